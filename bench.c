@@ -0,0 +1,580 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  bench - microbenchmarks for the library.
+ *
+ *  Usage: bench [-d seconds] [-n timers] [-s] [-S spin_ns]
+ *
+ *  Each benchmark prints one line of JSON to stdout, with the number of
+ *  operations, the rate, and the 50th, 99th and 99.9th percentiles of the
+ *  latency of one operation in nanoseconds. Progress messages go to stderr.
+ *  Run it with 'make benchmark'.
+ *
+ *  With -s, it runs one workload with 1, 2, 4 and more worker and poller
+ *  threads instead, and reports how the throughput scales and how long the
+ *  threads waited for the main locks. Run it with 'make scaling'.
+ *
+ *  -S sets pnotify_spin_limit(), to compare the latency of sleeping and
+ *  spinning workers.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pnotify.h"
+
+/** The largest number of latency samples kept by one benchmark */
+#define MAX_SAMPLES	(1 << 20)
+
+/** The latency samples of the running benchmark */
+static uint64_t *SAMPLE;
+static size_t NSAMPLES;
+
+/** The number of operations completed by the running benchmark */
+static uint64_t OPS;
+
+/** How long each of the fd and signal benchmarks runs, in seconds */
+static double DURATION = 1.0;
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "clock_gettime(2)");
+
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+
+/* Record the latency of one operation; callable from any thread */
+static void
+sample(uint64_t ns)
+{
+	size_t i;
+
+	(void) __atomic_add_fetch(&OPS, 1, __ATOMIC_RELAXED);
+	i = __atomic_fetch_add(&NSAMPLES, 1, __ATOMIC_RELAXED);
+	if (i < MAX_SAMPLES)
+		SAMPLE[i] = ns;
+}
+
+
+static void
+reset(void)
+{
+	__atomic_store_n(&OPS, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&NSAMPLES, 0, __ATOMIC_SEQ_CST);
+}
+
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+static uint64_t
+percentile(size_t n, double pct)
+{
+	size_t i;
+
+	if (n == 0)
+		return 0;
+	i = (size_t) (pct / 100 * n);
+	return SAMPLE[MIN(i, n - 1)];
+}
+
+
+/* Print the result of a benchmark that ran for @a ns nanoseconds */
+static void
+report(const char *name, unsigned long param, uint64_t ns)
+{
+	size_t n = MIN(__atomic_load_n(&NSAMPLES, __ATOMIC_SEQ_CST), MAX_SAMPLES);
+	uint64_t ops = __atomic_load_n(&OPS, __ATOMIC_SEQ_CST);
+	double sec = ns / 1e9;
+
+	qsort(SAMPLE, n, sizeof(*SAMPLE), u64_cmp);
+	printf("{\"bench\":\"%s\",\"n\":%lu,\"ops\":%llu,\"sec\":%.6f,"
+			"\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+			"\"p999_ns\":%llu}\n",
+			name, param, (unsigned long long) ops, sec,
+			(sec > 0) ? ops / sec : 0.0,
+			(unsigned long long) percentile(n, 50),
+			(unsigned long long) percentile(n, 99),
+			(unsigned long long) percentile(n, 99.9));
+	fflush(stdout);
+}
+
+
+/*
+ * fd events: each socketpair has one message in flight. The message is the
+ * time it was sent, and the callback answers it with a new one.
+ */
+
+static volatile int FD_STOP;
+
+static void
+fd_send(int fd)
+{
+	uint64_t t = now_ns();
+
+	if (write(fd, &t, sizeof(t)) != sizeof(t))
+		err(1, "write(2)");
+}
+
+
+static void
+fd_cb(int fd, int mask, void *arg)
+{
+	int peer = (int) (intptr_t) arg;
+	uint64_t t;
+
+	if (!(mask & PN_READ))
+		return;
+	while (read(fd, &t, sizeof(t)) == sizeof(t)) {
+		sample(now_ns() - t);
+		if (!FD_STOP)
+			fd_send(peer);
+	}
+}
+
+
+static void
+bench_fd(unsigned int npairs)
+{
+	struct watch **w;
+	int (*sv)[2];
+	uint64_t start;
+	unsigned int i;
+
+	if ((sv = calloc(npairs, sizeof(*sv))) == NULL ||
+			(w = calloc(npairs, sizeof(*w))) == NULL)
+		err(1, "calloc(3)");
+	for (i = 0; i < npairs; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) < 0)
+			err(1, "socketpair(2)");
+		(void) fcntl(sv[i][1], F_SETFL, O_NONBLOCK);
+		if ((w[i] = watch_fd(sv[i][1], fd_cb, (void *) (intptr_t) sv[i][0])) == NULL)
+			err(1, "watch_fd()");
+	}
+
+	FD_STOP = 0;
+	reset();
+	start = now_ns();
+	for (i = 0; i < npairs; i++)
+		fd_send(sv[i][0]);
+	while (now_ns() - start < DURATION * 1e9)
+		usleep(10000);
+	report("fd", npairs, now_ns() - start);
+
+	/* Let the messages in flight drain before closing */
+	FD_STOP = 1;
+	usleep(100000);
+	for (i = 0; i < npairs; i++) {
+		(void) watch_cancel(w[i]);
+		(void) close(sv[i][0]);
+		(void) close(sv[i][1]);
+	}
+	free(sv);
+}
+
+
+/*
+ * Timers: the time to start and to cancel one timer, and how late the
+ * callbacks run when all of the timers expire together.
+ */
+
+static uint64_t TIMER_DEADLINE;
+static uint64_t TIMER_LAST;
+
+static void
+timer_cb(void *arg)
+{
+	uint64_t t = now_ns();
+
+	sample((t > TIMER_DEADLINE) ? t - TIMER_DEADLINE : 0);
+	__atomic_store_n(&TIMER_LAST, t, __ATOMIC_RELAXED);
+}
+
+
+static void
+bench_timer(unsigned long count)
+{
+	struct watch **w;
+	uint64_t start, t;
+	unsigned long i;
+
+	if ((w = calloc(count, sizeof(*w))) == NULL)
+		err(1, "calloc(3)");
+
+	reset();
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		t = now_ns();
+		if ((w[i] = watch_timer(3600, timer_cb, NULL)) == NULL)
+			err(1, "watch_timer()");
+		sample(now_ns() - t);
+	}
+	report("timer_insert", count, now_ns() - start);
+
+	reset();
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		t = now_ns();
+		(void) watch_cancel(w[i]);
+		sample(now_ns() - t);
+		free(w[i]);
+	}
+	report("timer_cancel", count, now_ns() - start);
+
+	/* The latency is measured from the earliest possible expiry */
+	reset();
+	TIMER_DEADLINE = now_ns() + 1000000000;
+	for (i = 0; i < count; i++) {
+		if ((w[i] = watch_timer(1, timer_cb, NULL)) == NULL)
+			err(1, "watch_timer()");
+	}
+	start = MAX(now_ns(), TIMER_DEADLINE);
+	while (__atomic_load_n(&OPS, __ATOMIC_RELAXED) < count &&
+			now_ns() < start + (uint64_t) 60 * 1000000000)
+		usleep(1000);
+	t = __atomic_load_n(&TIMER_LAST, __ATOMIC_RELAXED);
+	report("timer_expire", count, (t > start) ? t - start : 1);
+
+	free(w);
+}
+
+
+/*
+ * Signals: one signal at a time is sent to the process, and the next is
+ * sent when the callback for the previous one has run.
+ */
+
+static uint64_t SIGNAL_SEQ;
+
+static void
+signal_cb(int signum, void *arg)
+{
+	(void) __atomic_add_fetch(&SIGNAL_SEQ, 1, __ATOMIC_RELEASE);
+}
+
+
+static void
+bench_signal(void)
+{
+	struct watch *w;
+	uint64_t start, t, seq;
+
+	if ((w = watch_signal(SIGUSR2, signal_cb, NULL)) == NULL)
+		err(1, "watch_signal()");
+
+	reset();
+	start = now_ns();
+	while (now_ns() - start < DURATION * 1e9) {
+		seq = __atomic_load_n(&SIGNAL_SEQ, __ATOMIC_ACQUIRE);
+		t = now_ns();
+		if (kill(getpid(), SIGUSR2) < 0)
+			err(1, "kill(2)");
+		while (__atomic_load_n(&SIGNAL_SEQ, __ATOMIC_ACQUIRE) == seq)
+			sched_yield();
+		sample(now_ns() - t);
+	}
+	report("signal", 1, now_ns() - start);
+
+	(void) watch_cancel(w);
+}
+
+
+/*
+ * Watch registration: adding and cancelling a watch on the read end of a
+ * pipe, which never becomes ready.
+ */
+
+static void
+watch_cb(int fd, int mask, void *arg)
+{
+}
+
+
+static void
+bench_watch(unsigned long count)
+{
+	struct watch **w;
+	uint64_t start, t;
+	unsigned long i;
+	int fd[2];
+
+	if (pipe(fd) < 0)
+		err(1, "pipe(2)");
+	if ((w = calloc(count, sizeof(*w))) == NULL)
+		err(1, "calloc(3)");
+
+	reset();
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		t = now_ns();
+		if ((w[i] = watch_fd(fd[0], watch_cb, NULL)) == NULL)
+			err(1, "watch_fd()");
+		sample(now_ns() - t);
+
+		/* An fd can only be in the epoll set once */
+		(void) watch_cancel(w[i]);
+		free(w[i]);
+	}
+	report("watch_add_cancel", count, now_ns() - start);
+
+	(void) close(fd[0]);
+	(void) close(fd[1]);
+	free(w);
+}
+
+
+/*
+ * Scaling: the fd workload over many socketpairs, with every 16th message
+ * also starting and cancelling a timer, so that the watch list and the
+ * timer heap are used as well as the event queue. Each thread count runs
+ * in a child process, because the threads are created by pnotify_init().
+ */
+
+#define SCALE_PAIRS	256
+
+/** The result of one run, sent from the child to the parent */
+struct scale_result {
+	uint64_t ops;
+	uint64_t ns;
+	uint64_t mutex_waits[PN_MUTEX_COUNT];
+	uint64_t mutex_wait_ns[PN_MUTEX_COUNT];
+};
+
+static void
+scale_cb(int fd, int mask, void *arg)
+{
+	int peer = (int) (intptr_t) arg;
+	struct watch *w;
+	uint64_t t, n;
+
+	if (!(mask & PN_READ))
+		return;
+	while (read(fd, &t, sizeof(t)) == sizeof(t)) {
+		n = __atomic_add_fetch(&OPS, 1, __ATOMIC_RELAXED);
+		if (n % 16 == 0 && (w = watch_timer(3600, timer_cb, NULL)) != NULL) {
+			(void) watch_cancel(w);
+			free(w);
+		}
+		if (!FD_STOP)
+			fd_send(peer);
+	}
+}
+
+
+static void
+scale_child(int out)
+{
+	struct pnotify_stats *st;
+	struct scale_result res;
+	int sv[SCALE_PAIRS][2];
+	uint64_t start;
+	unsigned int i;
+
+	pnotify_init();
+
+	for (i = 0; i < SCALE_PAIRS; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) < 0)
+			err(1, "socketpair(2)");
+		(void) fcntl(sv[i][1], F_SETFL, O_NONBLOCK);
+		if (watch_fd(sv[i][1], scale_cb, (void *) (intptr_t) sv[i][0]) == NULL)
+			err(1, "watch_fd()");
+	}
+
+	start = now_ns();
+	for (i = 0; i < SCALE_PAIRS; i++)
+		fd_send(sv[i][0]);
+	while (now_ns() - start < DURATION * 1e9)
+		usleep(10000);
+
+	memset(&res, 0, sizeof(res));
+	res.ops = __atomic_load_n(&OPS, __ATOMIC_SEQ_CST);
+	res.ns = now_ns() - start;
+	if ((st = malloc(sizeof(*st))) == NULL)
+		err(1, "malloc(3)");
+	if (pnotify_stats(st) < 0)
+		err(1, "pnotify_stats()");
+	memcpy(res.mutex_waits, st->mutex_waits, sizeof(res.mutex_waits));
+	memcpy(res.mutex_wait_ns, st->mutex_wait_ns, sizeof(res.mutex_wait_ns));
+	if (write(out, &res, sizeof(res)) != sizeof(res))
+		err(1, "write(2)");
+	_exit(0);
+}
+
+
+/* Run the workload in a child with the given thread counts */
+static void
+scale_run(unsigned int workers, unsigned int pollers, struct scale_result *res,
+		double *cpu_sec)
+{
+	struct rusage ru;
+	char buf[16];
+	pid_t pid;
+	int fd[2], status;
+
+	if (pipe(fd) < 0)
+		err(1, "pipe(2)");
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		err(1, "fork(2)");
+	if (pid == 0) {
+		(void) close(fd[0]);
+		snprintf(buf, sizeof(buf), "%u", workers);
+		(void) setenv("PNOTIFY_WORKERS", buf, 1);
+		snprintf(buf, sizeof(buf), "%u", pollers);
+		(void) setenv("PNOTIFY_POLLERS", buf, 1);
+		scale_child(fd[1]);
+	}
+
+	(void) close(fd[1]);
+	if (read(fd[0], res, sizeof(*res)) != sizeof(*res))
+		errx(1, "the benchmark with %u workers failed", workers);
+	(void) close(fd[0]);
+	if (wait4(pid, &status, 0, &ru) < 0)
+		err(1, "wait4(2)");
+	*cpu_sec = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+
+static void
+bench_scaling(void)
+{
+	static const char *lock[] = { "event", "watch", "timer" };
+	struct scale_result res;
+	double base[2] = { 0, 0 }, rate, cpu, eff;
+	unsigned int max, n, pollers, mode, i;
+	long ncpu;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	max = MAX(4, (ncpu > 0) ? ncpu : 1);
+
+	/* First only the workers are added, then pollers as well */
+	for (mode = 0; mode < 2; mode++) {
+		for (n = 1; n <= max; n *= 2) {
+			pollers = (mode == 0) ? 1 : n;
+			fprintf(stderr, "%u workers, %u pollers..\n", n, pollers);
+			scale_run(n, pollers, &res, &cpu);
+
+			rate = res.ops / (res.ns / 1e9);
+			if (n == 1)
+				base[mode] = rate;
+			eff = (base[mode] > 0) ? rate / base[mode] / n : 0;
+			printf("{\"bench\":\"scaling\",\"workers\":%u,\"pollers\":%u,"
+					"\"cpus\":%ld,\"ops\":%llu,\"ops_per_sec\":%.0f,"
+					"\"ops_per_cpu_sec\":%.0f,\"speedup\":%.3f,"
+					"\"efficiency\":%.3f",
+					n, pollers, ncpu, (unsigned long long) res.ops, rate,
+					(cpu > 0) ? res.ops / cpu : 0.0,
+					(base[mode] > 0) ? rate / base[mode] : 0.0, eff);
+			for (i = 0; i < 3; i++) {
+				printf(",\"%s_waits\":%llu,\"%s_wait_ns\":%llu,"
+						"\"%s_wait_ns_per_op\":%.1f",
+						lock[i], (unsigned long long) res.mutex_waits[i],
+						lock[i], (unsigned long long) res.mutex_wait_ns[i],
+						lock[i], (res.ops > 0) ?
+						(double) res.mutex_wait_ns[i] / res.ops : 0.0);
+			}
+			printf("}\n");
+			fprintf(stderr, "  %.0f ops/sec, scaling efficiency %.0f%%\n",
+					rate, eff * 100);
+			fflush(stdout);
+		}
+	}
+}
+
+
+int
+main(int argc, char **argv)
+{
+	static const unsigned int pairs[] = { 1, 64, 1024 };
+	unsigned long count, max_timers = 1000000;
+	uint64_t spin = 0;
+	unsigned int i;
+	int c, scaling = 0;
+
+	while ((c = getopt(argc, argv, "d:n:sS:")) != -1) {
+		switch (c) {
+		case 'd':
+			DURATION = atof(optarg);
+			break;
+		case 'n':
+			max_timers = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			scaling = 1;
+			break;
+		case 'S':
+			spin = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: bench [-d seconds] [-n timers] [-s] "
+					"[-S spin_ns]\n");
+			exit(1);
+		}
+	}
+
+	if ((SAMPLE = calloc(MAX_SAMPLES, sizeof(*SAMPLE))) == NULL)
+		err(1, "calloc(3)");
+	if (scaling) {
+		bench_scaling();
+		exit(0);
+	}
+	pnotify_init();
+	if (pnotify_spin_limit(spin) < 0)
+		err(1, "pnotify_spin_limit()");
+
+	for (i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+		fprintf(stderr, "fd events over %u socketpairs..\n", pairs[i]);
+		bench_fd(pairs[i]);
+	}
+	for (count = 1000; count <= max_timers; count *= 10) {
+		fprintf(stderr, "%lu timers..\n", count);
+		bench_timer(count);
+	}
+	fprintf(stderr, "signals..\n");
+	bench_signal();
+	fprintf(stderr, "watch registration..\n");
+	bench_watch(100000);
+
+	exit(0);
+}
@@ -34,6 +34,7 @@
 
 /* Forward declarations */
 void bsd_dump_kevent(struct kevent *kev);
+int bsd_add_watch(struct watch *watch);
 
 /** The file descriptor returned by kqueue(2) */
 static int KQUEUE_FD;
@@ -58,6 +59,78 @@ bsd_handle_fd_event(struct watch *watch, struct kevent *kev)
 }
 
 
+static void
+bsd_handle_vnode_event(struct watch *watch, struct kevent *kev)
+{
+	int mask = 0;
+
+	/* An event on the directory means that a file was added or removed */
+	if (kev->ident == watch->wfd) {
+		pn_event_add(watch, PN_CREATE);
+		return;
+	}
+
+	if (kev->fflags & (NOTE_WRITE | NOTE_EXTEND))
+		mask |= PN_MODIFY;
+	if (kev->fflags & NOTE_TRUNCATE)
+		mask |= PN_MODIFY;
+	if (kev->fflags & NOTE_RENAME)
+		mask |= PN_RENAME;
+	if (kev->fflags & NOTE_DELETE)
+		mask |= PN_DELETE;
+
+	pn_event_add(watch, mask);
+}
+
+
+/* Watch a tailed file and the directory that contains it */
+static int
+bsd_add_tail_watch(struct watch *watch)
+{
+	struct pn_tail *t = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+	struct kevent kev[2];
+	char dir[PATH_MAX];
+	const char *name;
+	int n = 0;
+
+	/* The watch was cancelled while the file was being reopened */
+	if (t == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Called again after the file is rotated */
+	if (watch->wfd <= 0) {
+		if ((name = strrchr(watch->path, '/')) == NULL)
+			(void) strcpy(dir, ".");
+		else if (name == watch->path)
+			(void) strcpy(dir, "/");
+		else
+			(void) snprintf(dir, sizeof(dir), "%.*s",
+					(int) (name - watch->path), watch->path);
+		if ((watch->wfd = open(dir, O_RDONLY)) < 0) {
+			warn("open(2) of `%s'", dir);
+			return -1;
+		}
+		EV_SET(&kev[n++], watch->wfd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+				NOTE_WRITE, 0, watch);
+	}
+
+	if (t->fd >= 0) {
+		EV_SET(&kev[n++], t->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+				NOTE_WRITE | NOTE_EXTEND | NOTE_TRUNCATE |
+				NOTE_DELETE | NOTE_RENAME, 0, watch);
+	}
+
+	if (kevent(KQUEUE_FD, kev, n, NULL, 0, NULL) < 0) {
+		perror("kevent(2)");
+		return -1;
+	}
+
+	return 0;
+}
+
+
 void *
 bsd_kqueue_loop()
 {
@@ -68,22 +141,41 @@ bsd_kqueue_loop()
 	/* Loop forever waiting for events */
 	for (;;) {
 
+		/* Nothing from the previous batch is in use any more */
+		pn_poller_quiescent();
+
+		/* Leave the events in the kernel while the queue is full */
+		pn_event_throttle();
+
 		/* Wait for an event */
 		dprintf("waiting for kernel event..\n");
 		rc = kevent(KQUEUE_FD, NULL, 0, &kev, 1, NULL);
 		if (rc < 0) 
 			err(1, "kqueue_loop: kevent(2) failed");
+		pn_hist_record(&PN_STATS()->poll_batch, rc);
 
 		bsd_dump_kevent(&kev);
 
 		/* Find the matching watch structure */
 		watch = (struct watch *) kev.udata;
+		PN_TRACE(PN_TRACE_READY, watch, NULL, kev.fflags);
 
 		/* Handle the event */
 		switch (watch->type) {
 			case WATCH_FD:
+			case WATCH_BUFFER:
+			case WATCH_FORWARD:
+			case WATCH_LISTEN:
+			case WATCH_DATAGRAM:
 				bsd_handle_fd_event(watch, &kev);
 				break;
+			case WATCH_TAIL:
+				bsd_handle_vnode_event(watch, &kev);
+				break;
+			case WATCH_PROC:
+				/* The child exited; it is reaped by a worker */
+				pn_event_add(watch, PN_CLOSE);
+				break;
 			default:
 				errx(1, "invalid watch type %d", watch->type);
 		}
@@ -98,14 +190,17 @@ void
 bsd_init_once(void)
 {
 	pthread_t tid;
+	unsigned int i;
 
 	/* Create a kqueue descriptor */
 	if ((KQUEUE_FD = kqueue()) < 0)
 		err(1, "kqueue(2)");
 
-        /* Create a dedicated kqueue thread */
-	if (pthread_create( &tid, NULL, bsd_kqueue_loop, NULL ) != 0)
-		errx(1, "pthread_create(3) failed");
+        /* Create the kqueue threads, which all wait on the same descriptor */
+	for (i = 0; i < POLLER_COUNT; i++) {
+		if (pthread_create( &tid, NULL, bsd_kqueue_loop, NULL ) != 0)
+			errx(1, "pthread_create(3) failed");
+	}
 
 	/* TODO: push cleanup function */
 }
@@ -166,6 +261,16 @@ bsd_add_watch(struct watch *watch)
 			EV_SET(kev, watch->ident, 
 					EVFILT_READ | EVFILT_WRITE, 
 					EV_ONESHOT | EV_ADD | EV_CLEAR, 0, 0, watch);
+	} else if (watch->type == WATCH_BUFFER || watch->type == WATCH_LISTEN ||
+			watch->type == WATCH_DATAGRAM) {
+			/* Output is enabled by bsd_mod_watch() when there is some */
+			EV_SET(kev, watch->ident, EVFILT_READ, EV_ADD | EV_CLEAR,
+					0, 0, watch);
+	} else if (watch->type == WATCH_PROC) {
+			EV_SET(kev, watch->ident, EVFILT_PROC, EV_ADD | EV_ONESHOT,
+					NOTE_EXIT, 0, watch);
+	} else if (watch->type == WATCH_TAIL) {
+			return bsd_add_tail_watch(watch);
 	} else {
 			return 0;
 	}
@@ -180,9 +285,29 @@ bsd_add_watch(struct watch *watch)
 }
 
 
+int bsd_mod_watch(struct watch *watch, int mask);
+
 int
 bsd_rm_watch(struct watch *watch)
 {
+	struct kevent kev;
+
+	/* The descriptor belongs to the caller, so only the kevents are deleted */
+	if (watch->type == WATCH_BUFFER || watch->type == WATCH_FORWARD ||
+			watch->type == WATCH_LISTEN || watch->type == WATCH_DATAGRAM)
+		return bsd_mod_watch(watch, 0);
+
+	/* Posts are added to the event queue directly */
+	if (watch->type == WATCH_USER)
+		return 0;
+
+	/* The kevent is already gone if the child has exited */
+	if (watch->type == WATCH_PROC) {
+		EV_SET(&kev, watch->ident, EVFILT_PROC, EV_DELETE, 0, 0, watch);
+		(void) kevent(KQUEUE_FD, &kev, 1, NULL, 0, NULL);
+		return 0;
+	}
+
 	/* Close the file descriptor.
 	  The kernel will automatically delete the kevent 
 	  and any pending events.
@@ -196,11 +321,49 @@ bsd_rm_watch(struct watch *watch)
 }
 
 
+/* Change the events that are reported for a descriptor */
+int
+bsd_mod_watch(struct watch *watch, int mask)
+{
+	struct kevent kev;
+	int i;
+
+	/* Each filter is changed separately, since deleting may fail */
+	for (i = 0; i < 2; i++) {
+		if (i == 0)
+			EV_SET(&kev, watch->ident, EVFILT_READ,
+					(mask & PN_READ) ? EV_ADD | EV_CLEAR : EV_DELETE,
+					0, 0, watch);
+		else
+			EV_SET(&kev, watch->ident, EVFILT_WRITE,
+					(mask & PN_WRITE) ? EV_ADD | EV_CLEAR : EV_DELETE,
+					0, 0, watch);
+		if (kevent(KQUEUE_FD, &kev, 1, NULL, 0, NULL) < 0 &&
+				!(errno == ENOENT && (kev.flags & EV_DELETE))) {
+			perror("kevent(2)");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* There is no eventfd, so a WATCH_USER post is queued directly */
+static void
+bsd_post(struct watch *watch)
+{
+	pn_event_add(watch, PN_READ);
+}
+
+
 const struct pnotify_vtable BSD_VTABLE = {
 	.init_once = bsd_init_once,
 	.add_watch = bsd_add_watch,
 	.rm_watch = bsd_rm_watch,
+	.mod_watch = bsd_mod_watch,
 	.cleanup = bsd_cleanup,
+	.post = bsd_post,
 };
 
 #endif
@@ -0,0 +1,453 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Buffered I/O on a file descriptor (WATCH_BUFFER).
+ *
+ *  When the descriptor is readable, the worker thread reads everything
+ *  that is available into a chain of fixed-size buffers with readv(2),
+ *  and then invokes the callback. Output is appended to a second chain,
+ *  and written with writev(2) when the descriptor becomes writable.
+ *  PN_WRITE is only enabled in the kernel event queue while there is
+ *  output waiting to be written.
+ *
+ *  Buffers are recycled through a small per-thread pool.
+ *
+ *  The input may instead be split into records; see frame.c.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The maximum number of buffers passed to readv(2) or writev(2) */
+#define BUFFER_IOV	64
+
+/** The maximum number of buffers kept in each thread's pool */
+#define BUFFER_POOL_MAX	256
+
+/** Free buffers owned by the current thread */
+static __thread struct pn_buffer_chain BUFFER_POOL;
+static __thread size_t BUFFER_POOL_COUNT;
+
+
+/**
+ * Get an empty buffer from the pool.
+ */
+struct pn_buffer *
+pn_buffer_alloc(void)
+{
+	struct pn_buffer *buf;
+
+	if (BUFFER_POOL_COUNT == 0) {
+		if ((buf = malloc(sizeof(*buf))) == NULL)
+			err(1, "malloc(3)");
+	} else {
+		buf = STAILQ_FIRST(&BUFFER_POOL);
+		STAILQ_REMOVE_HEAD(&BUFFER_POOL, entries);
+		BUFFER_POOL_COUNT--;
+	}
+	buf->pos = 0;
+	buf->len = 0;
+
+	return buf;
+}
+
+
+/**
+ * Return a buffer to the pool.
+ */
+void
+pn_buffer_free(struct pn_buffer *buf)
+{
+	if (BUFFER_POOL_COUNT >= BUFFER_POOL_MAX) {
+		free(buf);
+		return;
+	}
+	/* The pool is initialized when it is first used by each thread */
+	if (BUFFER_POOL_COUNT == 0)
+		STAILQ_INIT(&BUFFER_POOL);
+	STAILQ_INSERT_HEAD(&BUFFER_POOL, buf, entries);
+	BUFFER_POOL_COUNT++;
+}
+
+
+static void
+buffer_chain_free(struct pn_buffer_chain *chain)
+{
+	struct pn_buffer *buf;
+
+	while ((buf = STAILQ_FIRST(chain)) != NULL) {
+		STAILQ_REMOVE_HEAD(chain, entries);
+		pn_buffer_free(buf);
+	}
+}
+
+
+/* Enable or disable PN_WRITE. The caller must hold b->mtx. */
+static void
+buffer_want_write(struct watch *watch, struct pnotify_buffer *b, bool enable)
+{
+	if (b->want_write == enable)
+		return;
+	if (sys->mod_watch(watch, enable ? PN_READ | PN_WRITE : PN_READ) == 0)
+		b->want_write = enable;
+}
+
+
+/*
+ * Read everything that is available. The caller must hold b->mtx.
+ *
+ * If @a hangup is true, the remote end has closed the connection, so
+ * reading continues until end-of-file even after a short read.
+ *
+ * @return true if any data was read
+ */
+static bool
+buffer_fill(struct watch *watch, struct pnotify_buffer *b, bool hangup)
+{
+	struct pn_buffer *buf[BUFFER_IOV], *tail;
+	struct iovec iov[BUFFER_IOV];
+	size_t avail, len, left;
+	ssize_t n;
+	int i, cnt;
+	bool got = false;
+
+	while (!b->eof && b->error == 0) {
+		if (b->in_len >= PN_BUFFER_MAX_INPUT) {
+			b->throttled = true;
+			break;
+		}
+
+		/* Fill the unused space at the end of the last buffer first */
+		cnt = 0;
+		tail = STAILQ_LAST(&b->in, pn_buffer, entries);
+		if (tail != NULL && tail->len < PN_BUFFER_SIZE) {
+			iov[cnt].iov_base = tail->data + tail->len;
+			iov[cnt].iov_len = PN_BUFFER_SIZE - tail->len;
+			buf[cnt++] = tail;
+		}
+		avail = (cnt > 0) ? iov[0].iov_len : 0;
+		while (cnt < BUFFER_IOV && b->in_len + avail < PN_BUFFER_MAX_INPUT) {
+			buf[cnt] = pn_buffer_alloc();
+			iov[cnt].iov_base = buf[cnt]->data;
+			iov[cnt].iov_len = PN_BUFFER_SIZE;
+			avail += PN_BUFFER_SIZE;
+			cnt++;
+		}
+
+		n = readv(watch->ident, iov, cnt);
+		if (n == 0)
+			b->eof = true;
+		else if (n < 0 && errno != EINTR && errno != EAGAIN &&
+				errno != EWOULDBLOCK)
+			b->error = errno;
+
+		/* Keep the buffers that received data */
+		for (i = 0, left = (n > 0) ? n : 0; i < cnt; i++) {
+			len = MIN(left, iov[i].iov_len);
+			if (buf[i] == tail) {
+				tail->len += len;
+			} else if (len > 0) {
+				buf[i]->len = len;
+				STAILQ_INSERT_TAIL(&b->in, buf[i], entries);
+			} else {
+				pn_buffer_free(buf[i]);
+			}
+			left -= len;
+			b->in_len += len;
+		}
+		if (n > 0)
+			got = true;
+
+		/* A short read means that the descriptor has been drained */
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || ((size_t) n < avail && !hangup))
+			break;
+	}
+
+	return got;
+}
+
+
+/*
+ * Write as much output as possible. The caller must hold b->mtx.
+ *
+ * @return true if all of the output was written
+ */
+static bool
+buffer_flush(struct watch *watch, struct pnotify_buffer *b)
+{
+	struct pn_buffer *buf;
+	struct iovec iov[BUFFER_IOV];
+	ssize_t n;
+	size_t len;
+	int cnt;
+
+	while (b->out_len > 0 && b->error == 0) {
+		cnt = 0;
+		STAILQ_FOREACH(buf, &b->out, entries) {
+			if (cnt == BUFFER_IOV)
+				break;
+			iov[cnt].iov_base = buf->data + buf->pos;
+			iov[cnt].iov_len = buf->len - buf->pos;
+			cnt++;
+		}
+
+		if ((n = writev(watch->ident, iov, cnt)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				b->error = errno;
+			return false;
+		}
+
+		/* Release the buffers that were written */
+		b->out_len -= n;
+		while (n > 0 && (buf = STAILQ_FIRST(&b->out)) != NULL) {
+			len = MIN((size_t) n, buf->len - buf->pos);
+			buf->pos += len;
+			n -= len;
+			if (buf->pos == buf->len) {
+				STAILQ_REMOVE_HEAD(&b->out, entries);
+				pn_buffer_free(buf);
+			}
+		}
+	}
+
+	return (b->out_len == 0);
+}
+
+
+/* Free the state of a WATCH_BUFFER watch after the last reference is dropped */
+static void
+buffer_release(void *arg)
+{
+	struct pnotify_buffer *b = arg;
+
+	pn_ref_put(b->framing);
+	buffer_chain_free(&b->in);
+	buffer_chain_free(&b->out);
+	(void) pthread_mutex_destroy(&b->mtx);
+	free(b);
+}
+
+
+/**
+ * Create the buffers for a WATCH_BUFFER watch, and put the descriptor
+ * into non-blocking mode.
+ */
+int
+pn_buffer_open(struct watch *watch)
+{
+	struct pnotify_buffer *b;
+	int flags;
+
+	if ((flags = fcntl(watch->ident, F_GETFL)) < 0 ||
+			fcntl(watch->ident, F_SETFL, flags | O_NONBLOCK) < 0) {
+		warn("fcntl(2)");
+		return -1;
+	}
+	if ((b = calloc(1, sizeof(*b))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	STAILQ_INIT(&b->in);
+	STAILQ_INIT(&b->out);
+	if (pthread_mutex_init(&b->mtx, NULL) != 0) {
+		warn("pthread_mutex_init(3) failed");
+		free(b);
+		return -1;
+	}
+	pn_ref_init(&b->ref, buffer_release);
+	watch->priv = b;
+
+	return 0;
+}
+
+
+/**
+ * Handle an event for a WATCH_BUFFER watch.
+ *
+ * This is called by a worker thread instead of the callback.
+ */
+void
+pn_buffer_dispatch(struct watch *watch, int mask)
+{
+	struct pnotify_buffer *b = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+	struct pn_frame *f = NULL;
+	int umask = 0;
+	size_t nrec = 0;
+	bool eof, error, resume = false;
+
+	/* The watch has been cancelled; the event still holds the state */
+	if (b == NULL)
+		return;
+
+	MUTEX_LOCK(b->mtx);
+	eof = b->eof;
+	error = (b->error != 0);
+
+	if (mask & PN_WRITE) {
+		if (buffer_flush(watch, b) && b->want_write) {
+			buffer_want_write(watch, b, false);
+			umask |= PN_WRITE;
+		}
+	}
+	if (mask & (PN_READ | PN_CLOSE | PN_ERROR)) {
+		if (buffer_fill(watch, b, (mask & PN_CLOSE) != 0))
+			umask |= PN_READ;
+
+		/* Records are passed to the record callback instead */
+		if (b->framing != NULL) {
+			umask &= ~PN_READ;
+			nrec = pn_frame_collect(b, &f);
+			resume = (b->throttled && b->in_len < PN_BUFFER_MAX_INPUT);
+			if (resume)
+				b->throttled = false;
+		}
+	}
+
+	/* Report the end of the stream, or an error, only once */
+	if (b->eof && !eof)
+		umask |= PN_CLOSE;
+	if (b->error != 0 && !error)
+		umask |= PN_ERROR;
+
+	MUTEX_UNLOCK(b->mtx);
+
+	if (nrec > 0)
+		pn_frame_deliver(watch, f);
+	if (resume)
+		pn_event_add(watch, PN_READ);
+	if (umask != 0)
+		watch->cb(watch, umask, watch->arg);
+}
+
+
+/**
+ * Drop the reference of the watch to its buffers. They are freed once the
+ * queued events and any running dispatch are done with them.
+ */
+void
+pn_buffer_close(struct watch *watch)
+{
+	pn_ref_put(pn_ref_clear(&watch->priv));
+}
+
+
+size_t
+pnotify_buffer_length(struct watch *watch)
+{
+	struct pnotify_buffer *b;
+	size_t len;
+
+	if ((b = pn_ref_get(&watch->priv)) == NULL)
+		return 0;
+	MUTEX_LOCK(b->mtx);
+	len = b->in_len;
+	MUTEX_UNLOCK(b->mtx);
+	pn_ref_put(b);
+
+	return len;
+}
+
+
+size_t
+pnotify_buffer_read(struct watch *watch, void *buf, size_t len)
+{
+	struct pnotify_buffer *b;
+	struct pn_buffer *ent;
+	size_t n, total = 0;
+	bool resume;
+
+	if ((b = pn_ref_get(&watch->priv)) == NULL)
+		return 0;
+	MUTEX_LOCK(b->mtx);
+	while (total < len && (ent = STAILQ_FIRST(&b->in)) != NULL) {
+		n = MIN(len - total, ent->len - ent->pos);
+		memcpy((char *) buf + total, ent->data + ent->pos, n);
+		ent->pos += n;
+		total += n;
+		if (ent->pos == ent->len) {
+			STAILQ_REMOVE_HEAD(&b->in, entries);
+			pn_buffer_free(ent);
+		}
+	}
+	b->in_len -= total;
+
+	/* Start reading again once there is room */
+	resume = (b->throttled && b->in_len < PN_BUFFER_MAX_INPUT);
+	if (resume)
+		b->throttled = false;
+	MUTEX_UNLOCK(b->mtx);
+	pn_ref_put(b);
+
+	if (resume)
+		pn_event_add(watch, PN_READ);
+
+	return total;
+}
+
+
+int
+pnotify_buffer_write(struct watch *watch, const void *buf, size_t len)
+{
+	struct pnotify_buffer *b;
+	struct pn_buffer *tail;
+	size_t n;
+
+	/* The watch has been cancelled */
+	if ((b = pn_ref_get(&watch->priv)) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	MUTEX_LOCK(b->mtx);
+	if (b->error != 0) {
+		errno = b->error;
+		MUTEX_UNLOCK(b->mtx);
+		pn_ref_put(b);
+		return -1;
+	}
+
+	while (len > 0) {
+		tail = STAILQ_LAST(&b->out, pn_buffer, entries);
+		if (tail == NULL || tail->len == PN_BUFFER_SIZE) {
+			tail = pn_buffer_alloc();
+			STAILQ_INSERT_TAIL(&b->out, tail, entries);
+		}
+		n = MIN(len, PN_BUFFER_SIZE - tail->len);
+		memcpy(tail->data + tail->len, buf, n);
+		tail->len += n;
+		b->out_len += n;
+		buf = (const char *) buf + n;
+		len -= n;
+	}
+
+	/* The output is written when the descriptor becomes writable */
+	buffer_want_write(watch, b, true);
+	MUTEX_UNLOCK(b->mtx);
+	pn_ref_put(b);
+
+	return 0;
+}
@@ -0,0 +1,414 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Suppression of events for files whose contents did not change.
+ *
+ *  When a watch has checksums enabled, the worker thread that is about
+ *  to deliver a PN_MODIFY, PN_ATTRIB, PN_CREATE or PN_RENAME event for a
+ *  regular file computes the CRC-32C of the file, and drops the event if
+ *  the contents and permissions are the same as the last time the file
+ *  was seen. The CRC is computed with the SSE4.2 crc32 instruction when the
+ *  CPU has it, and with a lookup table otherwise.
+ *
+ *  The number of bytes hashed per second is limited by a token bucket.
+ *  When the limit is reached, events are delivered without being checked.
+ *  A file larger than the bucket is checked once the bucket is full, and
+ *  leaves it in debt, so that it is not skipped forever.
+ *
+ *  The state is reference counted (see ref.c), so that watch_checksum()
+ *  can turn checking off while a worker is filtering an event.
+ */
+
+#include <fcntl.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <cpuid.h>
+# include <nmmintrin.h>
+# define HAVE_SSE42_CRC 1
+#endif
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/**
+ * The size of the buffer used for pread(2).
+ *
+ * Files are not mapped into memory, because a file that is truncated
+ * while it is being hashed would raise SIGBUS.
+ */
+#define CSUM_CHUNK	(64 * 1024)
+
+/**
+ * The events that may be suppressed. A file that is atomically replaced
+ * by rename(2) generates PN_RENAME or PN_CREATE at the pathname.
+ */
+#define CSUM_EVENTS	(PN_MODIFY | PN_ATTRIB | PN_CREATE | PN_RENAME)
+
+/** The last known state of a file */
+struct pn_checksum_ent {
+	uint64_t ino;
+	int64_t  mtime;		/** The modification time, in nanoseconds */
+	int64_t  size;
+	uint32_t mode;
+	uid_t    uid;
+	gid_t    gid;
+	uint32_t crc;		/** The CRC-32C of the contents */
+};
+
+/** The checksum state of a watch */
+struct pn_checksum {
+
+	/** The reference count; each filter in progress holds a reference */
+	struct pn_ref ref;
+
+	/** The last known state of each file, keyed by pathname */
+	struct pn_hash files;
+
+	/** The maximum number of bytes to hash per second */
+	size_t rate;
+
+	/** The number of bytes that may be hashed without waiting; may be negative */
+	double tokens;
+
+	/** The time the token bucket was last refilled, in milliseconds */
+	uint64_t refilled;
+
+	/** A mutex to protect all of the above */
+	pthread_mutex_t mtx;
+};
+
+/** The CRC-32C polynomial, in reversed bit order */
+#define CRC32C_POLY	0x82f63b78
+
+static uint32_t CRC32C_TABLE[256];
+static bool HAVE_SSE42;
+
+
+static void
+crc32c_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		CRC32C_TABLE[i] = c;
+	}
+
+#if HAVE_SSE42_CRC
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+			HAVE_SSE42 = true;
+	}
+#endif
+}
+
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len-- > 0)
+		crc = CRC32C_TABLE[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+
+#if HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc, w;
+
+	/* Align to 8 bytes, then do 8 bytes per instruction */
+	while (len > 0 && ((uintptr_t) p & 7) != 0) {
+		c = _mm_crc32_u8((uint32_t) c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&w, p, sizeof(w));
+		c = _mm_crc32_u64(c, w);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		c = _mm_crc32_u8((uint32_t) c, *p++);
+
+	return (uint32_t) c;
+}
+#endif
+
+
+/**
+ * Compute the CRC-32C of a buffer.
+ *
+ * To checksum data in pieces, pass the result of the previous call
+ * as @a crc; the first call should pass zero.
+ */
+uint32_t
+pn_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	(void) pthread_once(&once, crc32c_init);
+
+	crc = ~crc;
+#if HAVE_SSE42_CRC
+	if (HAVE_SSE42)
+		return ~crc32c_sse42(crc, buf, len);
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
+
+
+/* Compute the CRC-32C of an open file */
+static int
+checksum_file(int fd, uint32_t *crc)
+{
+	off_t offset = 0;
+	ssize_t n;
+	char *p;
+
+	*crc = 0;
+	if ((p = malloc(CSUM_CHUNK)) == NULL) {
+		warn("malloc(3)");
+		return -1;
+	}
+	for (;;) {
+		n = pread(fd, p, CSUM_CHUNK, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		*crc = pn_crc32c(*crc, p, n);
+		offset += n;
+	}
+	free(p);
+
+	return (n < 0) ? -1 : 0;
+}
+
+
+/*
+ * Take tokens from the bucket. The caller must hold c->mtx.
+ *
+ * A file larger than the bucket is allowed once the bucket is full, and
+ * the bucket goes into debt, which is repaid before anything else is
+ * allowed.
+ */
+static bool
+checksum_allow(struct pn_checksum *c, size_t bytes)
+{
+	uint64_t now;
+
+	if (c->rate == SIZE_MAX)
+		return true;
+
+	now = pn_time_ms();
+	c->tokens += (double) c->rate * (now - c->refilled) / 1000;
+	if (c->tokens > c->rate)
+		c->tokens = c->rate;
+	c->refilled = now;
+
+	if (c->tokens < MIN(bytes, c->rate))
+		return false;
+	c->tokens -= bytes;
+
+	return true;
+}
+
+
+/* Check if a file has changed, while holding a reference to @a c */
+static bool
+checksum_check(struct pn_checksum *c, const char *path, int mask)
+{
+	struct pn_checksum_ent *ent, cur;
+	struct stat sb;
+	bool same;
+	int fd;
+
+	/* Only a regular file is opened, never a FIFO or a device */
+	if ((mask & ~CSUM_EVENTS) != 0 || lstat(path, &sb) < 0 ||
+			(S_ISREG(sb.st_mode) &&
+			 (fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK)) < 0)) {
+		/* A file that was deleted or renamed away is forgotten */
+		MUTEX_LOCK(c->mtx);
+		free(pn_hash_remove(&c->files, path, strlen(path)));
+		MUTEX_UNLOCK(c->mtx);
+		return true;
+	}
+	if (!S_ISREG(sb.st_mode))
+		return true;
+
+	/* The file may have been replaced since lstat(2) */
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		(void) close(fd);
+		return true;
+	}
+	memset(&cur, 0, sizeof(cur));
+	cur.ino = sb.st_ino;
+	cur.mtime = (int64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+	cur.size = sb.st_size;
+	cur.mode = sb.st_mode;
+	cur.uid = sb.st_uid;
+	cur.gid = sb.st_gid;
+
+	MUTEX_LOCK(c->mtx);
+	ent = pn_hash_lookup(&c->files, path, strlen(path));
+
+	/* If nothing that could change the contents changed, skip the hash */
+	if (ent != NULL && ent->ino == cur.ino && ent->size == cur.size &&
+			ent->mtime == cur.mtime) {
+		cur.crc = ent->crc;
+		goto compare;
+	}
+
+	/* Over the limit, deliver the event and forget the old checksum */
+	if (!checksum_allow(c, cur.size)) {
+		free(pn_hash_remove(&c->files, path, strlen(path)));
+		MUTEX_UNLOCK(c->mtx);
+		(void) close(fd);
+		return true;
+	}
+	MUTEX_UNLOCK(c->mtx);
+
+	if (checksum_file(fd, &cur.crc) < 0) {
+		(void) close(fd);
+		return true;
+	}
+
+	MUTEX_LOCK(c->mtx);
+	ent = pn_hash_lookup(&c->files, path, strlen(path));
+
+compare:
+	(void) close(fd);
+	same = (ent != NULL && ent->crc == cur.crc && ent->size == cur.size &&
+			ent->mode == cur.mode && ent->uid == cur.uid &&
+			ent->gid == cur.gid);
+
+	if (ent == NULL) {
+		if ((ent = malloc(sizeof(*ent))) == NULL)
+			err(1, "malloc(3)");
+		(void) pn_hash_insert(&c->files, path, strlen(path), ent);
+	}
+	*ent = cur;
+	MUTEX_UNLOCK(c->mtx);
+
+	return !same;
+}
+
+
+/**
+ * Check if a file has changed since the last event for it.
+ *
+ * @return false if the event should be dropped
+ */
+bool
+pn_checksum_filter(struct watch *watch, const char *path, int mask)
+{
+	struct pn_checksum *c;
+	bool rv;
+
+	/* Most watches do not have checksums, so avoid the lock */
+	if (path == NULL || __atomic_load_n(&watch->checksum, __ATOMIC_RELAXED) == NULL)
+		return true;
+
+	if ((c = pn_ref_get((void **) &watch->checksum)) == NULL)
+		return true;
+	rv = checksum_check(c, path, mask);
+	pn_ref_put(c);
+
+	return rv;
+}
+
+
+/* Free the state after the last reference is dropped */
+static void
+checksum_release(void *arg)
+{
+	struct pn_checksum *c = arg;
+
+	pn_hash_destroy(&c->files, free);
+	(void) pthread_mutex_destroy(&c->mtx);
+	free(c);
+}
+
+
+/**
+ * Turn off checking. The state is freed once any filter that is running
+ * has finished with it.
+ */
+void
+pn_checksum_cancel(struct watch *watch)
+{
+	pn_ref_put(pn_ref_clear((void **) &watch->checksum));
+}
+
+
+int
+watch_checksum(struct watch *watch, size_t rate)
+{
+	struct pn_checksum *c;
+
+	if (watch->type != WATCH_MOUNT && watch->type != WATCH_POLL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (rate == 0) {
+		pn_checksum_cancel(watch);
+		return 0;
+	}
+
+	/* Change the limit of an existing watch */
+	if ((c = pn_ref_get((void **) &watch->checksum)) != NULL) {
+		MUTEX_LOCK(c->mtx);
+		c->rate = rate;
+		MUTEX_UNLOCK(c->mtx);
+		pn_ref_put(c);
+		return 0;
+	}
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	pn_ref_init(&c->ref, checksum_release);
+	c->rate = rate;
+	c->tokens = (rate == SIZE_MAX) ? 0 : rate;
+	c->refilled = pn_time_ms();
+	if (pn_hash_init(&c->files, 0) != 0) {
+		free(c);
+		return -1;
+	}
+	if (pthread_mutex_init(&c->mtx, NULL) != 0) {
+		warn("pthread_mutex_init(3) failed");
+		pn_hash_destroy(&c->files, NULL);
+		free(c);
+		return -1;
+	}
+	__atomic_store_n(&watch->checksum, c, __ATOMIC_RELEASE);
+
+	return 0;
+}
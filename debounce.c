@@ -0,0 +1,256 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Coalescing of event storms.
+ *
+ *  When a watch has a debounce window, the first event for a pathname
+ *  starts an internal timer. Further events for the same pathname are
+ *  merged into the pending event until the timer expires, and then all
+ *  of the pending events are added to the event queue at once.
+ *
+ *  The state is reference counted (see ref.c). The watch, the timer while
+ *  a window is open, and each pn_debounce_add() that is running hold a
+ *  reference, so the state outlives a flush that is still delivering
+ *  events when the watch is cancelled.
+ */
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** A pending event, possibly the result of merging several events */
+struct pn_debounce_ent {
+	int   mask;		/** The union of all merged event masks */
+	char *path;		/** The pathname of the affected file, if any */
+	STAILQ_ENTRY(pn_debounce_ent) entries;
+};
+
+/** The debounce state of a watch */
+struct pn_debounce {
+
+	/** The reference count */
+	struct pn_ref ref;
+
+	/** The watch that owns this state */
+	struct watch *watch;
+
+	/** The length of the debounce window, in milliseconds */
+	unsigned int msec;
+
+	/** The pending events, keyed by pathname */
+	struct pn_hash pending;
+
+	/** The pending events, in the order they were first seen */
+	STAILQ_HEAD(, pn_debounce_ent) order;
+
+	/** The flush timer; non-NULL while a window is open */
+	struct timer *timer;
+
+	/** If true, coalescing has been turned off, and events bypass the state */
+	bool dead;
+
+	/** A mutex to protect all of the above */
+	pthread_mutex_t mtx;
+};
+
+
+/* Free the state after the last reference is dropped */
+static void
+debounce_release(void *arg)
+{
+	struct pn_debounce *d = arg;
+
+	pn_hash_destroy(&d->pending, NULL);
+	(void) pthread_mutex_destroy(&d->mtx);
+	free(d);
+}
+
+
+/*
+ * Add all pending events to the event queue. The caller must hold d->mtx,
+ * which is released while the events are added, and a reference.
+ */
+static void
+debounce_deliver(struct pn_debounce *d)
+{
+	STAILQ_HEAD(, pn_debounce_ent) ready;
+	struct pn_debounce_ent *ent;
+	struct watch *watch = d->watch;
+
+	STAILQ_INIT(&ready);
+	STAILQ_CONCAT(&ready, &d->order);
+	pn_hash_clear(&d->pending, NULL);
+	MUTEX_UNLOCK(d->mtx);
+
+	while ((ent = STAILQ_FIRST(&ready)) != NULL) {
+		STAILQ_REMOVE_HEAD(&ready, entries);
+		pn_event_enqueue(watch, ent->mask, ent->path);
+		free(ent->path);
+		free(ent);
+	}
+
+	MUTEX_LOCK(d->mtx);
+}
+
+
+/* Called by the timer thread at the end of each window */
+static void
+debounce_flush(void *arg)
+{
+	struct pn_debounce *d = arg;
+
+	MUTEX_LOCK(d->mtx);
+	d->timer = NULL;
+	debounce_deliver(d);
+	MUTEX_UNLOCK(d->mtx);
+
+	/* Drop the reference of the timer */
+	pn_ref_put(d);
+}
+
+
+/**
+ * Merge an event into the pending event for the same pathname.
+ *
+ * @return false if the watch is not coalescing events, so the caller
+ *   must add the event to the queue itself
+ */
+bool
+pn_debounce_add(struct watch *watch, int mask, const char *path)
+{
+	struct pn_debounce *d;
+	struct pn_debounce_ent *ent;
+	const char *key = (path != NULL) ? path : "";
+
+	/* Most watches do not coalesce, so avoid the lock */
+	if (__atomic_load_n(&watch->debounce, __ATOMIC_RELAXED) == NULL)
+		return false;
+	if ((d = pn_ref_get((void **) &watch->debounce)) == NULL)
+		return false;
+
+	MUTEX_LOCK(d->mtx);
+
+	/* Coalescing was turned off after the reference was taken */
+	if (d->dead) {
+		MUTEX_UNLOCK(d->mtx);
+		pn_ref_put(d);
+		return false;
+	}
+
+	if ((ent = pn_hash_lookup(&d->pending, key, strlen(key))) != NULL) {
+		ent->mask |= mask;
+		MUTEX_UNLOCK(d->mtx);
+		pn_ref_put(d);
+		return true;
+	}
+
+	if ((ent = calloc(1, sizeof(*ent))) == NULL)
+		err(1, "calloc(3)");
+	ent->mask = mask;
+	if (path != NULL && (ent->path = strdup(path)) == NULL)
+		err(1, "strdup(3)");
+	(void) pn_hash_insert(&d->pending, key, strlen(key), ent);
+	STAILQ_INSERT_TAIL(&d->order, ent, entries);
+
+	/* The first event opens a new window, and the timer holds a reference */
+	if (d->timer == NULL) {
+		pn_ref_hold(d);
+		if ((d->timer = pn_timer_start(d->msec, debounce_flush, d)) == NULL)
+			errx(1, "unable to start the debounce timer");
+	}
+
+	MUTEX_UNLOCK(d->mtx);
+	pn_ref_put(d);
+
+	return true;
+}
+
+
+/**
+ * Remove the debounce state from a watch.
+ *
+ * Any pending events are delivered immediately.
+ */
+void
+pn_debounce_cancel(struct watch *watch)
+{
+	struct pn_debounce *d;
+	bool stopped = false;
+
+	if ((d = pn_ref_clear((void **) &watch->debounce)) == NULL)
+		return;
+
+	MUTEX_LOCK(d->mtx);
+	d->dead = true;
+	if (d->timer != NULL && pn_timer_stop(d->timer) == 0) {
+		d->timer = NULL;
+		stopped = true;
+	}
+
+	/* A flush that is already running delivers whatever it has taken */
+	debounce_deliver(d);
+	MUTEX_UNLOCK(d->mtx);
+
+	if (stopped)
+		pn_ref_put(d);
+	pn_ref_put(d);
+}
+
+
+int
+watch_debounce(struct watch *watch, unsigned int msec)
+{
+	struct pn_debounce *d;
+
+	if (msec == 0) {
+		pn_debounce_cancel(watch);
+		return 0;
+	}
+
+	/* Change the length of an existing window */
+	if ((d = pn_ref_get((void **) &watch->debounce)) != NULL) {
+		MUTEX_LOCK(d->mtx);
+		d->msec = msec;
+		MUTEX_UNLOCK(d->mtx);
+		pn_ref_put(d);
+		return 0;
+	}
+
+	if ((d = calloc(1, sizeof(*d))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	pn_ref_init(&d->ref, debounce_release);
+	d->watch = watch;
+	d->msec = msec;
+	STAILQ_INIT(&d->order);
+	if (pn_hash_init(&d->pending, 0) != 0) {
+		free(d);
+		return -1;
+	}
+	if (pthread_mutex_init(&d->mtx, NULL) != 0) {
+		warn("pthread_mutex_init(3) failed");
+		pn_hash_destroy(&d->pending, NULL);
+		free(d);
+		return -1;
+	}
+	__atomic_store_n(&watch->debounce, d, __ATOMIC_RELEASE);
+
+	return 0;
+}
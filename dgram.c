@@ -0,0 +1,212 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Receiving and sending datagrams in batches (WATCH_DATAGRAM).
+ *
+ *  When the socket becomes readable, the worker thread receives up to
+ *  DGRAM_BATCH datagrams with a single recvmmsg(2) call, and passes all of
+ *  them to the callback at once. This is repeated until the socket has
+ *  been drained. Each worker thread has its own array of message slots,
+ *  which is allocated once and reused for every batch.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The maximum number of datagrams received or sent by one system call */
+#define DGRAM_BATCH	64
+
+/** The size of each message slot; longer datagrams are truncated */
+#define DGRAM_SLOT	2048
+
+/** The number of batches received before letting other events run */
+#define DGRAM_ROUNDS	16
+
+/** The message slots owned by a worker thread */
+struct dgram_slots {
+#if defined(__linux__)
+	struct mmsghdr msg[DGRAM_BATCH];
+#else
+	struct msghdr msg[DGRAM_BATCH];
+#endif
+	struct iovec iov[DGRAM_BATCH];
+	struct sockaddr_storage addr[DGRAM_BATCH];
+	struct pn_datagram dgram[DGRAM_BATCH];
+	char data[DGRAM_BATCH][DGRAM_SLOT];
+};
+
+static __thread struct dgram_slots *DGRAM_SLOTS;
+
+
+/* Get the slots of the current thread, and make them ready to receive into */
+static struct dgram_slots *
+dgram_slots(void)
+{
+	struct dgram_slots *s = DGRAM_SLOTS;
+	struct msghdr *hdr;
+	int i;
+
+	if (s == NULL && (s = DGRAM_SLOTS = malloc(sizeof(*s))) == NULL)
+		err(1, "malloc(3)");
+
+	for (i = 0; i < DGRAM_BATCH; i++) {
+#if defined(__linux__)
+		hdr = &s->msg[i].msg_hdr;
+#else
+		hdr = &s->msg[i];
+#endif
+		memset(hdr, 0, sizeof(*hdr));
+		s->iov[i].iov_base = s->data[i];
+		s->iov[i].iov_len = DGRAM_SLOT;
+		hdr->msg_name = &s->addr[i];
+		hdr->msg_namelen = sizeof(s->addr[i]);
+		hdr->msg_iov = &s->iov[i];
+		hdr->msg_iovlen = 1;
+	}
+
+	return s;
+}
+
+
+/* Receive a batch of datagrams. Returns the number received, or -1. */
+static int
+dgram_recv(int fd, struct dgram_slots *s)
+{
+#if defined(__linux__)
+	int i, n;
+
+	if ((n = recvmmsg(fd, s->msg, DGRAM_BATCH, MSG_DONTWAIT, NULL)) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		s->dgram[i].data = s->data[i];
+		s->dgram[i].len = MIN(s->msg[i].msg_len, DGRAM_SLOT);
+		s->dgram[i].addr = (struct sockaddr *) &s->addr[i];
+		s->dgram[i].addrlen = s->msg[i].msg_hdr.msg_namelen;
+		s->dgram[i].flags = s->msg[i].msg_hdr.msg_flags;
+	}
+
+	return n;
+#else
+	ssize_t len;
+	int n;
+
+	for (n = 0; n < DGRAM_BATCH; n++) {
+		if ((len = recvmsg(fd, &s->msg[n], MSG_DONTWAIT)) < 0)
+			return (n > 0) ? n : -1;
+		s->dgram[n].data = s->data[n];
+		s->dgram[n].len = len;
+		s->dgram[n].addr = (struct sockaddr *) &s->addr[n];
+		s->dgram[n].addrlen = s->msg[n].msg_namelen;
+		s->dgram[n].flags = s->msg[n].msg_flags;
+	}
+
+	return n;
+#endif
+}
+
+
+/**
+ * Handle an event for a WATCH_DATAGRAM watch.
+ *
+ * This is called by a worker thread instead of the callback.
+ */
+void
+pn_dgram_dispatch(struct watch *watch, int mask)
+{
+	void (*cb)(struct watch *, const struct pn_datagram *, size_t, void *) = watch->cb;
+	struct dgram_slots *s;
+	int n, round;
+
+	for (round = 0; round < DGRAM_ROUNDS; round++) {
+		s = dgram_slots();
+		if ((n = dgram_recv(watch->ident, s)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				warn("recvmmsg(2)");
+			return;
+		}
+		if (n > 0)
+			cb(watch, s->dgram, n, watch->arg);
+
+		/* A partial batch means that the socket has been drained */
+		if (n < DGRAM_BATCH)
+			return;
+	}
+
+	/* Give other watches a turn, and continue later */
+	pn_event_add(watch, PN_READ);
+}
+
+
+int
+pnotify_datagram_send(struct watch *watch, const struct pn_datagram *dgram, size_t count)
+{
+#if defined(__linux__)
+	struct mmsghdr msg[DGRAM_BATCH];
+	struct iovec iov[DGRAM_BATCH];
+#endif
+	size_t i, batch, sent = 0;
+	int n;
+
+	while (sent < count) {
+		batch = MIN(count - sent, DGRAM_BATCH);
+#if defined(__linux__)
+		memset(msg, 0, batch * sizeof(msg[0]));
+		for (i = 0; i < batch; i++) {
+			iov[i].iov_base = (void *) dgram[sent + i].data;
+			iov[i].iov_len = dgram[sent + i].len;
+			msg[i].msg_hdr.msg_name = (void *) dgram[sent + i].addr;
+			msg[i].msg_hdr.msg_namelen = dgram[sent + i].addrlen;
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = sendmmsg(watch->ident, msg, batch, MSG_DONTWAIT);
+#else
+		for (i = 0, n = 0; i < batch; i++, n++) {
+			if (sendto(watch->ident, dgram[sent + i].data,
+						dgram[sent + i].len, MSG_DONTWAIT,
+						dgram[sent + i].addr,
+						dgram[sent + i].addrlen) < 0) {
+				if (n == 0)
+					n = -1;
+				break;
+			}
+		}
+#endif
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		sent += n;
+
+		/* The socket buffer is full */
+		if ((size_t) n < batch)
+			break;
+	}
+
+	return (sent > 0 || count == 0) ? (int) sent : -1;
+}
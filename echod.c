@@ -0,0 +1,274 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  echod - an example echo server built on watch_fd().
+ *
+ *  Usage: echod [-p port | -u path]
+ *
+ *  The listening socket and every connection have a watch_fd() watch.
+ *  Events for a descriptor can be delivered to two worker threads at once,
+ *  so each connection has a counter of the events that have arrived for
+ *  it: the worker that raises it from zero echoes until the counter shows
+ *  that no more events arrived in the meantime, and the others return at
+ *  once. This keeps the bytes of a connection in order.
+ *
+ *  It is the server side of the load test run by 'make echo-load'; see
+ *  loadgen.c.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "pnotify.h"
+
+/** A client connection */
+struct conn {
+	int fd;
+	struct watch *watch;
+
+	/** The number of events that have not yet been handled */
+	unsigned int busy;
+};
+
+
+static void
+set_nonblock(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+			fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		err(1, "fcntl(2)");
+}
+
+
+/* Write all of a buffer to a non-blocking socket */
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) > 0) {
+			buf += n;
+			len -= n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		/* The client is not reading fast enough */
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		(void) poll(&pfd, 1, 1000);
+	}
+
+	return 0;
+}
+
+
+/* Echo everything that can be read. Returns -1 when the connection is done. */
+static int
+echo(struct conn *c)
+{
+	char buf[16384];
+	ssize_t n;
+
+	for (;;) {
+		if ((n = read(c->fd, buf, sizeof(buf))) > 0) {
+			if (write_all(c->fd, buf, n) < 0)
+				return -1;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		return -1;
+	}
+}
+
+
+/* Echo until no more events have arrived. The caller has raised the counter. */
+static void
+conn_run(struct conn *c)
+{
+	unsigned int seen;
+
+	do {
+		seen = __atomic_load_n(&c->busy, __ATOMIC_ACQUIRE);
+		if (echo(c) < 0) {
+			(void) watch_cancel(c->watch);
+			(void) close(c->fd);
+
+			/*
+			 * Events may still be queued for the watch, so the
+			 * connection is not freed, and they will find the
+			 * counter raised.
+			 */
+			return;
+		}
+	} while (__atomic_sub_fetch(&c->busy, seen, __ATOMIC_ACQ_REL) != 0);
+}
+
+
+static void
+conn_cb(int fd, int mask, void *arg)
+{
+	struct conn *c = arg;
+
+	/* Another worker is already echoing, and will see this event */
+	if (__atomic_fetch_add(&c->busy, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	conn_run(c);
+}
+
+
+static void
+accept_cb(int lfd, int mask, void *arg)
+{
+	struct conn *c;
+	int fd, on = 1;
+
+	if (!(mask & PN_READ))
+		return;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		set_nonblock(fd);
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if ((c = calloc(1, sizeof(*c))) == NULL)
+			err(1, "calloc(3)");
+		c->fd = fd;
+
+		/*
+		 * Hold off the callback until the watch pointer is stored,
+		 * and then echo anything that arrived in the meantime.
+		 */
+		c->busy = 1;
+		if ((c->watch = watch_fd(fd, conn_cb, c)) == NULL) {
+			warnx("watch_fd() failed");
+			(void) close(fd);
+			free(c);
+			continue;
+		}
+		conn_run(c);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+		warn("accept(2)");
+}
+
+
+static int
+listen_tcp(int port)
+{
+	struct sockaddr_in sin;
+	int fd, on = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		err(1, "socket(2)");
+	(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+		err(1, "bind(2)");
+
+	return fd;
+}
+
+
+static int
+listen_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(1, "socket(2)");
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
+		errx(1, "%s: path too long", path);
+	strcpy(sun.sun_path, path);
+	(void) unlink(path);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(1, "bind(2)");
+
+	return fd;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct rlimit rl;
+	const char *path = NULL;
+	int c, fd, port = 7777;
+
+	while ((c = getopt(argc, argv, "p:u:")) != -1) {
+		switch (c) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'u':
+			path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: echod [-p port | -u path]\n");
+			exit(1);
+		}
+	}
+
+	/* Allow thousands of connections */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		(void) setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	pnotify_init();
+
+	fd = (path != NULL) ? listen_unix(path) : listen_tcp(port);
+	set_nonblock(fd);
+	if (listen(fd, SOMAXCONN) < 0)
+		err(1, "listen(2)");
+	if (watch_fd(fd, accept_cb, NULL) == NULL)
+		errx(1, "watch_fd() failed");
+
+	event_dispatch();
+	exit(0);
+}
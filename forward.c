@@ -0,0 +1,363 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Copying data from one descriptor to another (WATCH_FORWARD).
+ *
+ *  The input descriptor is watched for PN_READ and the output descriptor
+ *  for PN_WRITE, and whenever either one becomes ready a worker thread
+ *  moves as much data as it can. Under Linux, the data never enters
+ *  userspace: a regular file is sent with sendfile(2), and anything else
+ *  is moved with splice(2), through an internal pipe unless one of the
+ *  descriptors is already a pipe. Other systems use read(2) and write(2)
+ *  with an internal buffer.
+ *
+ *  When the input reaches end-of-file and all of the data has been
+ *  written, or when an error occurs, the callback is invoked once.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+
+#if defined(__linux__)
+# include <sys/sendfile.h>
+#endif
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The amount of data moved by each system call */
+#define FORWARD_CHUNK	(64 * 1024)
+
+/** The state of a WATCH_FORWARD watch */
+struct pn_forward {
+
+	/** The reference count; each event for either descriptor holds one */
+	struct pn_ref ref;
+
+	/** The watch for the input descriptor, which has the callback */
+	struct watch *watch;
+
+	/** An internal watch for the output descriptor */
+	struct watch out;
+
+	/** If true, the input is a regular file */
+	bool file;
+
+	/** If true, data is spliced without the internal pipe */
+	bool direct;
+
+	/** The internal pipe, or the internal buffer */
+	int   pipe[2];
+	char *buf;
+	size_t pos;
+
+	/** The number of bytes in the pipe or buffer */
+	size_t pending;
+
+	/** If true, the input has reached end-of-file */
+	bool eof;
+
+	/** If true, the callback has been invoked */
+	bool done;
+
+	/** A mutex to serialize the copying */
+	pthread_mutex_t mtx;
+};
+
+
+static bool
+forward_again(void)
+{
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+
+/*
+ * Move as much data as possible. The caller must hold f->mtx.
+ *
+ * @return PN_CLOSE when finished, PN_ERROR if an error occurred,
+ *   or zero if the descriptors are not ready
+ */
+static int
+forward_pump(struct pn_forward *f)
+{
+	int in = f->watch->ident, out = f->out.ident;
+	bool progress;
+	ssize_t n;
+
+	do {
+		progress = false;
+
+#if defined(__linux__)
+		if (f->file) {
+			/* Send a regular file from, and advancing, its file offset */
+			if ((n = sendfile(out, in, NULL, FORWARD_CHUNK)) == 0)
+				return PN_CLOSE;
+			if (n < 0)
+				return forward_again() ? 0 : PN_ERROR;
+			progress = true;
+			continue;
+		}
+
+		if (f->direct) {
+			/* Either the input or the output is a pipe */
+			n = splice(in, NULL, out, NULL, FORWARD_CHUNK,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n == 0)
+				return PN_CLOSE;
+			if (n < 0)
+				return forward_again() ? 0 : PN_ERROR;
+			progress = true;
+			continue;
+		}
+
+		/* Fill the internal pipe */
+		if (!f->eof && f->pending < FORWARD_CHUNK) {
+			n = splice(in, NULL, f->pipe[1], NULL, FORWARD_CHUNK - f->pending,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n == 0)
+				f->eof = true;
+			else if (n < 0 && !forward_again())
+				return PN_ERROR;
+			else if (n > 0) {
+				f->pending += n;
+				progress = true;
+			}
+		}
+
+		/* Drain it into the output */
+		if (f->pending > 0) {
+			n = splice(f->pipe[0], NULL, out, NULL, f->pending,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && !forward_again())
+				return PN_ERROR;
+			if (n > 0) {
+				f->pending -= n;
+				progress = true;
+			}
+		}
+#else
+		/* Fill the internal buffer */
+		if (!f->eof && f->pending == 0) {
+			f->pos = 0;
+			n = read(in, f->buf, FORWARD_CHUNK);
+			if (n == 0)
+				f->eof = true;
+			else if (n < 0 && !forward_again())
+				return PN_ERROR;
+			else if (n > 0) {
+				f->pending = n;
+				progress = true;
+			}
+		}
+
+		/* Drain it into the output */
+		if (f->pending > 0) {
+			n = write(out, f->buf + f->pos, f->pending);
+			if (n < 0 && !forward_again())
+				return PN_ERROR;
+			if (n > 0) {
+				f->pos += n;
+				f->pending -= n;
+				progress = true;
+			}
+		}
+#endif
+
+		if (f->eof && f->pending == 0)
+			return PN_CLOSE;
+
+	} while (progress);
+
+	return 0;
+}
+
+
+static int
+forward_nonblock(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+			fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		warn("fcntl(2)");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Free the state after the last reference is dropped */
+static void
+forward_release(void *arg)
+{
+	struct pn_forward *f = arg;
+
+	if (f->pipe[0] >= 0) {
+		(void) close(f->pipe[0]);
+		(void) close(f->pipe[1]);
+	}
+	(void) pthread_mutex_destroy(&f->mtx);
+	free(f->buf);
+	free(f);
+}
+
+
+/*
+ * Remove the output from the kernel, and drop the reference of the watch
+ * once no poller can be looking at the internal watch any more. The caller
+ * has already removed the input.
+ */
+static void
+forward_shutdown(struct watch *watch, struct pn_forward *f)
+{
+	(void) sys->rm_watch(&f->out);
+
+	/* The internal watch shares the reference of the caller's watch */
+	(void) pn_ref_clear(&f->out.priv);
+	pn_poller_defer(pn_ref_put, pn_ref_clear(&watch->priv));
+}
+
+
+/**
+ * Set up a WATCH_FORWARD watch, and register both descriptors.
+ */
+int
+pn_forward_open(struct watch *watch, int out_fd)
+{
+	struct pn_forward *f;
+	struct stat in_sb, out_sb;
+
+	if (fstat(watch->ident, &in_sb) < 0 || fstat(out_fd, &out_sb) < 0) {
+		warn("fstat(2)");
+		return -1;
+	}
+	if ((f = calloc(1, sizeof(*f))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	pn_ref_init(&f->ref, forward_release);
+	f->watch = watch;
+	f->out.type = WATCH_FORWARD;
+	f->out.ident = out_fd;
+	f->out.priv = f;
+	f->pipe[0] = f->pipe[1] = -1;
+	f->file = S_ISREG(in_sb.st_mode);
+	if (pthread_mutex_init(&f->mtx, NULL) != 0) {
+		warn("pthread_mutex_init(3) failed");
+		free(f);
+		return -1;
+	}
+
+#if defined(__linux__)
+	f->direct = S_ISFIFO(in_sb.st_mode) || S_ISFIFO(out_sb.st_mode);
+	if (!f->file && !f->direct && pipe2(f->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		warn("pipe2(2)");
+		goto err;
+	}
+#else
+	if ((f->buf = malloc(FORWARD_CHUNK)) == NULL) {
+		warn("malloc(3)");
+		goto err;
+	}
+#endif
+
+	if ((!f->file && forward_nonblock(watch->ident) < 0) ||
+			forward_nonblock(out_fd) < 0)
+		goto err;
+	watch->priv = f;
+
+	/*
+	 * A regular file is always readable, so only the output is watched.
+	 * Under Linux, epoll(7) rejects a regular file as the output.
+	 */
+	if (sys->add_watch(&f->out) < 0)
+		goto err;
+	if (sys->mod_watch(&f->out, PN_WRITE) < 0)
+		goto err_out;
+	if (!f->file && sys->add_watch(watch) < 0)
+		goto err_out;
+	if (!f->file && sys->mod_watch(watch, PN_READ) < 0) {
+		(void) sys->rm_watch(watch);
+		goto err_out;
+	}
+
+	return 0;
+
+err_out:
+	/* Events may already have been queued for the output */
+	forward_shutdown(watch, f);
+	return -1;
+
+err:
+	watch->priv = NULL;
+	forward_release(f);
+	return -1;
+}
+
+
+/**
+ * Handle an event for either descriptor of a WATCH_FORWARD watch.
+ *
+ * This is called by a worker thread instead of the callback.
+ */
+void
+pn_forward_dispatch(struct watch *watch, int mask)
+{
+	struct pn_forward *f = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+	int result;
+
+	/* The watch has been cancelled; the event still holds the state */
+	if (f == NULL)
+		return;
+
+	MUTEX_LOCK(f->mtx);
+	if (f->done) {
+		MUTEX_UNLOCK(f->mtx);
+		return;
+	}
+	if ((result = forward_pump(f)) != 0)
+		f->done = true;
+	MUTEX_UNLOCK(f->mtx);
+
+	if (result != 0)
+		f->watch->cb(f->watch, result, f->watch->arg);
+}
+
+
+/**
+ * Stop copying. The state is freed once the queued events, any running
+ * dispatch and the pollers, which may still see the internal watch for
+ * the output, are done with it.
+ */
+void
+pn_forward_close(struct watch *watch)
+{
+	struct pn_forward *f = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+
+	if (f == NULL)
+		return;
+
+	if (!f->file)
+		(void) sys->rm_watch(watch);
+	forward_shutdown(watch, f);
+}
@@ -0,0 +1,487 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Splitting the input of a WATCH_BUFFER watch into records.
+ *
+ *  Each time data is read, the complete records at the front of the input
+ *  buffer are passed to the record callback as one batch. A record that
+ *  lies within a single buffer is passed as a pointer into the buffer;
+ *  only a record that crosses from one buffer to the next is copied.
+ *  The buffers are kept until the callback returns.
+ *
+ *  The framing state is reference counted (see ref.c), because it may be
+ *  replaced by pnotify_buffer_framing() while a batch is being delivered.
+ *  The buffer holds one reference, and a worker holds another from
+ *  pn_frame_collect() until pn_frame_deliver() returns.
+ *
+ *  Delimiters are found with SSE2 or AVX2 instructions, which compare
+ *  16 or 32 bytes at a time and report every delimiter in the block.
+ */
+
+#include <limits.h>
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_X86_SIMD 1
+#endif
+
+/** The largest number of delimiters returned by one call to a scanner */
+#define FRAME_SCAN_MAX	256
+
+/** The framing state of a WATCH_BUFFER watch */
+struct pn_frame {
+	struct pn_ref ref;
+	enum pn_framing type;
+	unsigned int param;
+	void (*cb)(struct watch *, const struct pn_record *, size_t, void *);
+
+	/** The length of the incomplete record known not to contain a delimiter */
+	size_t scanned;
+
+	/** The batch of records being delivered */
+	struct pn_record *rec;
+	size_t nrec, recsz;
+
+	/** Records that were copied because they cross a buffer boundary */
+	char **copy;
+	size_t ncopy, copysz;
+
+	/** Consumed buffers, kept until the callback returns */
+	struct pn_buffer_chain retired;
+
+	/** Serializes the delivery of batches */
+	pthread_mutex_t mtx;
+};
+
+/** A position within the input chain */
+struct frame_cursor {
+	struct pn_buffer *buf;
+	size_t base;		/** The offset of the first unread byte of buf */
+};
+
+/** Find every occurrence of a byte, returning their offsets */
+typedef size_t (*frame_scan_t)(const char *, size_t, int, size_t *, size_t);
+
+static frame_scan_t frame_scan;
+
+
+static size_t
+frame_scan_scalar(const char *p, size_t len, int c, size_t *pos, size_t max)
+{
+	const char *q = p, *end = p + len;
+	size_t n = 0;
+
+	while (n < max && q < end && (q = memchr(q, c, end - q)) != NULL) {
+		pos[n++] = q - p;
+		q++;
+	}
+
+	return n;
+}
+
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t
+frame_scan_sse2(const char *p, size_t len, int c, size_t *pos, size_t max)
+{
+	__m128i needle = _mm_set1_epi8((char) c);
+	unsigned int bits;
+	size_t i, j, m, n = 0;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		bits = _mm_movemask_epi8(_mm_cmpeq_epi8(needle,
+				_mm_loadu_si128((const __m128i *) (p + i))));
+		while (bits != 0) {
+			pos[n++] = i + __builtin_ctz(bits);
+			if (n == max)
+				return n;
+			bits &= bits - 1;
+		}
+	}
+
+	/* Finish the remainder, which is shorter than a block */
+	m = frame_scan_scalar(p + i, len - i, c, pos + n, max - n);
+	for (j = n; j < n + m; j++)
+		pos[j] += i;
+
+	return n + m;
+}
+
+
+__attribute__((target("avx2")))
+static size_t
+frame_scan_avx2(const char *p, size_t len, int c, size_t *pos, size_t max)
+{
+	__m256i needle = _mm256_set1_epi8((char) c);
+	unsigned int bits;
+	size_t i, j, m, n = 0;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(needle,
+				_mm256_loadu_si256((const __m256i *) (p + i))));
+		while (bits != 0) {
+			pos[n++] = i + __builtin_ctz(bits);
+			if (n == max)
+				return n;
+			bits &= bits - 1;
+		}
+	}
+
+	/* Finish the remainder, which is shorter than a block */
+	m = frame_scan_sse2(p + i, len - i, c, pos + n, max - n);
+	for (j = n; j < n + m; j++)
+		pos[j] += i;
+
+	return n + m;
+}
+#endif
+
+
+static void
+frame_init(void)
+{
+	frame_scan = frame_scan_scalar;
+#if HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		frame_scan = frame_scan_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		frame_scan = frame_scan_sse2;
+#endif
+}
+
+
+/* Move the cursor forward to the buffer containing offset @a off */
+static void
+frame_seek(struct frame_cursor *cur, size_t off)
+{
+	while (off >= cur->base + (cur->buf->len - cur->buf->pos)) {
+		cur->base += cur->buf->len - cur->buf->pos;
+		cur->buf = STAILQ_NEXT(cur->buf, entries);
+	}
+}
+
+
+/* Copy @a len bytes, starting at offset @a off, out of the input chain */
+static void
+frame_copy(struct frame_cursor *cur, size_t off, size_t len, char *dst)
+{
+	struct pn_buffer *buf;
+	size_t skip, n;
+
+	frame_seek(cur, off);
+	skip = off - cur->base;
+	for (buf = cur->buf; len > 0; buf = STAILQ_NEXT(buf, entries)) {
+		n = MIN(len, buf->len - buf->pos - skip);
+		memcpy(dst, buf->data + buf->pos + skip, n);
+		dst += n;
+		len -= n;
+		skip = 0;
+	}
+}
+
+
+/* Add a record to the batch */
+static void
+frame_emit(struct pn_frame *f, struct frame_cursor *cur, size_t off, size_t len)
+{
+	struct pn_record *rec;
+	char *p;
+	void *tmp;
+
+	if (f->nrec == f->recsz) {
+		f->recsz = (f->recsz == 0) ? 64 : f->recsz * 2;
+		if ((tmp = realloc(f->rec, f->recsz * sizeof(*f->rec))) == NULL)
+			err(1, "realloc(3)");
+		f->rec = tmp;
+	}
+	rec = &f->rec[f->nrec++];
+	rec->len = len;
+
+	/* Point into the buffer unless the record crosses into the next one */
+	if (len > 0)
+		frame_seek(cur, off);
+	if (len == 0 || off + len <= cur->base + (cur->buf->len - cur->buf->pos)) {
+		rec->data = (len > 0) ? cur->buf->data + cur->buf->pos + (off - cur->base) : "";
+		return;
+	}
+
+	if (f->ncopy == f->copysz) {
+		f->copysz = (f->copysz == 0) ? 16 : f->copysz * 2;
+		if ((tmp = realloc(f->copy, f->copysz * sizeof(*f->copy))) == NULL)
+			err(1, "realloc(3)");
+		f->copy = tmp;
+	}
+	if ((p = malloc(len)) == NULL)
+		err(1, "malloc(3)");
+	frame_copy(cur, off, len, p);
+	f->copy[f->ncopy++] = p;
+	rec->data = p;
+}
+
+
+/* Remove @a len bytes from the front of the input chain */
+static void
+frame_consume(struct pnotify_buffer *b, struct pn_frame *f, size_t len)
+{
+	struct pn_buffer *buf;
+	size_t n;
+
+	b->in_len -= len;
+	while (len > 0 && (buf = STAILQ_FIRST(&b->in)) != NULL) {
+		n = MIN(len, buf->len - buf->pos);
+		buf->pos += n;
+		len -= n;
+		if (buf->pos == buf->len) {
+			STAILQ_REMOVE_HEAD(&b->in, entries);
+			STAILQ_INSERT_TAIL(&f->retired, buf, entries);
+		}
+	}
+}
+
+
+/* Split the input at each delimiter. Returns the number of bytes used. */
+static size_t
+frame_delim(struct pnotify_buffer *b, struct pn_frame *f)
+{
+	struct frame_cursor cur = { STAILQ_FIRST(&b->in), 0 };
+	struct pn_buffer *buf;
+	size_t pos[FRAME_SCAN_MAX];
+	size_t off = 0, start = 0, skip, i, n, seglen;
+	const char *seg;
+
+	STAILQ_FOREACH(buf, &b->in, entries) {
+		seg = buf->data + buf->pos;
+		seglen = buf->len - buf->pos;
+
+		/* Do not scan the incomplete record again */
+		skip = (f->scanned > off) ? MIN(f->scanned - off, seglen) : 0;
+		while (skip < seglen) {
+			n = frame_scan(seg + skip, seglen - skip, f->param, pos, FRAME_SCAN_MAX);
+			for (i = 0; i < n; i++) {
+				frame_emit(f, &cur, start, off + skip + pos[i] - start);
+				start = off + skip + pos[i] + 1;
+			}
+			if (n < FRAME_SCAN_MAX)
+				break;
+			skip += pos[n - 1] + 1;
+		}
+		off += seglen;
+	}
+
+	/* At the end of the stream, the rest of the input is the last record */
+	if (b->eof && start < off) {
+		frame_emit(f, &cur, start, off - start);
+		start = off;
+	}
+	f->scanned = off - start;
+
+	if (f->scanned >= PN_BUFFER_MAX_INPUT)
+		b->error = EMSGSIZE;
+
+	return start;
+}
+
+
+/* Split the input using a big-endian length prefix. Returns the bytes used. */
+static size_t
+frame_length(struct pnotify_buffer *b, struct pn_frame *f)
+{
+	struct frame_cursor cur = { STAILQ_FIRST(&b->in), 0 };
+	unsigned char hdr[8];
+	size_t off = 0, width = f->param;
+	uint64_t len;
+	unsigned int i;
+
+	while (b->in_len - off >= width) {
+		frame_copy(&cur, off, width, (char *) hdr);
+		for (i = 0, len = 0; i < width; i++)
+			len = (len << 8) | hdr[i];
+		if (len > PN_BUFFER_MAX_INPUT - width) {
+			b->error = EMSGSIZE;
+			break;
+		}
+		if (b->in_len - off - width < len)
+			break;
+		frame_emit(f, &cur, off + width, len);
+		off += width + len;
+	}
+
+	return off;
+}
+
+
+/**
+ * Find the complete records in the input buffer.
+ *
+ * The caller must hold b->mtx. If any records are found, f->mtx is
+ * locked, @a fp holds a reference to the framing state, and both are
+ * released by pn_frame_deliver().
+ *
+ * @return the number of records found
+ */
+size_t
+pn_frame_collect(struct pnotify_buffer *b, struct pn_frame **fp)
+{
+	struct pn_frame *f;
+	size_t used;
+
+	if (b->in_len == 0)
+		return 0;
+	if ((f = pn_ref_get((void **) &b->framing)) == NULL)
+		return 0;
+
+	/* Deliver batches in order, without holding b->mtx in the callback */
+	MUTEX_UNLOCK(b->mtx);
+	MUTEX_LOCK(f->mtx);
+	MUTEX_LOCK(b->mtx);
+
+	/* The framing was replaced, and the new one was sent its own event */
+	if (b->framing != f) {
+		MUTEX_UNLOCK(f->mtx);
+		pn_ref_put(f);
+		return 0;
+	}
+
+	if (f->type == PN_FRAME_DELIM)
+		used = frame_delim(b, f);
+	else
+		used = frame_length(b, f);
+	frame_consume(b, f, used);
+
+	if (f->nrec == 0) {
+		MUTEX_UNLOCK(f->mtx);
+		pn_ref_put(f);
+		return 0;
+	}
+
+	*fp = f;
+	return f->nrec;
+}
+
+
+/**
+ * Pass a batch of records to the callback, and release the buffers.
+ *
+ * The caller must not hold b->mtx.
+ */
+void
+pn_frame_deliver(struct watch *watch, struct pn_frame *f)
+{
+	struct pn_buffer *buf;
+	size_t i;
+
+	f->cb(watch, f->rec, f->nrec, watch->arg);
+
+	for (i = 0; i < f->ncopy; i++)
+		free(f->copy[i]);
+	f->ncopy = 0;
+	f->nrec = 0;
+	while ((buf = STAILQ_FIRST(&f->retired)) != NULL) {
+		STAILQ_REMOVE_HEAD(&f->retired, entries);
+		pn_buffer_free(buf);
+	}
+
+	MUTEX_UNLOCK(f->mtx);
+	pn_ref_put(f);
+}
+
+
+/* Free the framing state after the last reference is dropped */
+static void
+frame_release(void *arg)
+{
+	struct pn_frame *f = arg;
+	struct pn_buffer *buf;
+
+	while ((buf = STAILQ_FIRST(&f->retired)) != NULL) {
+		STAILQ_REMOVE_HEAD(&f->retired, entries);
+		pn_buffer_free(buf);
+	}
+	free(f->rec);
+	free(f->copy);
+	(void) pthread_mutex_destroy(&f->mtx);
+	free(f);
+}
+
+
+int
+pnotify_buffer_framing(struct watch *watch, enum pn_framing type, unsigned int param,
+		void (*cb)(struct watch *, const struct pn_record *, size_t, void *))
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct pnotify_buffer *b;
+	struct pn_frame *f = NULL, *old;
+	bool pending;
+
+	if (watch->type != WATCH_BUFFER ||
+			(type == PN_FRAME_DELIM && param > UCHAR_MAX) ||
+			(type == PN_FRAME_LENGTH && param != 1 && param != 2 &&
+			 param != 4 && param != 8) ||
+			(type != PN_FRAME_NONE && cb == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The watch has been cancelled */
+	if ((b = pn_ref_get(&watch->priv)) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	(void) pthread_once(&once, frame_init);
+
+	if (type != PN_FRAME_NONE) {
+		if ((f = calloc(1, sizeof(*f))) == NULL) {
+			warn("calloc(3)");
+			pn_ref_put(b);
+			return -1;
+		}
+		pn_ref_init(&f->ref, frame_release);
+		f->type = type;
+		f->param = param;
+		f->cb = cb;
+		STAILQ_INIT(&f->retired);
+		if (pthread_mutex_init(&f->mtx, NULL) != 0) {
+			warn("pthread_mutex_init(3) failed");
+			free(f);
+			pn_ref_put(b);
+			return -1;
+		}
+	}
+
+	/* A batch of the old framing that is being delivered keeps it alive */
+	MUTEX_LOCK(b->mtx);
+	old = b->framing;
+	b->framing = f;
+	pending = (f != NULL && b->in_len > 0);
+	MUTEX_UNLOCK(b->mtx);
+	pn_ref_put(old);
+	pn_ref_put(b);
+
+	/* Split any input that is already waiting */
+	if (pending)
+		pn_event_add(watch, PN_READ);
+
+	return 0;
+}
@@ -0,0 +1,759 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Linux filesystem watches (WATCH_MOUNT) using fanotify and inotify.
+ *
+ *  A fanotify group marks the entire filesystem and reports each event
+ *  as a directory file handle plus a name. Directory handles are resolved
+ *  to pathnames once and then cached. If fanotify is not available or not
+ *  permitted, one inotify watch is added for every directory in the tree.
+ *  The directories are scanned in parallel by the worker threads, and
+ *  PN_READY is delivered when the whole tree is being watched.
+ *
+ *  WATCH_TAIL watches also use inotify, to learn when a file is written to
+ *  and when a file with the same name appears in its directory.
+ *
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+
+/** The events requested from fanotify */
+#define FS_FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF | \
+		FAN_MODIFY | FAN_ATTRIB | FAN_MOVED_FROM | FAN_MOVED_TO | \
+		FAN_ONDIR)
+
+/** The events requested from inotify for each directory */
+#define FS_INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/** The size of the buffer used by getdents64(2) */
+#define SCAN_BUFSZ	(64 * 1024)
+
+/** The events requested from inotify for a tailed file */
+#define TAIL_FILE_MASK	(IN_MODIFY)
+
+/** The events requested from inotify for the directory of a tailed file */
+#define TAIL_DIR_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+		IN_MOVED_TO | IN_ONLYDIR)
+
+/** The state of a WATCH_MOUNT watch */
+struct fswatch {
+
+	/** The fanotify or inotify descriptor */
+	int fd;
+
+	/** If true, `fd' is a fanotify group; otherwise it is an inotify instance */
+	bool fanotify;
+
+	/** An open descriptor for the root directory, used to resolve file handles */
+	int root_fd;
+
+	/** The canonical pathname of the root directory */
+	char root[PATH_MAX];
+	size_t rootlen;
+
+	/**
+	 * The pathname of each known directory.
+	 *
+	 * For fanotify, the key is a struct file_handle.
+	 * For inotify, the key is a watch descriptor.
+	 */
+	struct pn_hash dir;
+
+	/** A mutex to protect the `dir' table */
+	pthread_mutex_t mtx;
+
+	/** The watch that owns this state */
+	struct watch *watch;
+
+	/** The number of references, including one for each scan in progress */
+	int refs;
+
+	/** The number of directories waiting to be scanned */
+	int scan_pending;
+
+	/** Set once PN_READY has been delivered */
+	int ready;
+
+	/** Set when the watch is cancelled */
+	bool closing;
+};
+
+/** A directory waiting to be scanned by a worker thread */
+struct fs_scan {
+	struct fswatch *fs;
+	char path[];
+};
+
+/** A directory entry returned by getdents64(2) */
+struct fs_dirent64 {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+
+
+/* Join a directory and a filename. Returns -1 if the result is too long. */
+static int
+fs_join(char *buf, size_t bufsz, const char *dir, const char *name)
+{
+	size_t len;
+
+	if (name == NULL || name[0] == '\0' || strcmp(name, ".") == 0)
+		len = snprintf(buf, bufsz, "%s", dir);
+	else if (dir[0] != '\0' && dir[strlen(dir) - 1] == '/')
+		len = snprintf(buf, bufsz, "%s%s", dir, name);
+	else
+		len = snprintf(buf, bufsz, "%s/%s", dir, name);
+
+	return (len >= bufsz) ? -1 : 0;
+}
+
+
+/* Generate an event if the pathname is within the watched tree */
+static void
+fs_emit(struct watch *watch, struct fswatch *fs, const char *dir,
+		const char *name, int mask)
+{
+	char path[PATH_MAX];
+
+	if (mask == 0 || fs_join(path, sizeof(path), dir, name) < 0)
+		return;
+
+	/* fanotify reports events for the entire filesystem */
+	if (fs->rootlen > 1 && (strncmp(path, fs->root, fs->rootlen) != 0 ||
+			(path[fs->rootlen] != '\0' && path[fs->rootlen] != '/')))
+		return;
+
+	pn_event_add_path(watch, mask, path);
+}
+
+
+#if defined(FAN_REPORT_DFID_NAME)
+
+static int
+fs_fanotify_mask(uint64_t fmask)
+{
+	int mask = 0;
+
+	if (fmask & FAN_CREATE)
+		mask |= PN_CREATE;
+	if (fmask & (FAN_DELETE | FAN_DELETE_SELF))
+		mask |= PN_DELETE;
+	if (fmask & FAN_MODIFY)
+		mask |= PN_MODIFY;
+	if (fmask & FAN_ATTRIB)
+		mask |= PN_ATTRIB;
+	if (fmask & (FAN_MOVED_FROM | FAN_MOVED_TO))
+		mask |= PN_RENAME;
+
+	return mask;
+}
+
+
+/* Convert a directory file handle into a pathname. The caller must hold fs->mtx. */
+static const char *
+fs_fid_lookup(struct fswatch *fs, struct file_handle *fh)
+{
+	static const char deleted[] = " (deleted)";
+	char link[64], buf[PATH_MAX];
+	size_t keylen;
+	ssize_t len;
+	char *path;
+	int fd;
+
+	keylen = sizeof(*fh) + fh->handle_bytes;
+	if ((path = pn_hash_lookup(&fs->dir, fh, keylen)) != NULL)
+		return path;
+
+	if ((fd = open_by_handle_at(fs->root_fd, fh, O_PATH)) < 0) {
+		dprintf("open_by_handle_at(2): %s\n", strerror(errno));
+		return NULL;
+	}
+	(void) snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	len = readlink(link, buf, sizeof(buf) - 1);
+	(void) close(fd);
+	if (len < 0)
+		return NULL;
+	buf[len] = '\0';
+
+	/* Do not cache the name of a directory that no longer exists */
+	if (len > sizeof(deleted) - 1 &&
+			strcmp(buf + len - sizeof(deleted) + 1, deleted) == 0)
+		return NULL;
+
+	if ((path = strdup(buf)) == NULL)
+		err(1, "strdup(3)");
+	(void) pn_hash_insert(&fs->dir, fh, keylen, path);
+
+	return path;
+}
+
+
+static int
+fs_fanotify_open(struct fswatch *fs)
+{
+	char hbuf[sizeof(struct file_handle) + MAX_HANDLE_SZ]
+		__attribute__((aligned(8)));
+	struct file_handle *fh = (struct file_handle *) hbuf;
+	int fd, mount_id;
+
+	fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+			FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		dprintf("fanotify_init(2): %s\n", strerror(errno));
+		return -1;
+	}
+	if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				FS_FANOTIFY_MASK, AT_FDCWD, fs->root) < 0) {
+		dprintf("fanotify_mark(2): %s\n", strerror(errno));
+		goto err1;
+	}
+	if ((fs->root_fd = open(fs->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		goto err1;
+
+	/* Resolving a file handle needs CAP_DAC_READ_SEARCH, so try it now */
+	fh->handle_bytes = MAX_HANDLE_SZ;
+	if (name_to_handle_at(AT_FDCWD, fs->root, fh, &mount_id, 0) < 0 ||
+			fs_fid_lookup(fs, fh) == NULL) {
+		dprintf("unable to resolve file handles: %s\n", strerror(errno));
+		goto err2;
+	}
+
+	fs->fd = fd;
+	fs->fanotify = true;
+	return 0;
+
+err2:
+	(void) close(fs->root_fd);
+	fs->root_fd = -1;
+	pn_hash_clear(&fs->dir, free);
+
+err1:
+	(void) close(fd);
+	return -1;
+}
+
+
+static void
+fs_fanotify_read(struct watch *watch, struct fswatch *fs)
+{
+	char buf[8192]
+		__attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+	struct fanotify_event_metadata *md;
+	struct fanotify_event_info_fid *fid;
+	struct file_handle *fh;
+	const char *dir, *name;
+	ssize_t len;
+
+	for (;;) {
+		if ((len = read(fs->fd, buf, sizeof(buf))) <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0 && errno != EAGAIN)
+				warn("read(2)");
+			return;
+		}
+
+		MUTEX_LOCK(fs->mtx);
+		for (md = (struct fanotify_event_metadata *) buf;
+				FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)) {
+
+			if (md->fd >= 0)
+				(void) close(md->fd);
+
+			if (md->mask & FAN_Q_OVERFLOW) {
+				pn_event_add_path(watch, PN_ERROR, NULL);
+				continue;
+			}
+
+			/* Locate the directory file handle and entry name */
+			if (md->event_len < md->metadata_len + sizeof(*fid))
+				continue;
+			fid = (struct fanotify_event_info_fid *) ((char *) md + md->metadata_len);
+			fh = (struct file_handle *) fid->handle;
+			if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+				name = (const char *) fh->f_handle + fh->handle_bytes;
+			else if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID)
+				name = NULL;
+			else
+				continue;
+
+			if ((dir = fs_fid_lookup(fs, fh)) != NULL)
+				fs_emit(watch, fs, dir, name, fs_fanotify_mask(md->mask));
+
+			/* Cached names below a moved or deleted directory are stale */
+			if ((md->mask & FAN_ONDIR) && (md->mask & (FAN_DELETE |
+					FAN_DELETE_SELF | FAN_MOVED_FROM | FAN_MOVED_TO)))
+				pn_hash_clear(&fs->dir, free);
+		}
+		MUTEX_UNLOCK(fs->mtx);
+	}
+}
+
+#else
+
+static int
+fs_fanotify_open(struct fswatch *fs)
+{
+	/* The system headers do not support FAN_REPORT_DFID_NAME */
+	return -1;
+}
+
+static void
+fs_fanotify_read(struct watch *watch, struct fswatch *fs)
+{
+}
+
+#endif /* FAN_REPORT_DFID_NAME */
+
+
+static int
+fs_inotify_mask(uint32_t imask)
+{
+	int mask = 0;
+
+	if (imask & IN_CREATE)
+		mask |= PN_CREATE;
+	if (imask & IN_DELETE)
+		mask |= PN_DELETE;
+	if (imask & IN_MODIFY)
+		mask |= PN_MODIFY;
+	if (imask & IN_ATTRIB)
+		mask |= PN_ATTRIB;
+	if (imask & (IN_MOVED_FROM | IN_MOVED_TO))
+		mask |= PN_RENAME;
+
+	return mask;
+}
+
+
+/* Add an inotify watch for a directory. The caller must hold fs->mtx. */
+static int
+fs_inotify_add(struct fswatch *fs, const char *path)
+{
+	char *copy;
+	int wd;
+
+	if ((wd = inotify_add_watch(fs->fd, path, FS_INOTIFY_MASK)) < 0) {
+		/* The directory may have been removed in the meantime */
+		if (errno != ENOENT && errno != ENOTDIR && errno != EACCES)
+			warn("inotify_add_watch(2) of `%s'", path);
+		return -1;
+	}
+
+	if ((copy = strdup(path)) == NULL)
+		err(1, "strdup(3)");
+	free(pn_hash_insert(&fs->dir, &wd, sizeof(wd), copy));
+
+	return 0;
+}
+
+
+/* Release a reference to the watch state */
+static void
+fs_release(void *arg)
+{
+	struct fswatch *fs = arg;
+
+	if (__sync_sub_and_fetch(&fs->refs, 1) != 0)
+		return;
+
+	(void) close(fs->fd);
+	if (fs->root_fd >= 0)
+		(void) close(fs->root_fd);
+	pn_hash_destroy(&fs->dir, free);
+	(void) pthread_mutex_destroy(&fs->mtx);
+	free(fs);
+}
+
+
+static void fs_scan_dir(void *arg);
+
+/* Schedule a directory to be scanned by a worker thread */
+static void
+fs_scan_start(struct fswatch *fs, const char *path)
+{
+	struct fs_scan *scan;
+	size_t len = strlen(path) + 1;
+
+	if ((scan = malloc(sizeof(*scan) + len)) == NULL)
+		err(1, "malloc(3)");
+	scan->fs = fs;
+	memcpy(scan->path, path, len);
+
+	(void) __sync_fetch_and_add(&fs->refs, 1);
+	(void) __sync_fetch_and_add(&fs->scan_pending, 1);
+	pn_task_add(fs_scan_dir, scan);
+}
+
+
+/*
+ * Add an inotify watch for a directory, and schedule a scan of each
+ * of its subdirectories. This runs on a worker thread, so the scan of
+ * a large tree is spread across the worker pool.
+ */
+static void
+fs_scan_dir(void *arg)
+{
+	static __thread char buf[SCAN_BUFSZ]
+		__attribute__((aligned(8)));
+	struct fs_scan *scan = arg;
+	struct fswatch *fs = scan->fs;
+	struct fs_dirent64 *de;
+	char child[PATH_MAX];
+	struct stat sb;
+	bool isdir;
+	long n, off;
+	int fd, rv;
+
+	if (__atomic_load_n(&fs->closing, __ATOMIC_ACQUIRE))
+		goto out;
+
+	/* Watch the directory before reading it, so no new entry is missed */
+	MUTEX_LOCK(fs->mtx);
+	rv = fs_inotify_add(fs, scan->path);
+	MUTEX_UNLOCK(fs->mtx);
+	if (rv < 0)
+		goto out;
+
+	if ((fd = open(scan->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		goto out;
+
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += de->d_reclen) {
+			de = (struct fs_dirent64 *) (buf + off);
+
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+
+			/* Only call stat(2) if the filesystem does not provide d_type */
+			if (de->d_type == DT_UNKNOWN)
+				isdir = (fstatat(fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+						S_ISDIR(sb.st_mode));
+			else
+				isdir = (de->d_type == DT_DIR);
+
+			if (isdir && fs_join(child, sizeof(child), scan->path, de->d_name) == 0)
+				fs_scan_start(fs, child);
+		}
+	}
+	if (n < 0)
+		warn("getdents64(2) of `%s'", scan->path);
+	(void) close(fd);
+
+out:
+	/*
+	 * The last scan to finish reports that the tree is fully watched. The
+	 * mutex keeps linux_fs_close() from cancelling the watch in between.
+	 */
+	if (__sync_sub_and_fetch(&fs->scan_pending, 1) == 0) {
+		MUTEX_LOCK(fs->mtx);
+		if (!__atomic_load_n(&fs->closing, __ATOMIC_ACQUIRE) &&
+				__sync_bool_compare_and_swap(&fs->ready, 0, 1))
+			pn_event_add_path(fs->watch, PN_READY, fs->root);
+		MUTEX_UNLOCK(fs->mtx);
+	}
+
+	free(scan);
+	fs_release(fs);
+}
+
+
+static void
+fs_inotify_read(struct watch *watch, struct fswatch *fs)
+{
+	char buf[8192]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	struct inotify_event *ev;
+	const char *dir, *name;
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		if ((len = read(fs->fd, buf, sizeof(buf))) <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0 && errno != EAGAIN)
+				warn("read(2)");
+			return;
+		}
+
+		MUTEX_LOCK(fs->mtx);
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				pn_event_add_path(watch, PN_ERROR, NULL);
+				continue;
+			}
+			if ((dir = pn_hash_lookup(&fs->dir, &ev->wd, sizeof(ev->wd))) == NULL)
+				continue;
+			if (ev->mask & IN_IGNORED) {
+				free(pn_hash_remove(&fs->dir, &ev->wd, sizeof(ev->wd)));
+				continue;
+			}
+
+			name = (ev->len > 0) ? ev->name : NULL;
+			fs_emit(watch, fs, dir, name, fs_inotify_mask(ev->mask));
+
+			/* Watch new subdirectories as they appear */
+			if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+					fs_join(path, sizeof(path), dir, name) == 0)
+				fs_scan_start(fs, path);
+		}
+		MUTEX_UNLOCK(fs->mtx);
+	}
+}
+
+
+/**
+ * Start watching a filesystem tree.
+ *
+ * @return a descriptor to be added to the epoll set, or -1 on error
+ */
+int
+linux_fs_open(struct watch *watch)
+{
+	struct fswatch *fs;
+
+	if ((fs = calloc(1, sizeof(*fs))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	fs->fd = -1;
+	fs->root_fd = -1;
+	if (realpath(watch->path, fs->root) == NULL) {
+		warn("realpath(3) of `%s'", watch->path);
+		goto err1;
+	}
+	fs->rootlen = strlen(fs->root);
+	if (pn_hash_init(&fs->dir, 0) != 0)
+		goto err1;
+	if (pthread_mutex_init(&fs->mtx, NULL) != 0) {
+		warn("pthread_mutex_init(3) failed");
+		goto err2;
+	}
+
+	fs->watch = watch;
+	fs->refs = 1;
+
+	/* A single fanotify mark covers the entire tree */
+	if (fs_fanotify_open(fs) == 0) {
+		dprintf("using fanotify for %s\n", fs->root);
+		watch->priv = fs;
+		fs->ready = 1;
+		pn_event_add_path(watch, PN_READY, fs->root);
+		return fs->fd;
+	}
+
+	/* Fall back to one inotify watch per directory */
+	dprintf("using inotify for %s\n", fs->root);
+	if ((fs->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		warn("inotify_init1(2)");
+		goto err3;
+	}
+	watch->priv = fs;
+	fs_scan_start(fs, fs->root);
+
+	return fs->fd;
+
+err3:
+	(void) pthread_mutex_destroy(&fs->mtx);
+
+err2:
+	pn_hash_destroy(&fs->dir, free);
+
+err1:
+	free(fs);
+	return -1;
+}
+
+
+/** Convert all pending kernel events into pnotify events */
+void
+linux_fs_read(struct watch *watch)
+{
+	struct fswatch *fs = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+
+	/* The watch has been cancelled; its state is kept until this poller is done */
+	if (fs == NULL)
+		return;
+
+	if (fs->fanotify)
+		fs_fanotify_read(watch, fs);
+	else
+		fs_inotify_read(watch, fs);
+}
+
+
+void
+linux_fs_close(struct watch *watch)
+{
+	struct fswatch *fs;
+
+	if ((fs = __atomic_exchange_n(&watch->priv, NULL, __ATOMIC_ACQ_REL)) == NULL)
+		return;
+
+	/*
+	 * Scans that are still running hold their own reference. A poller may
+	 * still be reading the descriptor, so the reference of the watch is
+	 * dropped once every poller has moved on. Once closing is set under
+	 * the mutex, no scan reports PN_READY for the cancelled watch.
+	 */
+	MUTEX_LOCK(fs->mtx);
+	__atomic_store_n(&fs->closing, true, __ATOMIC_RELEASE);
+	MUTEX_UNLOCK(fs->mtx);
+	pn_poller_defer(fs_release, fs);
+}
+
+
+/**
+ * Start watching a file for WATCH_TAIL. After the file is rotated, this
+ * is called again to watch the new file.
+ *
+ * @return a descriptor to be added to the epoll set, or -1 on error
+ */
+int
+linux_tail_open(struct watch *watch)
+{
+	struct pn_tail *t = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+	char dir[PATH_MAX];
+	const char *name;
+
+	/* The watch was cancelled while the file was being reopened */
+	if (t == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (t->notify_fd < 0) {
+		if ((t->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+			warn("inotify_init1(2)");
+			return -1;
+		}
+
+		/* Watch the directory for the file being created or renamed */
+		if ((name = strrchr(watch->path, '/')) == NULL)
+			(void) strcpy(dir, ".");
+		else if (name == watch->path)
+			(void) strcpy(dir, "/");
+		else
+			(void) snprintf(dir, sizeof(dir), "%.*s",
+					(int) (name - watch->path), watch->path);
+		if ((t->wd_dir = inotify_add_watch(t->notify_fd, dir, TAIL_DIR_MASK)) < 0) {
+			warn("inotify_add_watch(2) of `%s'", dir);
+			linux_tail_close(watch);
+			return -1;
+		}
+	}
+
+	/* Stop watching the old file after a rotation */
+	if (t->wd_file >= 0)
+		(void) inotify_rm_watch(t->notify_fd, t->wd_file);
+
+	/* The file may not exist yet */
+	t->wd_file = inotify_add_watch(t->notify_fd, watch->path, TAIL_FILE_MASK);
+
+	return t->notify_fd;
+}
+
+
+/** Convert all pending inotify events into a single pnotify event */
+void
+linux_tail_read(struct watch *watch)
+{
+	char buf[8192]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pn_tail *t = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+	struct inotify_event *ev;
+	const char *name;
+	int mask = 0;
+	ssize_t len;
+	char *p;
+
+	/* The state is kept until this poller is done with it */
+	if (t == NULL)
+		return;
+
+	name = strrchr(watch->path, '/');
+	name = (name == NULL) ? watch->path : name + 1;
+
+	for (;;) {
+		if ((len = read(t->notify_fd, buf, sizeof(buf))) <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0 && errno != EAGAIN)
+				warn("read(2)");
+			break;
+		}
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+
+			if (ev->wd != t->wd_dir) {
+				if (ev->mask & IN_MODIFY)
+					mask |= PN_MODIFY;
+				continue;
+			}
+
+			/* Ignore other files in the same directory */
+			if (ev->len == 0 || strcmp(ev->name, name) != 0)
+				continue;
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				mask |= PN_CREATE;
+			if (ev->mask & IN_MOVED_FROM)
+				mask |= PN_RENAME;
+			if (ev->mask & IN_DELETE)
+				mask |= PN_DELETE;
+		}
+	}
+
+	if (mask != 0)
+		pn_event_add(watch, mask);
+}
+
+
+void
+linux_tail_close(struct watch *watch)
+{
+	struct pn_tail *t = watch->priv;
+
+	if (t->notify_fd >= 0)
+		(void) close(t->notify_fd);
+	t->notify_fd = -1;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,193 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  A small chained hash table keyed by arbitrary byte strings.
+ *
+ *  The table is not threadsafe; callers must provide their own locking.
+ */
+
+#include <stdint.h>
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The table is grown when the average chain length exceeds this value */
+#define HASH_MAX_LOAD	2
+
+uint32_t
+pn_hash_fnv(const void *key, size_t keylen)
+{
+	const unsigned char *p = key;
+	uint32_t h = 2166136261U;
+
+	while (keylen-- > 0) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+
+int
+pn_hash_init(struct pn_hash *h, size_t nbuckets)
+{
+	size_t i;
+
+	if (nbuckets == 0)
+		nbuckets = 64;
+	if ((h->bucket = calloc(nbuckets, sizeof(*h->bucket))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	for (i = 0; i < nbuckets; i++)
+		LIST_INIT(&h->bucket[i]);
+	h->nbuckets = nbuckets;
+	h->count = 0;
+
+	return 0;
+}
+
+
+static struct pn_hash_entry *
+pn_hash_find(struct pn_hash *h, const void *key, size_t keylen, uint32_t hv)
+{
+	struct pn_hash_entry *ent;
+
+	LIST_FOREACH(ent, &h->bucket[hv % h->nbuckets], entries) {
+		if (ent->hash == hv && ent->keylen == keylen &&
+				memcmp(ent->key, key, keylen) == 0)
+			return ent;
+	}
+
+	return NULL;
+}
+
+
+static void
+pn_hash_grow(struct pn_hash *h)
+{
+	struct pn_hash tmp;
+	struct pn_hash_entry *ent;
+	size_t i;
+
+	if (pn_hash_init(&tmp, h->nbuckets * 2) != 0)
+		return;		/* Keep using the smaller table */
+
+	for (i = 0; i < h->nbuckets; i++) {
+		while ((ent = LIST_FIRST(&h->bucket[i])) != NULL) {
+			LIST_REMOVE(ent, entries);
+			LIST_INSERT_HEAD(&tmp.bucket[ent->hash % tmp.nbuckets],
+					ent, entries);
+		}
+	}
+	free(h->bucket);
+	h->bucket = tmp.bucket;
+	h->nbuckets = tmp.nbuckets;
+}
+
+
+void *
+pn_hash_lookup(struct pn_hash *h, const void *key, size_t keylen)
+{
+	struct pn_hash_entry *ent;
+
+	ent = pn_hash_find(h, key, keylen, pn_hash_fnv(key, keylen));
+	return (ent == NULL) ? NULL : ent->value;
+}
+
+
+void *
+pn_hash_insert(struct pn_hash *h, const void *key, size_t keylen, void *value)
+{
+	struct pn_hash_entry *ent;
+	uint32_t hv;
+	void *old;
+
+	hv = pn_hash_fnv(key, keylen);
+
+	/* Replace the value of an existing entry */
+	if ((ent = pn_hash_find(h, key, keylen, hv)) != NULL) {
+		old = ent->value;
+		ent->value = value;
+		return old;
+	}
+
+	/* The key is stored inline, immediately after the entry */
+	if ((ent = malloc(sizeof(*ent) + keylen)) == NULL)
+		err(1, "malloc(3)");
+	ent->key = ent + 1;
+	memcpy(ent->key, key, keylen);
+	ent->keylen = keylen;
+	ent->hash = hv;
+	ent->value = value;
+	LIST_INSERT_HEAD(&h->bucket[hv % h->nbuckets], ent, entries);
+
+	if (++h->count > h->nbuckets * HASH_MAX_LOAD)
+		pn_hash_grow(h);
+
+	return NULL;
+}
+
+
+void *
+pn_hash_remove(struct pn_hash *h, const void *key, size_t keylen)
+{
+	struct pn_hash_entry *ent;
+	void *value;
+
+	if ((ent = pn_hash_find(h, key, keylen, pn_hash_fnv(key, keylen))) == NULL)
+		return NULL;
+
+	value = ent->value;
+	LIST_REMOVE(ent, entries);
+	free(ent);
+	h->count--;
+
+	return value;
+}
+
+
+void
+pn_hash_clear(struct pn_hash *h, void (*free_value)(void *))
+{
+	struct pn_hash_entry *ent;
+	size_t i;
+
+	for (i = 0; i < h->nbuckets; i++) {
+		while ((ent = LIST_FIRST(&h->bucket[i])) != NULL) {
+			LIST_REMOVE(ent, entries);
+			if (free_value != NULL)
+				free_value(ent->value);
+			free(ent);
+		}
+	}
+	h->count = 0;
+}
+
+
+void
+pn_hash_destroy(struct pn_hash *h, void (*free_value)(void *))
+{
+	pn_hash_clear(h, free_value);
+	free(h->bucket);
+	h->bucket = NULL;
+	h->nbuckets = 0;
+}
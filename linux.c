@@ -29,9 +29,43 @@
 #if defined(__linux__)
 
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+/* From <linux/eventpoll.h> in Linux 6.9, for older headers */
+#if !defined(EPIOCSPARAMS)
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+# define EPIOCSPARAMS	_IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/** The number of packets handled by each busy poll of a device */
+#define BUSY_POLL_BUDGET	64
 
 static int EPOLL_FD = -1;
 
+/*
+ * Re-enable the inotify or fanotify descriptor of a WATCH_MOUNT or
+ * WATCH_TAIL watch after it has been drained. It is added with
+ * EPOLLONESHOT, so with several pollers only one of them reads it at a
+ * time, and its events are queued in the order the kernel reported them.
+ */
+static void
+linux_rearm(struct watch *watch)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = watch;
+
+	/* The descriptor stays open until this poller is done, but the watch may have been cancelled */
+	if (epoll_ctl(EPOLL_FD, EPOLL_CTL_MOD, watch->ident, &ev) < 0 && errno != ENOENT)
+		warn("epoll_ctl(2) failed");
+}
+
 void *
 linux_epoll_loop(void * unused)
 {
@@ -43,6 +77,12 @@ linux_epoll_loop(void * unused)
 	/* Loop forever waiting for events */
 	for (;;) {
 
+		/* Nothing from the previous batch is in use any more */
+		pn_poller_quiescent();
+
+		/* Leave the events in the kernel while the queue is full */
+		pn_event_throttle();
+
 		/* Wait for an event */
 		numevents = epoll_wait(EPOLL_FD, 
 				(struct epoll_event *) &events, maxevents, -1);
@@ -51,17 +91,32 @@ linux_epoll_loop(void * unused)
 				continue;
 			err(1, "epoll_wait(2)");
 		}
+		pn_hist_record(&PN_STATS()->poll_batch, numevents);
 
 		/* Convert each epoll event into a pnotify event */
 		for (i = 0; i < numevents; i++) {
 
 			watch = (struct watch *) events[i].data.ptr;	
+			PN_TRACE(PN_TRACE_READY, watch, NULL, events[i].events);
+
+			/* Filesystem watches generate their own events */
+			if (watch->type == WATCH_MOUNT) {
+				linux_fs_read(watch);
+				linux_rearm(watch);
+				continue;
+			}
+			if (watch->type == WATCH_TAIL) {
+				linux_tail_read(watch);
+				linux_rearm(watch);
+				continue;
+			}
+
 			mask = 0;
 			if (events[i].events & EPOLLIN)
 				mask |= PN_READ;
 			if (events[i].events & EPOLLOUT)
 				mask |= PN_WRITE;
-			if (events[i].events & EPOLLHUP)
+			if (events[i].events & (EPOLLHUP | EPOLLRDHUP))
 				mask |= PN_CLOSE;
 			if (events[i].events & EPOLLERR)
 				mask |= PN_ERROR;
@@ -80,14 +135,17 @@ void
 linux_init_once(void)
 {
 	pthread_t tid;
+	unsigned int i;
 
 	/* Create an epoll descriptor */
 	if ((EPOLL_FD = epoll_create(1000)) < 0)
 		err(1, "epoll_create(2)");
 
-        /* Create a dedicated epoll thread */
-	if (pthread_create( &tid, NULL, linux_epoll_loop, NULL ) != 0)
-		errx(1, "pthread_create(3) failed");
+        /* Create the epoll threads, which all wait on the same descriptor */
+	for (i = 0; i < POLLER_COUNT; i++) {
+		if (pthread_create( &tid, NULL, linux_epoll_loop, NULL ) != 0)
+			errx(1, "pthread_create(3) failed");
+	}
 
 	/* TODO: push cleanup function */
 }
@@ -119,6 +177,85 @@ linux_add_watch(struct watch *watch)
 			dprintf("added epoll watch for fd #%d", watch->ident);
 			break;
 
+		case WATCH_BUFFER:
+			/* Output is enabled by linux_mod_watch() when there is some */
+			ev->events = EPOLLET | EPOLLIN | EPOLLRDHUP;
+			ev->data.ptr = watch;
+			if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, watch->ident, ev) < 0) {
+				warn("epoll_ctl(2) failed");
+				return -1;
+			}
+			break;
+
+		case WATCH_LISTEN:
+		case WATCH_DATAGRAM:
+		case WATCH_USER:
+			ev->events = EPOLLET | EPOLLIN;
+			ev->data.ptr = watch;
+			if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, watch->ident, ev) < 0) {
+				warn("epoll_ctl(2) failed");
+				return -1;
+			}
+			break;
+
+		case WATCH_PROC:
+			/* The pidfd becomes readable when the child exits */
+			ev->events = EPOLLET | EPOLLIN;
+			ev->data.ptr = watch;
+			if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD,
+					((struct pn_proc *) watch->priv)->pidfd, ev) < 0) {
+				warn("epoll_ctl(2) failed");
+				return -1;
+			}
+			break;
+
+		case WATCH_FORWARD:
+			/* The events are chosen by linux_mod_watch() */
+			ev->events = EPOLLET;
+			ev->data.ptr = watch;
+			if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, watch->ident, ev) < 0) {
+				warn("epoll_ctl(2) failed");
+				return -1;
+			}
+			break;
+
+		case WATCH_MOUNT:
+			/* Open a fanotify or inotify descriptor for the tree */
+			if ((watch->ident = linux_fs_open(watch)) < 0)
+				return -1;
+
+			/* Only one poller reads the descriptor; see linux_rearm() */
+			ev->events = EPOLLIN | EPOLLONESHOT;
+			ev->data.ptr = watch;
+			if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, watch->ident, ev) < 0) {
+				warn("epoll_ctl(2) failed");
+				linux_fs_close(watch);
+				return -1;
+			}
+			dprintf("added epoll watch for %s", watch->path);
+			break;
+
+		case WATCH_TAIL:
+			/* Called again after the file is rotated */
+			if (watch->ident >= 0) {
+				(void) linux_tail_open(watch);
+				break;
+			}
+
+			if ((watch->ident = linux_tail_open(watch)) < 0)
+				return -1;
+
+			/* Only one poller reads the descriptor; see linux_rearm() */
+			ev->events = EPOLLIN | EPOLLONESHOT;
+			ev->data.ptr = watch;
+			if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, watch->ident, ev) < 0) {
+				warn("epoll_ctl(2) failed");
+				linux_tail_close(watch);
+				return -1;
+			}
+			dprintf("added epoll watch for %s", watch->path);
+			break;
+
 		default:
 			/* The default action is to do nothing. */
 			break;
@@ -130,7 +267,77 @@ linux_add_watch(struct watch *watch)
 int
 linux_rm_watch(struct watch *watch)
 {
-	/* XXX-FIXME remove from epoll set */
+	switch (watch->type) {
+
+		case WATCH_FD:
+		case WATCH_BUFFER:
+		case WATCH_FORWARD:
+		case WATCH_LISTEN:
+		case WATCH_DATAGRAM:
+		case WATCH_USER:
+		case WATCH_MOUNT:
+		case WATCH_TAIL:
+			/* Remove the descriptor from the epoll set */
+			if (epoll_ctl(EPOLL_FD, EPOLL_CTL_DEL, watch->ident, NULL) < 0)
+				warn("epoll_ctl(2) failed");
+			if (watch->type == WATCH_MOUNT)
+				linux_fs_close(watch);
+
+			/* The inotify descriptor of WATCH_TAIL is closed with its state, see pn_tail_close() */
+			break;
+
+		case WATCH_PROC:
+			if (epoll_ctl(EPOLL_FD, EPOLL_CTL_DEL,
+					((struct pn_proc *) watch->priv)->pidfd, NULL) < 0)
+				warn("epoll_ctl(2) failed");
+			break;
+
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+
+/* Change the events that are reported for a descriptor */
+int
+linux_mod_watch(struct watch *watch, int mask)
+{
+	struct epoll_event *ev = &watch->epoll_evt;
+
+	ev->events = EPOLLET | EPOLLRDHUP;
+	if (mask & PN_READ)
+		ev->events |= EPOLLIN;
+	if (mask & PN_WRITE)
+		ev->events |= EPOLLOUT;
+	ev->data.ptr = watch;
+	if (epoll_ctl(EPOLL_FD, EPOLL_CTL_MOD, watch->ident, ev) < 0) {
+		warn("epoll_ctl(2) failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Busy poll the devices of the sockets in the epoll set */
+int
+linux_busy_poll(unsigned int usecs)
+{
+	struct epoll_params params;
+
+	memset(&params, 0, sizeof(params));
+	params.busy_poll_usecs = usecs;
+	params.busy_poll_budget = BUSY_POLL_BUDGET;
+	params.prefer_busy_poll = (usecs > 0);
+	if (ioctl(EPOLL_FD, EPIOCSPARAMS, &params) < 0) {
+		/* The kernel is older than 6.9 */
+		if (errno == ENOTTY)
+			errno = ENOTSUP;
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -139,7 +346,9 @@ const struct pnotify_vtable LINUX_VTABLE = {
 	.init_once = linux_init_once,
 	.add_watch = linux_add_watch,
 	.rm_watch = linux_rm_watch,
+	.mod_watch = linux_mod_watch,
 	.cleanup = linux_cleanup,
+	.busy_poll = linux_busy_poll,
 };
 
 #endif
@@ -0,0 +1,345 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Accepting connections on a listening socket (WATCH_LISTEN).
+ *
+ *  When the socket becomes readable, a worker thread accepts up to
+ *  LISTEN_BATCH connections and then invokes the callback for each one.
+ *  If the batch was full, another event is queued before the callbacks
+ *  run, so that a second worker continues to drain the backlog while
+ *  the first is busy with the new connections.
+ *
+ *  If the socket has SO_REUSEPORT set, additional sockets can be bound to
+ *  the same address, so that the kernel spreads the incoming connections
+ *  over several queues which are accepted from in parallel.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The maximum number of connections accepted before invoking the callback */
+#define LISTEN_BATCH	64
+
+/** How long to wait before accepting again after running out of descriptors */
+#define LISTEN_RETRY_MS	100
+
+/** The state of a WATCH_LISTEN watch */
+struct pn_listen {
+
+	/** The reference count; each event for any of the sockets holds one */
+	struct pn_ref ref;
+
+	/** The watch for the caller's socket, which has the callback */
+	struct watch *watch;
+
+	/** Internal watches for the additional SO_REUSEPORT sockets */
+	struct watch *shard;
+	unsigned int nshards;
+
+	/** A timer to retry after accept(2) fails with EMFILE; it holds a reference */
+	struct timer *retry;
+
+	/** If true, the watch is being cancelled */
+	bool closing;
+
+	/** A mutex to protect the retry timer */
+	pthread_mutex_t mtx;
+};
+
+
+static int
+listen_nonblock(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+			fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		warn("fcntl(2)");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Accept one connection, which is non-blocking and close-on-exec */
+static int
+listen_accept(int fd)
+{
+	int conn;
+
+#if defined(SOCK_NONBLOCK)
+	conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	if ((conn = accept(fd, NULL, NULL)) >= 0) {
+		(void) fcntl(conn, F_SETFD, FD_CLOEXEC);
+		if (listen_nonblock(conn) < 0) {
+			(void) close(conn);
+			errno = ECONNABORTED;
+			return -1;
+		}
+	}
+#endif
+
+	return conn;
+}
+
+
+/* Create another socket bound to the same address with SO_REUSEPORT */
+static int
+listen_clone(int fd)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss), optlen = sizeof(int);
+	int s, type, on = 1;
+
+	if (getsockname(fd, (struct sockaddr *) &ss, &len) < 0 ||
+			getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &optlen) < 0) {
+		warn("getsockname(2)");
+		return -1;
+	}
+	if ((s = socket(ss.ss_family, type, 0)) < 0) {
+		warn("socket(2)");
+		return -1;
+	}
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+			setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+			bind(s, (struct sockaddr *) &ss, len) < 0 ||
+			listen(s, SOMAXCONN) < 0 ||
+			fcntl(s, F_SETFD, FD_CLOEXEC) < 0 ||
+			listen_nonblock(s) < 0) {
+		warn("unable to create a listening socket");
+		(void) close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+
+/* Free the state after the last reference is dropped */
+static void
+listen_release(void *arg)
+{
+	struct pn_listen *l = arg;
+	unsigned int i;
+
+	for (i = 0; i < l->nshards; i++)
+		(void) close(l->shard[i].ident);
+	(void) pthread_mutex_destroy(&l->mtx);
+	free(l->shard);
+	free(l);
+}
+
+
+/*
+ * Remove the additional sockets from the kernel, and drop the reference of
+ * the watch once no poller can be looking at their watches any more.
+ */
+static void
+listen_shutdown(struct pn_listen *l)
+{
+	unsigned int i;
+
+	for (i = 0; i < l->nshards; i++) {
+		(void) sys->rm_watch(&l->shard[i]);
+
+		/* The shards share the reference of the caller's watch */
+		(void) pn_ref_clear(&l->shard[i].priv);
+	}
+	pn_poller_defer(pn_ref_put, l);
+}
+
+
+/* Try again to accept connections on every socket */
+static void
+listen_retry(void *arg)
+{
+	struct pn_listen *l = arg;
+	unsigned int i;
+
+	MUTEX_LOCK(l->mtx);
+	l->retry = NULL;
+	if (!l->closing) {
+		pn_event_add(l->watch, PN_READ);
+		for (i = 0; i < l->nshards; i++)
+			pn_event_add(&l->shard[i], PN_READ);
+	}
+	MUTEX_UNLOCK(l->mtx);
+	pn_ref_put(l);
+}
+
+
+/**
+ * Set up a WATCH_LISTEN watch, and create and register any additional
+ * sockets. The caller's socket is registered by pnotify_add_watch().
+ */
+int
+pn_listen_open(struct watch *watch, unsigned int shards)
+{
+	struct pn_listen *l;
+	unsigned int i;
+	socklen_t optlen = sizeof(int);
+	int reuse = 0;
+
+	if (listen_nonblock(watch->ident) < 0)
+		return -1;
+	if ((l = calloc(1, sizeof(*l))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	pn_ref_init(&l->ref, listen_release);
+	l->watch = watch;
+	if (pthread_mutex_init(&l->mtx, NULL) != 0) {
+		warn("pthread_mutex_init(3) failed");
+		free(l);
+		return -1;
+	}
+
+	/* Without SO_REUSEPORT, there is only the one socket to accept from */
+#if defined(SO_REUSEPORT)
+	if (shards > 1 && (getsockopt(watch->ident, SOL_SOCKET, SO_REUSEPORT,
+				&reuse, &optlen) < 0 || !reuse))
+		dprintf("fd #%d does not have SO_REUSEPORT set\n", watch->ident);
+#endif
+	if (shards > 1 && reuse) {
+		if ((l->shard = calloc(shards - 1, sizeof(*l->shard))) == NULL) {
+			warn("calloc(3)");
+			listen_release(l);
+			return -1;
+		}
+		for (i = 0; i < shards - 1; i++) {
+			l->shard[i].type = WATCH_LISTEN;
+			l->shard[i].priv = l;
+			if ((l->shard[i].ident = listen_clone(watch->ident)) < 0)
+				goto err;
+			if (sys->add_watch(&l->shard[i]) < 0) {
+				(void) close(l->shard[i].ident);
+				goto err;
+			}
+			l->nshards++;
+		}
+	}
+	watch->priv = l;
+
+	return 0;
+
+err:
+	/* Events may already have been queued for the registered sockets */
+	listen_shutdown(l);
+	return -1;
+}
+
+
+/**
+ * Handle an event for any of the sockets of a WATCH_LISTEN watch.
+ *
+ * This is called by a worker thread instead of the callback.
+ */
+void
+pn_listen_dispatch(struct watch *watch, int mask)
+{
+	struct pn_listen *l = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+	int conn[LISTEN_BATCH];
+	int i, n;
+	bool closing;
+
+	/* The watch has been cancelled; the event still holds the state */
+	if (l == NULL)
+		return;
+
+	for (n = 0; n < LISTEN_BATCH; ) {
+		if ((conn[n] = listen_accept(watch->ident)) >= 0) {
+			n++;
+			continue;
+		}
+		if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+			continue;
+
+		/*
+		 * The kernel will not report the backlog again, so wait for
+		 * some descriptors to be closed and then try again.
+		 */
+		if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+				errno == ENOMEM) {
+			warn("accept(2)");
+			MUTEX_LOCK(l->mtx);
+			if (l->retry == NULL && !l->closing) {
+				pn_ref_hold(l);
+				if ((l->retry = pn_timer_start(LISTEN_RETRY_MS,
+							listen_retry, l)) == NULL)
+					pn_ref_put(l);
+			}
+			MUTEX_UNLOCK(l->mtx);
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			warn("accept(2)");
+		}
+		break;
+	}
+
+	/* Let another worker continue while the callbacks run */
+	if (n == LISTEN_BATCH)
+		pn_event_add(watch, PN_READ);
+
+	/* Nobody wants the connections if the watch was cancelled meanwhile */
+	MUTEX_LOCK(l->mtx);
+	closing = l->closing;
+	MUTEX_UNLOCK(l->mtx);
+	for (i = 0; i < n; i++) {
+		if (closing)
+			(void) close(conn[i]);
+		else
+			l->watch->cb(l->watch, conn[i], l->watch->arg);
+	}
+}
+
+
+/**
+ * Stop accepting connections. The state is freed once the queued events,
+ * any running dispatch and the retry timer are done with it.
+ */
+void
+pn_listen_close(struct watch *watch)
+{
+	struct pn_listen *l;
+	bool stopped = false;
+
+	if ((l = pn_ref_clear(&watch->priv)) == NULL)
+		return;
+
+	MUTEX_LOCK(l->mtx);
+	l->closing = true;
+	if (l->retry != NULL && pn_timer_stop(l->retry) == 0) {
+		l->retry = NULL;
+		stopped = true;
+	}
+	MUTEX_UNLOCK(l->mtx);
+
+	/* Otherwise the expiring timer drops its own reference */
+	if (stopped)
+		pn_ref_put(l);
+
+	listen_shutdown(l);
+}
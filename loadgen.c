@@ -0,0 +1,424 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  loadgen - an open-loop load generator for echod.
+ *
+ *  Usage: loadgen [-p port | -u path] [-c connections] [-r requests/sec]
+ *                 [-d seconds] [-t threads] [-s size] [-P server-pid]
+ *
+ *  Each thread owns an equal share of the connections and of the offered
+ *  load. Requests are sent on a fixed schedule, whether or not the earlier
+ *  ones have been answered, and each request carries the time at which it
+ *  was scheduled. The latency of a request is measured from that time, so
+ *  a server that stalls is charged for every request that should have been
+ *  sent during the stall, not just for the one that was waiting; this is
+ *  the "coordinated omission" that a closed-loop generator suffers from.
+ *
+ *  If the process ID of the server is given, its CPU time during the run
+ *  is read from /proc and divided by the number of responses. The result
+ *  is printed as one line of JSON.
+ *
+ *  This program uses epoll(7) and /proc, so it only runs under Linux.
+ */
+
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+
+/** The largest request size */
+#define MAX_SIZE	4096
+
+/** How long to wait for the responses to the last requests */
+#define DRAIN_NS	1000000000ULL
+
+/** A connection to the server */
+struct conn {
+	int fd;
+
+	/** A partly received response */
+	char buf[MAX_SIZE];
+	size_t len;
+};
+
+/** The state of a generator thread */
+struct generator {
+	pthread_t tid;
+	unsigned int index;
+	struct conn *conn;
+	unsigned int nconn;
+
+	/** The interval between requests sent by this thread */
+	uint64_t interval;
+
+	/** The latency of each response, in ns */
+	uint64_t *lat;
+	size_t nlat, maxlat;
+
+	uint64_t sent, dropped;
+	struct rusage ru;
+};
+
+static const char *PATH;
+static int PORT = 7777;
+static unsigned int CONNS = 1000;
+static unsigned int THREADS = 4;
+static double RATE = 50000;
+static double DURATION = 10;
+static size_t SIZE = 64;
+
+/** The time at which every thread starts sending */
+static uint64_t START;
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "clock_gettime(2)");
+
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+
+static int
+connect_server(void)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	int fd, on = 1;
+
+	if (PATH != NULL) {
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			err(1, "socket(2)");
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, PATH, sizeof(sun.sun_path) - 1);
+		if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+			err(1, "connect(2) to %s", PATH);
+	} else {
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+			err(1, "socket(2)");
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(PORT);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+			err(1, "connect(2) to port %d", PORT);
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+		err(1, "fcntl(2)");
+
+	return fd;
+}
+
+
+/* Send a request that was scheduled for time @a when */
+static void
+send_request(struct generator *g, struct conn *c, uint64_t when)
+{
+	char msg[MAX_SIZE];
+	ssize_t n;
+
+	memset(msg, 0, SIZE);
+	memcpy(msg, &when, sizeof(when));
+	n = write(c->fd, msg, SIZE);
+
+	/* A full socket buffer means that the server is overloaded */
+	if (n == (ssize_t) SIZE) {
+		g->sent++;
+	} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		g->dropped++;
+	} else if (n < 0) {
+		err(1, "write(2)");
+	} else {
+		errx(1, "short write(2) of a request");
+	}
+}
+
+
+static void
+read_responses(struct generator *g, struct conn *c, uint64_t now)
+{
+	uint64_t when;
+	ssize_t n;
+
+	for (;;) {
+		n = read(c->fd, c->buf + c->len, SIZE - c->len);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0)
+			err(1, "read(2)");
+		c->len += n;
+		if (c->len < SIZE)
+			continue;
+
+		memcpy(&when, c->buf, sizeof(when));
+		if (g->nlat < g->maxlat)
+			g->lat[g->nlat++] = now - when;
+		c->len = 0;
+	}
+}
+
+
+static void *
+generator_main(void *arg)
+{
+	struct generator *g = arg;
+	struct epoll_event ev[256];
+	struct itimerspec its;
+	uint64_t next, now, end, drain, wake;
+	unsigned int i, k = 0;
+	int epfd, tfd, n;
+
+	if ((epfd = epoll_create(g->nconn + 1)) < 0)
+		err(1, "epoll_create(2)");
+	for (i = 0; i < g->nconn; i++) {
+		ev[0].events = EPOLLIN;
+		ev[0].data.ptr = &g->conn[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, g->conn[i].fd, &ev[0]) < 0)
+			err(1, "epoll_ctl(2)");
+	}
+
+	/*
+	 * The epoll_wait(2) timeout is in milliseconds, which is too coarse
+	 * for the schedule, so a timerfd wakes the thread instead.
+	 */
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+		err(1, "timerfd_create(2)");
+	ev[0].events = EPOLLIN;
+	ev[0].data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev[0]) < 0)
+		err(1, "epoll_ctl(2)");
+	memset(&its, 0, sizeof(its));
+
+	/* Stagger the threads over one interval */
+	next = START + g->interval * g->index / THREADS;
+	end = START + (uint64_t) (DURATION * 1e9);
+	drain = end + DRAIN_NS;
+
+	for (;;) {
+		now = now_ns();
+
+		/* Send every request that is due, even if some are late */
+		while (next <= now && next < end) {
+			send_request(g, &g->conn[k++ % g->nconn], next);
+			next += g->interval;
+		}
+		if (now >= drain || (next >= end && g->nlat >= g->sent))
+			break;
+
+		wake = (next < end) ? next : drain;
+		its.it_value.tv_sec = wake / 1000000000;
+		its.it_value.tv_nsec = wake % 1000000000;
+		if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+			err(1, "timerfd_settime(2)");
+		if ((n = epoll_wait(epfd, ev, 256, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "epoll_wait(2)");
+		}
+		now = now_ns();
+		for (i = 0; i < (unsigned int) n; i++) {
+			if (ev[i].data.ptr == NULL)
+				(void) read(tfd, &wake, sizeof(wake));
+			else
+				read_responses(g, ev[i].data.ptr, now);
+		}
+	}
+
+	if (getrusage(RUSAGE_THREAD, &g->ru) < 0)
+		err(1, "getrusage(2)");
+	(void) close(tfd);
+	(void) close(epfd);
+
+	return NULL;
+}
+
+
+/* Get the CPU time of a process, in microseconds */
+static uint64_t
+proc_cpu_us(pid_t pid)
+{
+	unsigned long utime, stime;
+	char path[64], buf[1024], *p;
+	FILE *f;
+
+	(void) snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	if (fgets(buf, sizeof(buf), f) == NULL)
+		err(1, "%s", path);
+	(void) fclose(f);
+
+	/* The command name may contain spaces, so skip past it */
+	if ((p = strrchr(buf, ')')) == NULL ||
+			sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				&utime, &stime) != 2)
+		errx(1, "%s: unexpected format", path);
+
+	return ((uint64_t) (utime + stime) * 1000000 / sysconf(_SC_CLK_TCK));
+}
+
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+static double
+percentile_us(const uint64_t *lat, size_t n, double pct)
+{
+	if (n == 0)
+		return 0;
+	return lat[MIN((size_t) (pct / 100 * n), n - 1)] / 1000.0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct generator *g;
+	struct rlimit rl;
+	uint64_t *lat, sent = 0, dropped = 0, client_us = 0, server_us = 0;
+	uint64_t elapsed;
+	size_t nlat = 0;
+	pid_t server = 0;
+	unsigned int i, j, c;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "p:u:c:r:d:t:s:P:")) != -1) {
+		switch (ch) {
+		case 'p': PORT = atoi(optarg); break;
+		case 'u': PATH = optarg; break;
+		case 'c': CONNS = strtoul(optarg, NULL, 10); break;
+		case 'r': RATE = atof(optarg); break;
+		case 'd': DURATION = atof(optarg); break;
+		case 't': THREADS = strtoul(optarg, NULL, 10); break;
+		case 's': SIZE = strtoul(optarg, NULL, 10); break;
+		case 'P': server = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: loadgen [-p port | -u path] [-c connections] "
+					"[-r requests/sec] [-d seconds] [-t threads] "
+					"[-s size] [-P server-pid]\n");
+			exit(1);
+		}
+	}
+	if (THREADS == 0 || CONNS < THREADS || RATE <= 0 || DURATION <= 0 ||
+			SIZE < sizeof(uint64_t) || SIZE > MAX_SIZE)
+		errx(1, "invalid arguments");
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		(void) setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	/* Open every connection before the clock starts */
+	if ((g = calloc(THREADS, sizeof(*g))) == NULL)
+		err(1, "calloc(3)");
+	for (i = 0; i < THREADS; i++) {
+		g[i].index = i;
+		g[i].nconn = CONNS / THREADS + (i < CONNS % THREADS);
+		if ((g[i].conn = calloc(g[i].nconn, sizeof(struct conn))) == NULL)
+			err(1, "calloc(3)");
+		for (j = 0; j < g[i].nconn; j++)
+			g[i].conn[j].fd = connect_server();
+		g[i].interval = (uint64_t) (1e9 * THREADS / RATE);
+		if (g[i].interval == 0)
+			g[i].interval = 1;
+		g[i].maxlat = (size_t) (RATE / THREADS * DURATION) + 16;
+		if ((g[i].lat = malloc(g[i].maxlat * sizeof(uint64_t))) == NULL)
+			err(1, "malloc(3)");
+	}
+
+	if (server > 0)
+		server_us = proc_cpu_us(server);
+	START = now_ns() + 10000000;
+	for (i = 0; i < THREADS; i++) {
+		if (pthread_create(&g[i].tid, NULL, generator_main, &g[i]) != 0)
+			errx(1, "pthread_create(3) failed");
+	}
+	for (i = 0; i < THREADS; i++)
+		(void) pthread_join(g[i].tid, NULL);
+	elapsed = now_ns() - START;
+	if (server > 0)
+		server_us = proc_cpu_us(server) - server_us;
+
+	/* Combine the results of every thread */
+	for (i = 0; i < THREADS; i++)
+		nlat += g[i].nlat;
+	if ((lat = malloc((nlat + 1) * sizeof(*lat))) == NULL)
+		err(1, "malloc(3)");
+	for (i = 0, nlat = 0; i < THREADS; i++) {
+		memcpy(lat + nlat, g[i].lat, g[i].nlat * sizeof(*lat));
+		nlat += g[i].nlat;
+		sent += g[i].sent;
+		dropped += g[i].dropped;
+		client_us += g[i].ru.ru_utime.tv_sec * 1000000 + g[i].ru.ru_utime.tv_usec +
+			g[i].ru.ru_stime.tv_sec * 1000000 + g[i].ru.ru_stime.tv_usec;
+		for (c = 0; c < g[i].nconn; c++)
+			(void) close(g[i].conn[c].fd);
+	}
+	qsort(lat, nlat, sizeof(*lat), u64_cmp);
+
+	printf("{\"conns\":%u,\"threads\":%u,\"size\":%zu,\"offered_rps\":%.0f,"
+			"\"duration\":%.3f,\"sent\":%llu,\"received\":%zu,\"dropped\":%llu,"
+			"\"lost\":%llu,\"throughput_rps\":%.0f,\"p50_us\":%.1f,"
+			"\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+			"\"client_cpu_us_per_req\":%.2f",
+			CONNS, THREADS, SIZE, RATE, DURATION,
+			(unsigned long long) sent, nlat, (unsigned long long) dropped,
+			(unsigned long long) (sent - MIN(sent, nlat)),
+			nlat / DURATION,
+			percentile_us(lat, nlat, 50), percentile_us(lat, nlat, 99),
+			percentile_us(lat, nlat, 99.9),
+			(nlat > 0) ? lat[nlat - 1] / 1000.0 : 0.0,
+			(nlat > 0) ? (double) client_us / nlat : 0.0);
+	if (server > 0)
+		printf(",\"server_cpu_us_per_req\":%.2f",
+				(nlat > 0) ? (double) server_us / nlat : 0.0);
+	printf(",\"elapsed\":%.3f}\n", elapsed / 1e9);
+
+	exit(0);
+}
@@ -27,8 +27,10 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/param.h>
 #include <sys/types.h>
@@ -39,6 +41,11 @@
 #include "pnotify.h"
 #include "queue.h"
 
+/* STAILQ_LAST() in queue.h uses the BSD name for offsetof() */
+#ifndef __offsetof
+# define __offsetof(type, field) offsetof(type, field)
+#endif
+
 /* kqueue(4) in MacOS/X does not support NOTE_TRUNCATE */
 #ifndef NOTE_TRUNCATE
 # define NOTE_TRUNCATE 0
@@ -53,24 +60,216 @@ struct event {
 	/** One or more bitflags containing the event(s) that occurred */
 	int       mask;
 
+	/** The pathname of the affected file, if any */
+	char     *path;
+
+	/** For tasks, a function to be called by a worker thread */
+	void    (*func)(void *);
+	void     *arg;
+
+	/** For tasks, a WATCH_USER watch to post to when the task is done */
+	struct watch *done;
+
+	/** The next task in a worker's inbox */
+	struct event *next;
+
+	/** The monotonic time (in ns) when the event was queued */
+	uint64_t enqueued;
+
+	/** A reference to the private state of the watch, see ref.c */
+	void     *ref;
+
 	STAILQ_ENTRY(event) entries;
 };
 
+STAILQ_HEAD(pn_eventq, event);
+
+/** The number of event queues, one for each priority */
+#define PN_PRIO_COUNT	(PN_PRIO_HIGH - PN_PRIO_LOW + 1)
+
+/** The event queue of a priority; the highest priority is first */
+#define PN_PRIO_QUEUE(prio)	(PN_PRIO_HIGH - (prio))
+
+/** The number of consecutive events taken from a queue before the one below gets a turn */
+#define PN_PRIO_BURST	8
+
+/* Defined in pnotify.c */
+extern struct pn_eventq EVENT[PN_PRIO_COUNT];
+extern pthread_mutex_t EVENT_MUTEX;
+extern unsigned int POLLER_COUNT;
+extern pthread_mutex_t WATCH_MUTEX;
+extern pthread_mutex_t TIMER_MUTEX;
+void pn_event_removed_locked(void);
+void pn_event_throttle(void);
+size_t pn_event_count(void);
+
+/** A worker thread */
+struct pn_worker {
+
+	/** Tasks submitted to this worker, most recent first */
+	struct event *inbox;
+
+	/** Tasks pinned to this worker, which no other worker takes */
+	struct event *pinned;
+
+	/** Tasks taken from an inbox by this worker, in submission order */
+	struct event *local;
+
+	/** The position of the worker in WORKER, or -1 outside the pool */
+	int index;
+
+	/** The number of events taken in a row while tasks were waiting */
+	unsigned int streak;
+
+	/** How long to spin before sleeping, in ns; see pnotify_spin_limit() */
+	uint64_t spin;
+
+	/** If true, the worker is sleeping on its condition variable */
+	bool idle;
+	pthread_cond_t cond;
+	LIST_ENTRY(pn_worker) entries;
+
+	pthread_t tid;
+
+} __attribute__((aligned(64)));
+
+/* Defined in worker.c */
+extern struct pn_worker *WORKER;
+extern size_t WORKER_COUNT;
+void pn_worker_init(size_t count);
+void pn_worker_wake(struct pn_worker *target);
+void pn_worker_wake_locked(struct pn_worker *target);
+size_t pn_worker_idle(void);
+
+/* Defined in trace.c */
+extern int TRACE_ENABLED;
+void pn_trace_write(int type, const struct watch *watch, void (*func)(void *), int mask);
+
+/** Write a trace record, if tracing is enabled */
+#define PN_TRACE(type, watch, func, mask) do {				\
+	if (__builtin_expect(__atomic_load_n(&TRACE_ENABLED, __ATOMIC_RELAXED), 0)) \
+		pn_trace_write((type), (watch), (func), (mask));	\
+} while (0)
+
+/** Tell the CPU that this thread is spinning */
+#if defined(__x86_64__) || defined(__i386__)
+# define PN_CPU_RELAX()		__builtin_ia32_pause()
+#elif defined(__aarch64__)
+# define PN_CPU_RELAX()		__asm__ __volatile__("yield")
+#else
+# define PN_CPU_RELAX()		do { } while (0)
+#endif
+
+/* Defined in record.c */
+extern int RECORD_ENABLED;
+void pn_record_write(int op, const struct watch *watch, int mask);
+
+/** Write an event record, if recording is enabled */
+#define PN_RECORD(op, watch, mask) do {					\
+	if (__builtin_expect(__atomic_load_n(&RECORD_ENABLED, __ATOMIC_RELAXED), 0)) \
+		pn_record_write((op), (watch), (mask));			\
+} while (0)
+
+/* Defined in stats.c */
+extern __thread struct pnotify_stats *STATS_SELF;
+struct pnotify_stats * pn_stats_alloc(void);
+void pn_hist_record(struct pn_histogram *hist, uint64_t value);
+void pn_mutex_wait(pthread_mutex_t *mtx);
+
+/** The statistics of the current thread */
+#define PN_STATS()	((STATS_SELF != NULL) ? STATS_SELF : pn_stats_alloc())
+
+/**
+ * Add to a counter of the current thread. Only this thread writes to it,
+ * so a plain store is enough, and it does not tear for concurrent readers.
+ */
+#define PN_STAT_ADD(field, n) \
+	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+/** The reference count at the start of the private state of a watch */
+struct pn_ref {
+	unsigned int count;		/** The number of references */
+	void (*release)(void *);	/** Frees the state after the last one is dropped */
+};
+
+/* Defined in ref.c */
+void pn_ref_init(struct pn_ref *ref, void (*release)(void *));
+void * pn_ref_get(void **slot);
+void pn_ref_put(void *obj);
+void * pn_ref_clear(void **slot);
+void pn_ref_hold(void *obj);
+void pn_poller_init(unsigned int count);
+void pn_poller_defer(void (*func)(void *), void *arg);
+void pn_poller_quiescent(void);
+
 /** A timer */
 struct timer {
-	time_t expires;		 /** The time after which the timer expires */
+	uint64_t expires;	 /** The monotonic time (in ms) after which the timer expires */
+	size_t index;		 /** The position of the timer within the heap */
 	struct watch *watch;	 /** The watch associated with the timer event */
-	LIST_ENTRY(timer) entries; /** Pointers to the next and previous list entries */
+	void (*func)(void *);	 /** For internal timers, the function to call instead */
+	void *arg;		 /** The argument passed to func */
+};
+
+
+/** An entry in a pn_hash table */
+struct pn_hash_entry {
+	void    *key;		/** A copy of the key, stored after the entry */
+	size_t   keylen;	/** The length of the key, in bytes */
+	uint32_t hash;		/** The hash value of the key */
+	void    *value;		/** The value associated with the key */
+	LIST_ENTRY(pn_hash_entry) entries;
+};
+
+/** A chained hash table keyed by arbitrary byte strings */
+struct pn_hash {
+	LIST_HEAD(, pn_hash_entry) *bucket;
+	size_t nbuckets;
+	size_t count;
+};
+
+/** The state of a WATCH_PROC watch */
+struct pn_proc {
+
+	/** Each event for the watch holds a reference */
+	struct pn_ref ref;
+
+	/** Under Linux, a pidfd for the child process */
+	int pidfd;
+
+	/** If true, the exit status has been reported */
+	bool done;
 };
 
+/** The state of a WATCH_TAIL watch */
+struct pn_tail {
+	struct pn_ref ref;	/** Each event for the watch holds a reference */
+	int     fd;		/** The file being read, or -1 if it does not exist */
+	dev_t   dev;		/** The device containing the file */
+	ino_t   ino;		/** The inode number of the file */
+	off_t   offset;		/** The offset of the first byte not yet delivered */
+	char   *buf;		/** A buffer for pread(2) */
+
+	/* Linux: an inotify instance watching the file and its directory */
+	int     notify_fd;
+	int     wd_dir;
+	int     wd_file;
+
+	/** A mutex to serialize reads from the file */
+	pthread_mutex_t mtx;
+};
 
 /* Defined in signal.c */
 extern struct watch *SIG_WATCH[NSIG + 1];
 
-/* TODO - not used yet */
+/** The size of each buffer in a pnotify_buffer chain */
+#define PN_BUFFER_SIZE	4096
+
+/** Reading stops when this much input is waiting to be consumed */
+#define PN_BUFFER_MAX_INPUT	(1024 * 1024)
+
 /** An entry within a pnotify_buffer chain */
 struct pn_buffer {
-	char data[4096];
 
 	/** The position, in bytes, within the buffer.
 	 *
@@ -79,29 +278,49 @@ struct pn_buffer {
 	 * where the previous operation finished.
 	 */
 	size_t pos;
+
+	/** The number of bytes of data in the buffer, including any before pos */
+	size_t len;
+
+	STAILQ_ENTRY(pn_buffer) entries;
+
+	char data[PN_BUFFER_SIZE];
 };
 
-/* TODO - not used yet */
-/** A linked list of buffers used to store the incoming and outgoing data 
- *  for a file descriptor.
- **/
+STAILQ_HEAD(pn_buffer_chain, pn_buffer);
+
+/** The incoming and outgoing data for a WATCH_BUFFER watch */
 struct pnotify_buffer {
 
+	/** The reference count; each event for the watch holds a reference */
+	struct pn_ref ref;
+
 	/** Input buffer */
-	STAILQ_HEAD(, pn_buffer) in;
+	struct pn_buffer_chain in;
 
 	/** Output buffer */
-	STAILQ_HEAD(, pn_buffer) out;
+	struct pn_buffer_chain out;
 
-	/** The position, in bytes, within the head of the `out' queue.
-	 *
-	 * When multiple lines are contained in a single buffer entry,
-	 * the reader's position is stored in the in_pos variable.
-	 *
-	 * An entry is freed when all its data has been written to the 
-	 * file descriptor.
-	 */
-	size_t out_pos;
+	/** The number of bytes in each chain that have not been consumed */
+	size_t in_len, out_len;
+
+	/** If true, PN_WRITE is enabled in the kernel event queue */
+	bool want_write;
+
+	/** If true, reading stopped because the input buffer is full */
+	bool throttled;
+
+	/** If true, the remote end has closed the connection */
+	bool eof;
+
+	/** The errno value of a failed read or write, or zero */
+	int error;
+
+	/** If not NULL, the input is split into records; holds a reference */
+	struct pn_frame *framing;
+
+	/** A mutex to protect all of the above */
+	pthread_mutex_t mtx;
 };
 
 /* The 'dprintf' macro is used for printf() debugging */
@@ -118,30 +337,183 @@ struct pnotify_buffer {
 void * pn_signal_loop(void *);
 void * timer_loop(void *);
 void pn_event_add(struct watch *watch, int mask);
+void pn_event_add_path(struct watch *watch, int mask, const char *path);
+void pn_event_enqueue(struct watch *watch, int mask, const char *path);
+void pn_task_add(void (*func)(void *), void *arg);
 void pn_mask_signals();
 int pn_add_timer(struct watch *watch);
 int pn_rm_timer(struct watch *watch);
+void pn_timer_init(void);
+struct timer * pn_timer_start(unsigned int msec, void (*func)(void *), void *arg);
+int pn_timer_stop(struct timer *timer);
+uint64_t pn_time_ms(void);
+uint64_t pn_time_ns(void);
+size_t pn_timer_count(void);
+
+/* Defined in hash.c */
+uint32_t pn_hash_fnv(const void *key, size_t keylen);
+int pn_hash_init(struct pn_hash *h, size_t nbuckets);
+void * pn_hash_lookup(struct pn_hash *h, const void *key, size_t keylen);
+void * pn_hash_insert(struct pn_hash *h, const void *key, size_t keylen, void *value);
+void * pn_hash_remove(struct pn_hash *h, const void *key, size_t keylen);
+void pn_hash_clear(struct pn_hash *h, void (*free_value)(void *));
+void pn_hash_destroy(struct pn_hash *h, void (*free_value)(void *));
+
+/* Defined in debounce.c */
+bool pn_debounce_add(struct watch *watch, int mask, const char *path);
+void pn_debounce_cancel(struct watch *watch);
+
+/* Defined in checksum.c */
+uint32_t pn_crc32c(uint32_t crc, const void *buf, size_t len);
+bool pn_checksum_filter(struct watch *watch, const char *path, int mask);
+void pn_checksum_cancel(struct watch *watch);
+
+/* Defined in buffer.c */
+struct pn_buffer * pn_buffer_alloc(void);
+void pn_buffer_free(struct pn_buffer *buf);
+int pn_buffer_open(struct watch *watch);
+void pn_buffer_dispatch(struct watch *watch, int mask);
+void pn_buffer_close(struct watch *watch);
+
+/* Defined in frame.c */
+size_t pn_frame_collect(struct pnotify_buffer *b, struct pn_frame **fp);
+void pn_frame_deliver(struct watch *watch, struct pn_frame *f);
+
+/* Defined in forward.c */
+int pn_forward_open(struct watch *watch, int out_fd);
+void pn_forward_dispatch(struct watch *watch, int mask);
+void pn_forward_close(struct watch *watch);
+
+/* Defined in listen.c */
+int pn_listen_open(struct watch *watch, unsigned int shards);
+void pn_listen_dispatch(struct watch *watch, int mask);
+void pn_listen_close(struct watch *watch);
+
+/* Defined in dgram.c */
+void pn_dgram_dispatch(struct watch *watch, int mask);
+
+/* Defined in proc.c */
+int pn_proc_open(struct watch *watch);
+void pn_proc_dispatch(struct watch *watch, int mask);
+void pn_proc_close(struct watch *watch);
+
+/* Defined in user.c */
+int pn_user_open(struct watch *watch);
+void pn_user_dispatch(struct watch *watch, int mask);
+void pn_user_close(struct watch *watch);
+
+/* Defined in tail.c */
+int pn_tail_open(struct watch *watch);
+void pn_tail_dispatch(struct watch *watch, int mask);
+void pn_tail_close(struct watch *watch);
+
+/** A file or directory within a tree */
+struct pn_tree_rec {
+	uint64_t ino;
+	int64_t  mtime;		/** The modification time, in nanoseconds */
+	int64_t  size;
+	uint32_t name;		/** The filename, in the string table */
+	uint32_t mode;
+};
+
+/** A directory within a tree */
+struct pn_tree_dir {
+	uint64_t ino;
+	int64_t  mtime;		/** The modification time, in nanoseconds */
+	uint32_t path;		/** The pathname relative to the root, in the string table */
+	uint32_t first;		/** The index of the first record for this directory */
+	uint32_t count;		/** The number of records for this directory */
+	uint32_t pad;
+};
+
+/**
+ * The state of a tree, as a table of directories sorted with
+ * pn_tree_pathcmp(), a table of records grouped by directory and sorted
+ * by name, and a string table. The sizes are zero if the tables are not
+ * owned by the structure, such as those of a mapped snapshot file.
+ */
+struct pn_tree {
+	struct pn_tree_dir *dir;
+	size_t ndirs, dirsz;
+	struct pn_tree_rec *rec;
+	size_t nrecs, recsz;
+	char  *str;
+	size_t strlen, strsz;
+};
+
+/** A walk through the entries of one directory in two trees, by name */
+struct pn_tree_merge {
+	const struct pn_tree *old;
+	const struct pn_tree_dir *dir;	/** The directory in @a old, or NULL */
+	const struct pn_tree *cur;	/** The entries of the directory now */
+	size_t i, j;
+};
+
+/* Defined in tree.c */
+int pn_tree_join(char *buf, size_t bufsz, const char *dir, const char *name);
+int pn_tree_pathcmp(const char *a, const char *b);
+int pn_tree_stat(int dfd, const char *name, struct pn_tree_rec *rec);
+int pn_tree_changed(const struct pn_tree_rec *old, const struct pn_tree_rec *cur);
+const char * pn_tree_str(const struct pn_tree *t, uint32_t off);
+uint32_t pn_tree_string(struct pn_tree *t, const char *s);
+size_t pn_tree_add_dir(struct pn_tree *t, const char *rel);
+void pn_tree_append(struct pn_tree *t, const struct pn_tree *src, size_t first, size_t count);
+void pn_tree_readdir(DIR *dirp, struct pn_tree *t);
+const struct pn_tree_dir * pn_tree_find_dir(const struct pn_tree *t, const char *rel);
+void pn_tree_emit(struct watch *watch, const char *root, const char *rel, int mask);
+int pn_tree_delete(const struct pn_tree *t, struct watch *watch, const char *root, const char *rel);
+void pn_tree_merge_init(struct pn_tree_merge *m, const struct pn_tree *old,
+		const struct pn_tree_dir *dir, const struct pn_tree *cur);
+bool pn_tree_merge_next(struct pn_tree_merge *m, const char **name,
+		const struct pn_tree_rec **old, const struct pn_tree_rec **cur);
+void pn_tree_free(struct pn_tree *t);
+
+/* Defined in poll.c */
+bool pn_poll_required(const char *path);
+int pn_poll_open(struct watch *watch);
+void pn_poll_close(struct watch *watch);
+
+/* Defined in fsnotify.c */
+int linux_fs_open(struct watch *watch);
+void linux_fs_read(struct watch *watch);
+void linux_fs_close(struct watch *watch);
+int linux_tail_open(struct watch *watch);
+void linux_tail_read(struct watch *watch);
+void linux_tail_close(struct watch *watch);
 
 /* vtable for system-specific functions */
 struct pnotify_vtable {
 	void (*init_once)(void);
 	int (*add_watch)(struct watch *);
 	int (*rm_watch)(struct watch *);
+	int (*mod_watch)(struct watch *, int);
 	void (*cleanup)();
+
+	/** Set the busy polling time of the kernel, or NULL if there is none */
+	int (*busy_poll)(unsigned int);
+
+	/** Wake up a WATCH_USER watch, or NULL to write to its eventfd */
+	void (*post)(struct watch *);
 };
-extern const struct pnotify_vtable * const sys;
+extern const struct pnotify_vtable *sys;
 extern const struct pnotify_vtable LINUX_VTABLE;
 extern const struct pnotify_vtable BSD_VTABLE;
+extern const struct pnotify_vtable SIM_VTABLE;
 
 /*
  * Convenience macros for locking/unlocking mutexes.
  */
 #define MUTEX_DEBUG 0
 
+/*
+ * An uncontended lock costs one extra branch. When the mutex is held by
+ * another thread, pn_mutex_wait() measures how long it takes to get it.
+ */
 #define MUTEX_LOCK(st)		do {					\
    if (MUTEX_DEBUG) 							\
 	printf("%s takes the lock\n", __func__);			\
-   (void) pthread_mutex_lock(&st);					\
+   if (pthread_mutex_trylock(&st) != 0)					\
+	pn_mutex_wait(&st);						\
 } while (0)
 
 #define MUTEX_UNLOCK(st)	do {					\
@@ -20,6 +20,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -40,29 +41,54 @@
  *
 */
 
-/* All worker threads */
-pthread_t *WORKER;
-size_t WORKER_COUNT = 0;
-
-/** A global list of events that are ready to be delivered */
-STAILQ_HEAD(, event) EVENT;
+/** The events that are ready to be delivered, one list for each priority */
+struct pn_eventq EVENT[PN_PRIO_COUNT];
 pthread_mutex_t EVENT_MUTEX;
-pthread_cond_t EVENT_COND;
 
-/* Define the system-specific vtable.  */
+/** The number of events in EVENT, protected by EVENT_MUTEX */
+static size_t EVENT_COUNT;
+
+/** The watermarks that pause and resume reading events from the kernel */
+static size_t EVENT_HIGH = 65536;
+static size_t EVENT_LOW = 32768;
+
+/** Signalled when the queue drains while reading is paused */
+static pthread_cond_t EVENT_DRAIN = PTHREAD_COND_INITIALIZER;
+
+/** The number of poller threads that are paused */
+static unsigned int EVENT_PAUSED;
+
+/** The number of threads waiting for kernel events */
+unsigned int POLLER_COUNT = 1;
+
+/* Define the system-specific vtable. It may be replaced by pnotify_init(). */
 #if defined(BSD)
-const struct pnotify_vtable * const sys = &BSD_VTABLE;
+const struct pnotify_vtable *sys = &BSD_VTABLE;
 #elif defined(__linux__)
-const struct pnotify_vtable * const sys = &LINUX_VTABLE;
+const struct pnotify_vtable *sys = &LINUX_VTABLE;
 #endif
 
 /** A list of watched files and/or directories */
 LIST_HEAD(pnwatchhead, watch) WATCH;
 pthread_mutex_t WATCH_MUTEX = PTHREAD_MUTEX_INITIALIZER;
 
-/* Defined in timer.c */
-extern LIST_HEAD(, timer) TIMER;
-extern pthread_mutex_t TIMER_MUTEX;
+/* Get a thread count from the environment, or @a def if it is not set */
+static int
+get_env_count(const char *name, int def)
+{
+	const char *s;
+	long n;
+
+	if ((s = getenv(name)) == NULL)
+		return def;
+	if ((n = strtol(s, NULL, 10)) < 1 || n > 1024) {
+		warnx("ignoring invalid %s=%s", name, s);
+		return def;
+	}
+
+	return n;
+}
+
 
 static int
 get_cpu_count(void)
@@ -79,6 +105,11 @@ get_cpu_count(void)
 
 	/* FIXME - error checking */
 	return ((int) strtol((char *) &buf, NULL, 10));
+#elif defined(__linux__)
+	long ncpu;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+		return ((int) ncpu);
 #endif
 	
 	return 1;
@@ -87,9 +118,22 @@ get_cpu_count(void)
 static void
 pnotify_init_once(void)
 {
+	const char *backend;
 	pthread_t tid;
 	int i;
 
+	/* Initialize global data structures */
+	LIST_INIT(&WATCH);
+	pn_timer_init();
+	for (i = 0; i < PN_PRIO_COUNT; i++)
+		STAILQ_INIT(&EVENT[i]);
+
+	/* Initialize synchronization primitives */
+	if (pthread_mutex_init(&EVENT_MUTEX, NULL) != 0) {
+		warn("pthread_mutex_init(3) failed");
+		return;
+	}
+
 	/* Block all signals */
 	pn_mask_signals();
 
@@ -102,38 +146,20 @@ pnotify_init_once(void)
 		errx(1, "pthread_create(3) failed");
 
 	/* Create a pool of worker threads */
-	WORKER_COUNT = get_cpu_count();
-	WORKER = calloc(WORKER_COUNT, sizeof(pthread_t));
-	for (i = 0; i < WORKER_COUNT; i++) {
-		if (pthread_create(&WORKER[i], NULL, (void *(*)(void *)) event_dispatch, NULL) != 0)
-			errx(1, "pthread_create(3) failed");
-	}
-
-	/* Initialize global data structures */
-	LIST_INIT(&WATCH);
-	LIST_INIT(&TIMER);
-	STAILQ_INIT(&EVENT);
-
-	/* Initialize synchronization primitives */
-	if (pthread_mutex_init(&EVENT_MUTEX, NULL) != 0) {
-		warn("pthread_mutex_init(3) failed");
-		goto err1;
-	}
-	if (pthread_cond_init(&EVENT_COND, NULL) != 0) {
-		warn("pthread_cond_init(3) failed");
-		goto err2;
+	pn_worker_init(get_env_count("PNOTIFY_WORKERS", get_cpu_count()));
+	POLLER_COUNT = get_env_count("PNOTIFY_POLLERS", 1);
+	pn_poller_init(POLLER_COUNT);
+
+	/* Take events from memory instead of the kernel, see sim.c */
+	if ((backend = getenv("PNOTIFY_BACKEND")) != NULL) {
+		if (strcmp(backend, "sim") == 0)
+			sys = &SIM_VTABLE;
+		else if (strcmp(backend, "kernel") != 0)
+			warnx("ignoring unknown PNOTIFY_BACKEND=%s", backend);
 	}
 
 	/* Perform system-specific initialization */
 	sys->init_once();
-
-	return;
-
-err2:
-	(void) pthread_cond_destroy(&EVENT_COND);
-
-err1:
-	(void) pthread_mutex_destroy(&EVENT_MUTEX);
 }
 
 
@@ -150,9 +176,40 @@ pnotify_init(void)
 int
 pnotify_add_watch(struct watch *watch)
 {
+	/* Control-plane events should not wait behind I/O */
+	if (watch->type == WATCH_SIGNAL || watch->type == WATCH_TIMER)
+		watch->priority = PN_PRIO_HIGH;
+
+	/* Open the file to be tailed */
+	if (watch->type == WATCH_TAIL && pn_tail_open(watch) != 0)
+		return -1;
+	if (watch->type == WATCH_BUFFER && pn_buffer_open(watch) != 0)
+		return -1;
+	if (watch->type == WATCH_PROC && pn_proc_open(watch) != 0)
+		return -1;
+	if (watch->type == WATCH_USER && pn_user_open(watch) != 0)
+		return -1;
+
+	/* Poll filesystems that the kernel cannot watch */
+	if (watch->type == WATCH_MOUNT && pn_poll_required(watch->path))
+		watch->type = WATCH_POLL;
+	if (watch->type == WATCH_POLL) {
+		if (pn_poll_open(watch) != 0)
+			return -1;
+
 	/* Register the watch with the kernel */
-	if (sys->add_watch(watch) < 0) {
+	} else if (watch->type != WATCH_FORWARD && sys->add_watch(watch) < 0) {
 		warn("adding watch failed");
+		if (watch->type == WATCH_TAIL)
+			pn_tail_close(watch);
+		if (watch->type == WATCH_BUFFER)
+			pn_buffer_close(watch);
+		if (watch->type == WATCH_LISTEN)
+			pn_listen_close(watch);
+		if (watch->type == WATCH_PROC)
+			pn_proc_close(watch);
+		if (watch->type == WATCH_USER)
+			pn_user_close(watch);
 		return -1;
 	}
 
@@ -163,16 +220,60 @@ pnotify_add_watch(struct watch *watch)
 	}
 
 	else if (watch->type == WATCH_SIGNAL) {
-		pthread_mutex_lock(&WATCH_MUTEX);
+		MUTEX_LOCK(WATCH_MUTEX);
 		SIG_WATCH[watch->ident] = watch;
-		pthread_mutex_unlock(&WATCH_MUTEX);
+		MUTEX_UNLOCK(WATCH_MUTEX);
 	}
 
 
 	/* Add the watch to the watchlist */
-	pthread_mutex_lock(&WATCH_MUTEX);
+	MUTEX_LOCK(WATCH_MUTEX);
 	LIST_INSERT_HEAD(&WATCH, watch, entries);
-	pthread_mutex_unlock(&WATCH_MUTEX);
+	MUTEX_UNLOCK(WATCH_MUTEX);
+	PN_RECORD(PN_RECORD_ADD, watch, 0);
+
+	return 0;
+}
+
+
+int
+pnotify_queue_limit(size_t high, size_t low)
+{
+	if (high > 0 && low >= high) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	MUTEX_LOCK(EVENT_MUTEX);
+	EVENT_HIGH = high;
+	EVENT_LOW = low;
+	(void) pthread_cond_broadcast(&EVENT_DRAIN);
+	MUTEX_UNLOCK(EVENT_MUTEX);
+
+	return 0;
+}
+
+
+int
+pnotify_busy_poll(unsigned int usecs)
+{
+	if (sys->busy_poll == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	return sys->busy_poll(usecs);
+}
+
+
+int
+watch_priority(struct watch *watch, enum pn_priority prio)
+{
+	if (prio < PN_PRIO_LOW || prio > PN_PRIO_HIGH) {
+		errno = EINVAL;
+		return -1;
+	}
+	watch->priority = prio;
 
 	return 0;
 }
@@ -181,6 +282,13 @@ pnotify_add_watch(struct watch *watch)
 int 
 watch_cancel(struct watch *watch)
 {
+	PN_TRACE(PN_TRACE_CANCEL, watch, NULL, 0);
+	PN_RECORD(PN_RECORD_CANCEL, watch, 0);
+
+	/* Deliver any events that are being coalesced */
+	pn_debounce_cancel(watch);
+	pn_checksum_cancel(watch);
+
 	/* Unregister the kernel event */
 	/* TODO: error handling in this switch statement */
 	switch (watch->type) {
@@ -188,6 +296,39 @@ watch_cancel(struct watch *watch)
 			(void) pn_rm_timer(watch);
 			break;
 
+		case WATCH_TAIL:
+			(void) sys->rm_watch(watch);
+			pn_tail_close(watch);
+			break;
+
+		case WATCH_POLL:
+			pn_poll_close(watch);
+			break;
+
+		case WATCH_BUFFER:
+			(void) sys->rm_watch(watch);
+			pn_buffer_close(watch);
+			break;
+
+		case WATCH_FORWARD:
+			pn_forward_close(watch);
+			break;
+
+		case WATCH_LISTEN:
+			(void) sys->rm_watch(watch);
+			pn_listen_close(watch);
+			break;
+
+		case WATCH_PROC:
+			(void) sys->rm_watch(watch);
+			pn_proc_close(watch);
+			break;
+
+		case WATCH_USER:
+			(void) sys->rm_watch(watch);
+			pn_user_close(watch);
+			break;
+
 		default: 
 			(void) sys->rm_watch(watch);
 			break;
@@ -202,31 +343,6 @@ watch_cancel(struct watch *watch)
 }
 
 
-struct event * 
-event_wait(void)
-{ 
-	struct event *evp;
-
-	/* Wait for an event to be added to the queue */
-	MUTEX_LOCK(EVENT_MUTEX);
-retry:
-	if (pthread_cond_wait(&EVENT_COND, &EVENT_MUTEX) != 0) {
-		warn("pthread_cond_wait(3) failed");
-		return NULL;
-	}
-
-	/* Shift the first element off of the pending event queue */
-	if ((evp = STAILQ_FIRST(&EVENT)) != NULL) {
-		STAILQ_REMOVE_HEAD(&EVENT, entries);
-		MUTEX_UNLOCK(EVENT_MUTEX);
-		return evp;
-	}
-
-	/* Handle a spurious wakeup */
-	goto retry;
-}
-
-
 static struct watch *
 _watch_add(enum pn_watch_type wtype, int fd, const char *path, void (*cb)(), void *arg)
 {
@@ -241,9 +357,14 @@ _watch_add(enum pn_watch_type wtype, int fd, const char *path, void (*cb)(), voi
 	w->cb = cb;
 	w->arg = arg;
 	w->ident = fd;
+	if (path != NULL && (w->path = strdup(path)) == NULL) {
+		free(w);
+		return NULL;
+	}
 
 	/* Add the watch */
 	if (pnotify_add_watch(w) != 0) {
+		free(w->path);
 		free(w);
 		return NULL;
 	}
@@ -260,6 +381,77 @@ watch_fd(int fd, void (*cb)(int, int, void *), void *arg)
 }
 
 
+struct watch *
+watch_buffer(int fd, void (*cb)(struct watch *, int, void *), void *arg)
+{
+	return _watch_add(WATCH_BUFFER, fd, NULL, cb, arg);
+}
+
+
+struct watch *
+watch_forward(int in_fd, int out_fd, void (*cb)(struct watch *, int, void *), void *arg)
+{
+	struct watch *w;
+
+	assert(cb);
+
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		return NULL;
+	w->type = WATCH_FORWARD;
+	w->cb = cb;
+	w->arg = arg;
+	w->ident = in_fd;
+
+	/* Both descriptors are registered by pn_forward_open() */
+	if (pn_forward_open(w, out_fd) != 0) {
+		free(w);
+		return NULL;
+	}
+	if (pnotify_add_watch(w) != 0) {
+		pn_forward_close(w);
+		free(w);
+		return NULL;
+	}
+
+	return (w);
+}
+
+
+struct watch *
+watch_listen(int fd, unsigned int shards, void (*cb)(struct watch *, int, void *), void *arg)
+{
+	struct watch *w;
+
+	assert(cb);
+
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		return NULL;
+	w->type = WATCH_LISTEN;
+	w->cb = cb;
+	w->arg = arg;
+	w->ident = fd;
+
+	/* The additional sockets are registered by pn_listen_open() */
+	if (pn_listen_open(w, shards) != 0) {
+		free(w);
+		return NULL;
+	}
+	if (pnotify_add_watch(w) != 0) {
+		free(w);
+		return NULL;
+	}
+
+	return (w);
+}
+
+
+struct watch *
+watch_datagram(int fd, void (*cb)(struct watch *, const struct pn_datagram *, size_t, void *), void *arg)
+{
+	return _watch_add(WATCH_DATAGRAM, fd, NULL, cb, arg);
+}
+
+
 struct watch *
 watch_timer(int interval, void (*cb)(void *), void *arg)
 {
@@ -272,21 +464,126 @@ watch_signal(int signum, void (*cb)(int, void *), void *arg)
 	return _watch_add(WATCH_SIGNAL, signum, NULL, cb, arg);
 }
 
+struct watch *
+watch_user(void (*cb)(struct watch *, uint64_t, void *), void *arg)
+{
+	return _watch_add(WATCH_USER, -1, NULL, cb, arg);
+}
+
+struct watch *
+watch_proc(pid_t pid, void (*cb)(pid_t, int, void *), void *arg)
+{
+	return _watch_add(WATCH_PROC, pid, NULL, cb, arg);
+}
+
+struct watch *
+watch_mount(const char *path, void (*cb)(const char *, int, void *), void *arg)
+{
+	return _watch_add(WATCH_MOUNT, -1, path, cb, arg);
+}
+
+struct watch *
+watch_poll(const char *path, unsigned int msec, void (*cb)(const char *, int, void *), void *arg)
+{
+	if (msec > INT_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return _watch_add(WATCH_POLL, (int) msec, path, cb, arg);
+}
+
+struct watch *
+watch_tail(const char *path, void (*cb)(const char *, size_t, int, void *), void *arg)
+{
+	return _watch_add(WATCH_TAIL, -1, path, cb, arg);
+}
+
 void
 event_dispatch(void)
 {
+	struct pnotify_stats *st = PN_STATS();
+	enum pn_watch_type type;
 	struct event *evt;
+	uint64_t start;
 
 	for (;;) {
 		/* Wait for an event */
 		if ((evt = event_wait()) == NULL)
 			abort();
+		start = pn_time_ns();
+		pn_hist_record(&st->latency, start - evt->enqueued);
+		PN_TRACE(PN_TRACE_DEQUEUE, evt->watch, evt->func, evt->mask);
+		PN_TRACE(PN_TRACE_CB_START, evt->watch, evt->func, evt->mask);
+
+		/* Run a task, and report that it finished */
+		if (evt->func != NULL) {
+			evt->func(evt->arg);
+			PN_TRACE(PN_TRACE_CB_END, NULL, evt->func, 0);
+			pn_hist_record(&st->callback, pn_time_ns() - start);
+			PN_STAT_ADD(st->tasks_run, 1);
+			if (evt->done != NULL)
+				(void) pnotify_post(evt->done, 1);
+			free(evt);
+			continue;
+		}
 
-		if (evt->watch->type == WATCH_TIMER) {
-			evt->watch->cb(evt->mask, evt->watch->arg);
-		} else {
-			evt->watch->cb(evt->watch->ident, evt->mask, evt->watch->arg);
+		type = evt->watch->type;
+		switch (type) {
+			case WATCH_TIMER:
+				evt->watch->cb(evt->watch->arg);
+				break;
+
+			case WATCH_SIGNAL:
+				evt->watch->cb(evt->watch->ident, evt->watch->arg);
+				break;
+
+			case WATCH_MOUNT:
+			case WATCH_POLL:
+				/* Drop the event if the contents did not change */
+				if (!pn_checksum_filter(evt->watch, evt->path, evt->mask))
+					break;
+				evt->watch->cb(evt->path, evt->mask, evt->watch->arg);
+				break;
+
+			case WATCH_TAIL:
+				pn_tail_dispatch(evt->watch, evt->mask);
+				break;
+
+			case WATCH_BUFFER:
+				pn_buffer_dispatch(evt->watch, evt->mask);
+				break;
+
+			case WATCH_FORWARD:
+				pn_forward_dispatch(evt->watch, evt->mask);
+				break;
+
+			case WATCH_LISTEN:
+				pn_listen_dispatch(evt->watch, evt->mask);
+				break;
+
+			case WATCH_DATAGRAM:
+				pn_dgram_dispatch(evt->watch, evt->mask);
+				break;
+
+			case WATCH_PROC:
+				pn_proc_dispatch(evt->watch, evt->mask);
+				break;
+
+			case WATCH_USER:
+				pn_user_dispatch(evt->watch, evt->mask);
+				break;
+
+			default:
+				evt->watch->cb(evt->watch->ident, evt->mask, evt->watch->arg);
+				break;
 		}
+		PN_TRACE(PN_TRACE_CB_END, evt->watch, NULL, evt->mask);
+		pn_hist_record(&st->callback, pn_time_ns() - start);
+		PN_STAT_ADD(st->dispatched[type], 1);
+
+		pn_ref_put(evt->ref);
+		free(evt->path);
+		free(evt);
 	}
 
 }
@@ -294,22 +591,144 @@ event_dispatch(void)
 
 void
 pn_event_add(struct watch *watch, int mask)
+{
+	pn_event_add_path(watch, mask, NULL);
+}
+
+
+void
+pn_event_add_path(struct watch *watch, int mask, const char *path)
+{
+	/* Merge the event with other recent events */
+	if (pn_debounce_add(watch, mask, path))
+		return;
+
+	pn_event_enqueue(watch, mask, path);
+}
+
+
+/* Add an event to the queue and wake up a worker thread */
+static void
+event_push(struct event *evt)
+{
+	MUTEX_LOCK(EVENT_MUTEX);
+	STAILQ_INSERT_TAIL(&EVENT[PN_PRIO_QUEUE(evt->watch->priority)], evt, entries);
+	EVENT_COUNT++;
+
+	/* Wake up a worker thread to process the event */
+	pn_worker_wake_locked(NULL);
+	MUTEX_UNLOCK(EVENT_MUTEX);
+}
+
+
+/* If true, each event holds a reference to the private state of the watch */
+static bool
+watch_refcounted(const struct watch *watch)
+{
+	switch (watch->type) {
+		case WATCH_TAIL:
+		case WATCH_BUFFER:
+		case WATCH_FORWARD:
+		case WATCH_LISTEN:
+		case WATCH_USER:
+		case WATCH_PROC:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+
+void
+pn_event_enqueue(struct watch *watch, int mask, const char *path)
 {
 	struct event *evt;
+	void *ref = NULL;
 
 	dprintf("adding an event to the eventlist..\n");
 
+	/* Keep the state of the watch until the event has been handled */
+	if (watch_refcounted(watch) && (ref = pn_ref_get(&watch->priv)) == NULL) {
+		dprintf("dropping an event for a cancelled watch\n");
+		return;
+	}
+
 	/* Create a new event structure */
 	if ((evt = calloc(1, sizeof(*evt))) == NULL)
 		err(1, "calloc(3)");
 	evt->watch = watch;
 	evt->mask = mask;
+	evt->ref = ref;
+	evt->enqueued = pn_time_ns();
+	PN_STAT_ADD(PN_STATS()->enqueued[watch->type], 1);
+	PN_TRACE(PN_TRACE_ENQUEUE, watch, NULL, mask);
+	PN_RECORD(PN_RECORD_READY, watch, mask);
+	if (path != NULL && (evt->path = strdup(path)) == NULL)
+		err(1, "strdup(3)");
 
 	/* Assign the event */
+	event_push(evt);
+}
+
+
+/**
+ * Account for an event removed from EVENT, and resume reading from the
+ * kernel if the queue has drained. The caller must hold EVENT_MUTEX.
+ */
+void
+pn_event_removed_locked(void)
+{
+	EVENT_COUNT--;
+	if (EVENT_PAUSED > 0 && EVENT_COUNT <= EVENT_LOW)
+		(void) pthread_cond_broadcast(&EVENT_DRAIN);
+}
+
+
+/** Get the number of events waiting for a worker thread */
+size_t
+pn_event_count(void)
+{
+	size_t count;
+
+	MUTEX_LOCK(EVENT_MUTEX);
+	count = EVENT_COUNT;
+	MUTEX_UNLOCK(EVENT_MUTEX);
+
+	return count;
+}
+
+
+/**
+ * Wait until the queue is short enough to read more events from the kernel.
+ *
+ * This is called by the kernel event loop before each wait for events.
+ */
+void
+pn_event_throttle(void)
+{
 	MUTEX_LOCK(EVENT_MUTEX);
-	STAILQ_INSERT_TAIL(&EVENT, evt, entries);
+	if (EVENT_HIGH > 0 && EVENT_COUNT >= EVENT_HIGH) {
+		dprintf("pausing at %zu queued events\n", EVENT_COUNT);
+		EVENT_PAUSED++;
+		while (EVENT_HIGH > 0 && EVENT_COUNT > EVENT_LOW) {
+			if (pthread_cond_wait(&EVENT_DRAIN, &EVENT_MUTEX) != 0) {
+				warn("pthread_cond_wait(3) failed");
+				break;
+			}
+		}
+		EVENT_PAUSED--;
+	}
 	MUTEX_UNLOCK(EVENT_MUTEX);
+}
+
 
-	/* Signal a worker thread to process the event */
-	(void) pthread_cond_signal(&EVENT_COND);
+/**
+ * Run a function on one of the worker threads.
+ */
+void
+pn_task_add(void (*func)(void *), void *arg)
+{
+	if (pnotify_submit(func, arg, -1, NULL) != 0)
+		err(1, "pnotify_submit()");
 }
@@ -25,6 +25,8 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
 
 /* System-specific headers */
 #if defined(__linux__)
@@ -43,22 +45,50 @@
 
 /* Opaque structures */
 struct pnotify_ctx;
+struct pn_debounce;
+struct pn_checksum;
 
 /** The type of resource to be watched */
 enum pn_watch_type {
 	WATCH_FD,		 /** An open file descriptor */
 	WATCH_TIMER,		 /** A user-defined timer */
 	WATCH_SIGNAL,		 /** Signals from the operating system */
+	WATCH_MOUNT,		 /** All files beneath a directory or mount point */
+	WATCH_TAIL,		 /** Data appended to a file */
+	WATCH_POLL,		 /** All files beneath a directory, found by polling */
+	WATCH_BUFFER,		 /** An open file descriptor with buffered I/O */
+	WATCH_FORWARD,		 /** Data copied from one file descriptor to another */
+	WATCH_LISTEN,		 /** A listening socket */
+	WATCH_DATAGRAM,		 /** A datagram socket */
+	WATCH_PROC,		 /** A child process */
+	WATCH_USER,		 /** Events posted by the application */
 };
 
+/** The number of watch types */
+#define PN_WATCH_TYPES	(WATCH_USER + 1)
+
+
+/** The priority of the events of a watch */
+enum pn_priority {
+	PN_PRIO_LOW    = -1,	/** Bulk work that may be delayed */
+	PN_PRIO_NORMAL = 0,	/** The default for most watches */
+	PN_PRIO_HIGH   = 1,	/** The default for signals and timers */
+};
 
 /** The bitmask of events to monitor */
 enum pn_event_bitmask {
-	PN_READ,	/** Data is ready to be read from a file descriptor */
-	PN_WRITE, 	/** Data is ready to be written to a file descriptor */
-	PN_CLOSE,	/** A socket or pipe descriptor was closed by the remote end */
-	PN_TIMEOUT,	/** A timer expired */
-	PN_ERROR	/** An error condition in the underlying kernel event queue */
+	PN_READ    = 0x0001, /** Data is ready to be read from a file descriptor */
+	PN_WRITE   = 0x0002, /** Data is ready to be written to a file descriptor */
+	PN_CLOSE   = 0x0004, /** A socket or pipe descriptor was closed by the remote end */
+	PN_TIMEOUT = 0x0008, /** A timer expired */
+	PN_ERROR   = 0x0010, /** An error condition in the underlying kernel event queue */
+	PN_CREATE  = 0x0020, /** A file or directory was created */
+	PN_DELETE  = 0x0040, /** A file or directory was deleted */
+	PN_MODIFY  = 0x0080, /** The contents of a file were modified */
+	PN_ATTRIB  = 0x0100, /** The metadata of a file was changed */
+	PN_RENAME  = 0x0200, /** A file or directory was renamed */
+	PN_TRUNCATE = 0x0400, /** A file was truncated */
+	PN_READY   = 0x0800, /** A filesystem watch has finished its initial scan */
 };
 
 /**
@@ -76,6 +106,21 @@ struct watch {
 	void (*cb)();
 	void *arg;
 
+	/** The pathname of a watched file or directory */
+	char *path;
+
+	/** Private state used by watch types that need more than an ident */
+	void *priv;
+
+	/** Event coalescing state, see watch_debounce() */
+	struct pn_debounce *debounce;
+
+	/** Content checksums used to drop redundant events, see watch_checksum() */
+	struct pn_checksum *checksum;
+
+	/** The priority of the watch's events, see watch_priority() */
+	int priority;
+
 #if defined(BSD)
 
 	/* The associated kernel event structure */
@@ -108,6 +153,26 @@ struct watch {
 */
 void pnotify_init(void);
 
+/**
+ * Limit the number of events waiting to be delivered.
+ *
+ * When @a high events are queued, the thread that reads events from the
+ * kernel stops reading, and resumes only when the workers have brought
+ * the queue down to @a low. While it is paused, unread data stays in the
+ * kernel's socket buffers, where the sender will see it through flow
+ * control. Events that the library queues for itself, such as the
+ * continuation of a partial read, are still accepted.
+ *
+ * The default limits are 65536 and 32768 events.
+ *
+ * @param high the number of queued events that pauses reading, or zero
+ *   for no limit
+ * @param low the number of queued events that resumes reading, which must
+ *   be less than @a high
+ * @return 0 if successful, or -1 if the limits are not valid
+ */
+int pnotify_queue_limit(size_t high, size_t low);
+
 /**
   Remove a watch.
 
@@ -140,6 +205,70 @@ void event_dispatch(void);
  */ 
 struct watch * watch_signal(int signum, void (*cb)(int, void *), void *arg);
 
+/**
+ * Run a function on one of the worker threads.
+ *
+ * Submitting does not take a lock. If @a worker is not negative, the task
+ * is given to worker number @a worker, modulo the number of workers, and
+ * only that worker runs it, one task at a time in the order they were
+ * submitted, even while it is busy and other workers are idle. Otherwise
+ * any idle worker may take the task. If @a done is not NULL, it must
+ * be a WATCH_USER watch, and pnotify_post() is called on it with a value
+ * of 1 when the function returns. The post is dropped if @a done has
+ * been cancelled by then.
+ *
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int pnotify_submit(void (*fn)(void *), void *arg, int worker, struct watch *done);
+
+/**
+ * Run a function on the worker threads once for each of @a count arguments.
+ *
+ * If @a worker is negative, the batch is divided among all the workers
+ * with one atomic operation per worker. The @a done watch receives a post
+ * as each task finishes, so its callback sees the number of tasks done.
+ *
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int pnotify_submit_batch(void (*fn)(void *), void * const *args, size_t count, int worker, struct watch *done);
+
+/**
+ * Create a watch for events posted by the application.
+ *
+ * Any thread may call pnotify_post() to have the callback invoked by a
+ * worker thread. Posts made before the callback runs are combined, and
+ * the callback receives the sum of their values.
+ *
+ * @return a watch descriptor, or NULL if an error occurred
+ */
+struct watch * watch_user(void (*cb)(struct watch *, uint64_t, void *), void *arg);
+
+/**
+ * Post an event to a WATCH_USER watch.
+ *
+ * Only the first post after the callback has started makes a system
+ * call; later posts only add to the pending value.
+ *
+ * @param value a positive number to add to the pending value
+ * @return 0 if successful, or -1 if an error occurred. errno is EINVAL
+ *   if the watch has been cancelled.
+ */
+int pnotify_post(struct watch *watch, uint64_t value);
+
+/**
+ * Wait for a child process to exit.
+ *
+ * When the child exits, it is reaped with waitpid(2) and the callback is
+ * invoked once with its status, which can be examined with WIFEXITED()
+ * and the other wait macros. The status is -1 if the child was reaped by
+ * someone else. Under Linux, this uses a pidfd, so it does not depend on
+ * SIGCHLD and requires Linux 5.3 or later.
+ *
+ * @param pid the process ID of a child of the calling process
+ * @return a watch descriptor, or NULL if an error occurred
+ */
+struct watch * watch_proc(pid_t pid, void (*cb)(pid_t, int, void *), void *arg);
+
 /** Watch for changes to a file descriptor */
 struct watch * watch_fd(int fd, void (*cb)(int, int, void *), void *arg); 
 
@@ -149,4 +278,553 @@ struct watch * watch_fd(int fd, void (*cb)(int, int, void *), void *arg);
  */
 struct watch * watch_timer(int interval, void (*cb)(void *), void *arg);
 
+/** 
+ * Watch every file and directory beneath a path.
+ *
+ * On Linux, a single fanotify(7) group is used to watch the entire
+ * filesystem containing @a path. If fanotify is not permitted, one
+ * inotify(7) watch is added for each directory in the tree instead.
+ *
+ * The callback receives the pathname of the affected file and a mask
+ * containing one or more of PN_CREATE, PN_DELETE, PN_MODIFY, PN_ATTRIB
+ * and PN_RENAME.
+ *
+ * When inotify is used, the tree is scanned by the worker threads after
+ * this function returns. Once every directory is being watched, the
+ * callback is invoked once with @a path and PN_READY.
+ *
+ * Network and userspace filesystems such as NFS and FUSE, and all
+ * filesystems on BSD, are polled as if by watch_poll().
+ *
+ * @param path the directory at the top of the tree
+ * @return a watch descriptor, or NULL if an error occurred
+ */
+struct watch * watch_mount(const char *path, void (*cb)(const char *, int, void *), void *arg);
+
+/**
+ * Watch every file and directory beneath a path by scanning the tree.
+ *
+ * This works on any filesystem, but changes are only seen at the next
+ * scan. The interval between scans doubles each time a scan finds no
+ * changes, up to 16 times @a msec, and is reset when a change is found.
+ * The callback is the same as for watch_mount(), and PN_READY is
+ * delivered when the first scan has finished.
+ *
+ * @param msec the interval between scans in milliseconds, or zero for
+ *   the default of one second
+ * @return a watch descriptor, or NULL if an error occurred
+ */
+struct watch * watch_poll(const char *path, unsigned int msec, void (*cb)(const char *, int, void *), void *arg);
+
+/**
+ * Save the state of a watched tree to a snapshot file.
+ *
+ * The snapshot records the inode number, modification time and size of
+ * every file beneath the path of a WATCH_MOUNT watch. After a restart,
+ * pnotify_snapshot_load() uses it to find the changes that were made
+ * while the program was not running.
+ *
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int pnotify_snapshot_save(struct watch *watch, const char *file);
+
+/**
+ * Compare a watched tree with a snapshot file.
+ *
+ * The comparison is done in the background by the worker threads. Each
+ * difference is delivered to the callback of the WATCH_MOUNT watch as if
+ * it had just happened: PN_CREATE, PN_DELETE, PN_MODIFY or PN_ATTRIB.
+ *
+ * @return 0 if the comparison was started, or -1 if an error occurred
+ */
+int pnotify_snapshot_load(struct watch *watch, const char *file);
+
+/**
+ * Follow the data appended to a file, like "tail -F".
+ *
+ * Each time data is appended to the file, the callback receives a pointer
+ * to the new data, its length and the PN_READ mask. The data is only
+ * valid until the callback returns. Reading begins at the end of the file.
+ *
+ * If the file is truncated, the callback is invoked with PN_TRUNCATE and
+ * reading starts again from the beginning. If the file is rotated by
+ * renaming or deleting it and creating a new file with the same name, the
+ * rest of the old file is delivered, then the callback is invoked with
+ * PN_RENAME and reading continues from the start of the new file.
+ *
+ * @param path the pathname of the file
+ * @return a watch descriptor, or NULL if an error occurred
+ */
+struct watch * watch_tail(const char *path, void (*cb)(const char *, size_t, int, void *), void *arg);
+
+/**
+ * Watch a file descriptor, and buffer its input and output.
+ *
+ * The descriptor is put into non-blocking mode. Whenever it becomes
+ * readable, all of the available data is read into an input buffer, and
+ * the callback is invoked with PN_READ. The callback then consumes the
+ * data with pnotify_buffer_read(). PN_CLOSE is delivered when the remote
+ * end closes the connection, and PN_ERROR if a read or write fails.
+ *
+ * Data passed to pnotify_buffer_write() is written when the descriptor
+ * becomes writable, and the callback is invoked with PN_WRITE once all
+ * of it has been written.
+ *
+ * Events that are still queued when the watch is cancelled are dropped,
+ * and the buffers are freed once a callback that is already running has
+ * returned.
+ *
+ * @return a watch descriptor, or NULL if an error occurred
+ */
+struct watch * watch_buffer(int fd, void (*cb)(struct watch *, int, void *), void *arg);
+
+/**
+ * Return the number of bytes in the input buffer of a WATCH_BUFFER watch.
+ */
+size_t pnotify_buffer_length(struct watch *watch);
+
+/**
+ * Remove up to @a len bytes from the input buffer of a WATCH_BUFFER watch.
+ *
+ * @return the number of bytes copied to @a buf
+ */
+size_t pnotify_buffer_read(struct watch *watch, void *buf, size_t len);
+
+/**
+ * Add data to the output buffer of a WATCH_BUFFER watch.
+ *
+ * @return 0 if successful, or -1 if an earlier write failed, or if the
+ *         watch has been cancelled (EINVAL)
+ */
+int pnotify_buffer_write(struct watch *watch, const void *buf, size_t len);
+
+/** A record within the input buffer of a WATCH_BUFFER watch */
+struct pn_record {
+	const char *data;
+	size_t len;
+};
+
+/** The ways of splitting input into records */
+enum pn_framing {
+	PN_FRAME_NONE,		/** Deliver PN_READ events (the default) */
+	PN_FRAME_DELIM,		/** Records end with a delimiter byte */
+	PN_FRAME_LENGTH,	/** Records begin with a big-endian length */
+};
+
+/**
+ * Split the input of a WATCH_BUFFER watch into records.
+ *
+ * For PN_FRAME_DELIM, @a param is the delimiter, which is not included
+ * in the records; any data after the last delimiter is delivered as a
+ * record at end-of-file. For PN_FRAME_LENGTH, @a param is the width of
+ * the length prefix, which must be 1, 2, 4 or 8 bytes, and the prefix is
+ * not included in the records.
+ *
+ * Whenever data is read, @a cb is invoked with all of the complete
+ * records. The records point into the input buffer, and are only valid
+ * until the callback returns. The watch callback continues to receive
+ * PN_WRITE, PN_CLOSE and PN_ERROR, but not PN_READ. A record longer than
+ * the input buffer limit causes PN_ERROR, after which
+ * pnotify_buffer_write() fails with EMSGSIZE. The framing may be changed
+ * while a batch is being delivered; the batch is finished with the old one.
+ *
+ * @return 0 if successful, or -1 if an error occurred. errno is EINVAL if
+ *   the watch has been cancelled.
+ */
+int pnotify_buffer_framing(struct watch *watch, enum pn_framing type, unsigned int param,
+		void (*cb)(struct watch *, const struct pn_record *, size_t, void *));
+
+/**
+ * Copy everything read from one file descriptor to another.
+ *
+ * The data is copied by the worker threads whenever @a in_fd is readable
+ * or @a out_fd is writable, so a slow reader slows down the copying
+ * instead of causing data to be buffered. Under Linux, the data does not
+ * pass through userspace: it is moved with splice(2), or with sendfile(2)
+ * if @a in_fd is a regular file. Both descriptors are put into
+ * non-blocking mode, and remain open when the watch is cancelled.
+ *
+ * @a out_fd must be something that can be waited on, such as a socket or
+ * a pipe. Under Linux, epoll_ctl(2) rejects a regular file, so it cannot
+ * be used as the output and watch_forward() fails.
+ *
+ * The callback is invoked once, with PN_CLOSE when @a in_fd reaches
+ * end-of-file and all of the data has been written, or with PN_ERROR
+ * if reading or writing fails.
+ *
+ * @return a watch descriptor, or NULL if an error occurred
+ */
+struct watch * watch_forward(int in_fd, int out_fd, void (*cb)(struct watch *, int, void *), void *arg);
+
+/**
+ * Accept connections on a listening socket.
+ *
+ * The socket is put into non-blocking mode. Whenever connections are
+ * waiting, a worker thread accepts them in batches with accept4(2), and
+ * invokes the callback with each new descriptor, which is non-blocking
+ * and close-on-exec. The callback owns the descriptor, and will usually
+ * register it with watch_buffer() or watch_fd(). If the batch is full,
+ * another worker continues accepting while the callbacks run.
+ *
+ * If @a shards is greater than one and the socket has SO_REUSEPORT set,
+ * @a shards - 1 more sockets are bound to the same address, so that the
+ * kernel spreads new connections over several queues that are accepted
+ * from in parallel. The extra sockets are closed when the watch is
+ * cancelled; the caller's socket is left open.
+ *
+ * @return a watch descriptor, or NULL if an error occurred
+ */
+struct watch * watch_listen(int fd, unsigned int shards, void (*cb)(struct watch *, int, void *), void *arg);
+
+/** A datagram received or sent by a WATCH_DATAGRAM watch */
+struct pn_datagram {
+	const void *data;
+	size_t len;
+	const struct sockaddr *addr;	/** The source or destination, or NULL */
+	socklen_t addrlen;
+	int flags;			/** MSG_TRUNC if the datagram was truncated */
+};
+
+/**
+ * Receive datagrams in batches.
+ *
+ * Whenever the socket is readable, a worker thread receives up to 64
+ * datagrams at a time with recvmmsg(2), and invokes the callback once with
+ * all of them, until the socket has been drained. The datagrams and their
+ * addresses are only valid until the callback returns. Datagrams longer
+ * than 2048 bytes are truncated, and have MSG_TRUNC set in their flags.
+ *
+ * @return a watch descriptor, or NULL if an error occurred
+ */
+struct watch * watch_datagram(int fd, void (*cb)(struct watch *, const struct pn_datagram *, size_t, void *), void *arg);
+
+/**
+ * Send a batch of datagrams on the socket of a WATCH_DATAGRAM watch,
+ * using sendmmsg(2). The call does not block.
+ *
+ * @return the number of datagrams sent, which is less than @a count if the
+ *   socket buffer filled up, or -1 if none could be sent
+ */
+int pnotify_datagram_send(struct watch *watch, const struct pn_datagram *dgram, size_t count);
+
+/**
+ * Change the priority of the events of a watch.
+ *
+ * Each priority has its own event queue, and the worker threads take
+ * events from the highest priority queue that is not empty. So that lower
+ * priorities are not starved, a queue gives up one turn to the queue below
+ * it after every 8 consecutive events taken from it.
+ *
+ * @return 0 if successful, or -1 if @a prio is not valid
+ */
+int watch_priority(struct watch *watch, enum pn_priority prio);
+
+/**
+ * Coalesce bursts of events for a watch.
+ *
+ * The first event for a pathname opens a window of @a msec milliseconds.
+ * Any further events for the same pathname during the window are merged
+ * into a single event whose mask is the union of all the masks. When the
+ * window closes, the merged events are delivered in the order they
+ * were first seen.
+ *
+ * @param msec the length of the window, or zero to stop coalescing
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int watch_debounce(struct watch *watch, unsigned int msec);
+
+/**
+ * Drop events for files whose contents did not change.
+ *
+ * A checksum of each regular file is kept, and a PN_MODIFY, PN_ATTRIB,
+ * PN_CREATE or PN_RENAME event is not delivered if the contents,
+ * permissions and owner of the file are the same as the last time an
+ * event was delivered for it. This hides rewrites that produce the same
+ * contents, such as touch(1) or atomically replacing a file with a copy.
+ * The first event for each file is always delivered.
+ *
+ * Only WATCH_MOUNT and WATCH_POLL watches are supported.
+ *
+ * @param rate the maximum number of bytes to checksum per second, SIZE_MAX
+ *   for no limit, or zero to stop checking. Once the limit is reached,
+ *   events are delivered without being checked. A file larger than @a rate
+ *   is checked when no other file has been checked for a second, and the
+ *   limit then holds back other files until the excess has been paid off.
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int watch_checksum(struct watch *watch, size_t rate);
+
+/** The number of buckets in a struct pn_histogram */
+#define PN_HIST_BUCKETS	976
+
+/**
+ * A histogram of 64-bit values.
+ *
+ * Values below 16 have a bucket each. Above that, each power of two is
+ * split into 16 buckets, so a value is known to within 1/16th of itself.
+ */
+struct pn_histogram {
+	uint64_t count;			 /** The number of values recorded */
+	uint64_t sum;			 /** The sum of all values */
+	uint64_t max;			 /** The largest value */
+	uint64_t bucket[PN_HIST_BUCKETS];
+};
+
+/** The mutexes whose contention is counted in struct pnotify_stats */
+enum pn_mutex_id {
+	PN_MUTEX_EVENT,		 /** The event queue */
+	PN_MUTEX_WATCH,		 /** The list of watches */
+	PN_MUTEX_TIMER,		 /** The timer heap */
+	PN_MUTEX_OTHER,		 /** Every other mutex, such as those of each watch */
+	PN_MUTEX_COUNT
+};
+
+/** Statistics about the library, see pnotify_stats() */
+struct pnotify_stats {
+
+	/** The number of events queued and delivered for each watch type */
+	uint64_t enqueued[PN_WATCH_TYPES];
+	uint64_t dispatched[PN_WATCH_TYPES];
+
+	/** The number of tasks submitted and run, see pnotify_submit() */
+	uint64_t tasks_submitted;
+	uint64_t tasks_run;
+
+	/** The number of events waiting for a worker thread */
+	size_t queue_depth;
+
+	/** The number of worker threads that are idle, and running something */
+	size_t workers_idle;
+	size_t workers_busy;
+
+	/** The number of timers that have not expired, and that have */
+	size_t timers_active;
+	uint64_t timers_fired;
+
+	/** The number of events returned by each epoll_wait(2) or kevent(2) call */
+	struct pn_histogram poll_batch;
+
+	/** The time between queueing an event or task and starting to run it, in ns */
+	struct pn_histogram latency;
+
+	/** The time spent in each callback or task, in ns */
+	struct pn_histogram callback;
+
+	/**
+	 * The number of times that a mutex was found locked by another
+	 * thread, and the total time spent waiting for it in ns. The
+	 * entries are indexed by enum pn_mutex_id.
+	 */
+	uint64_t mutex_waits[PN_MUTEX_COUNT];
+	uint64_t mutex_wait_ns[PN_MUTEX_COUNT];
+
+	/**
+	 * The number of times an idle worker spun before sleeping, the number
+	 * of those that found something to do, and the total time spent
+	 * spinning in ns. See pnotify_spin_limit().
+	 */
+	uint64_t spins;
+	uint64_t spin_hits;
+	uint64_t spin_ns;
+};
+
+/**
+ * Let idle workers spin before they sleep.
+ *
+ * A worker that finds nothing to do normally sleeps on a condition
+ * variable, and the thread that queues the next event has to wake it,
+ * which adds the latency of a futex wakeup to the event. With a spin
+ * limit, the worker first polls the queues for up to @a max_ns. Each
+ * worker adapts its own spin time: it is doubled, up to the limit, when
+ * spinning finds work, and halved when it does not, so that workers which
+ * would only burn CPU soon spin briefly. The time spent spinning is
+ * reported by pnotify_stats().
+ *
+ * Spinning only helps when there are more CPUs than busy threads.
+ *
+ * @param max_ns the longest time to spin, or 0 to sleep at once, which
+ *   is the default
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int pnotify_spin_limit(uint64_t max_ns);
+
+/**
+ * Ask the kernel to busy poll the network devices of the watched sockets.
+ *
+ * Under Linux 6.9 and later, this sets the busy polling parameters of the
+ * epoll descriptor, so that a poller thread spins in the driver for up to
+ * @a usecs before it sleeps, which saves the interrupt and wakeup latency
+ * of each packet at the cost of a CPU. It only has an effect on devices
+ * that support busy polling.
+ *
+ * @param usecs the longest time to busy poll, or 0 to turn it off
+ * @return 0 if successful, or -1 if an error occurred; errno is ENOTSUP
+ *   if the backend does not support busy polling
+ */
+int pnotify_busy_poll(unsigned int usecs);
+
+/**
+ * Get statistics about the library.
+ *
+ * Every thread counts into its own copy of the statistics, so counting
+ * costs no more than an ordinary increment. This function adds up all the
+ * copies, so the result is not an atomic snapshot: a counter may be a
+ * little ahead of another that it is related to.
+ *
+ * @param stats the structure to fill in; it is about 24 KiB long
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int pnotify_stats(struct pnotify_stats *stats);
+
+/**
+ * Find a percentile of a histogram.
+ *
+ * @param pct the percentile, from 0 to 100
+ * @return the largest value in the bucket holding the percentile, or 0 if
+ *   the histogram is empty
+ */
+uint64_t pnotify_stats_percentile(const struct pn_histogram *hist, double pct);
+
+/** The kinds of trace records */
+enum pn_trace_type {
+	PN_TRACE_READY,		 /** The kernel reported that a watch is ready */
+	PN_TRACE_ENQUEUE,	 /** An event or task was queued */
+	PN_TRACE_DEQUEUE,	 /** A worker took an event or task from the queue */
+	PN_TRACE_CB_START,	 /** A callback or task started */
+	PN_TRACE_CB_END,	 /** A callback or task returned */
+	PN_TRACE_TIMER,		 /** A timer expired */
+	PN_TRACE_CANCEL,	 /** A watch was cancelled */
+};
+
+/** A trace record, as written to a trace file by pnotify_trace_dump() */
+struct pn_trace_record {
+	uint64_t ts;		 /** The monotonic time in ns */
+	uint64_t id;		 /** The address of the watch, or of the task function */
+	uint32_t tid;		 /** A number identifying the thread that wrote the record */
+	uint8_t  type;		 /** An enum pn_trace_type */
+	int8_t   wtype;		 /** The enum pn_watch_type of the watch, or -1 for a task */
+	uint16_t pad;
+	uint32_t mask;		 /** The event mask; for PN_TRACE_READY, the kernel's mask */
+	int32_t  ident;		 /** The ident of the watch */
+};
+
+/** The header of a trace file, followed by the records of every thread */
+struct pn_trace_header {
+	char     magic[8];	 /** PN_TRACE_MAGIC */
+	uint32_t version;	 /** PN_TRACE_VERSION */
+	uint32_t record_size;	 /** sizeof(struct pn_trace_record) */
+};
+
+#define PN_TRACE_MAGIC		"PNTRACE1"
+#define PN_TRACE_VERSION	1
+
+/**
+ * Start recording trace records.
+ *
+ * Each thread writes fixed-size records into its own ring buffer, which
+ * is allocated the first time the thread writes a record. When a ring is
+ * full, the oldest records are overwritten. While tracing is stopped, the
+ * cost is a single test of a flag.
+ *
+ * @param records the number of records in each ring; it is rounded up to
+ *   a power of two. Rings that already exist keep their size.
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int pnotify_trace_start(size_t records);
+
+/**
+ * Stop recording trace records. The rings keep their contents.
+ */
+void pnotify_trace_stop(void);
+
+/**
+ * Write the contents of every ring to a file.
+ *
+ * This may be called while tracing is running; records that are being
+ * overwritten while they are copied are left out. The pntrace(1) program
+ * converts the file into the JSON format of the Chrome trace viewer.
+ *
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int pnotify_trace_dump(const char *path);
+
+/** The kinds of event records */
+enum pn_event_record_op {
+	PN_RECORD_ADD,		 /** A watch was added */
+	PN_RECORD_READY,	 /** An event for a watch was added to the queue */
+	PN_RECORD_CANCEL,	 /** A watch was cancelled */
+};
+
+/** An event record, as written by pnotify_record_start() */
+struct pn_event_record {
+	uint64_t ts;		 /** The time in ns since recording started */
+	uint64_t id;		 /** The address of the watch */
+	uint8_t  op;		 /** An enum pn_event_record_op */
+	int8_t   wtype;		 /** The enum pn_watch_type of the watch */
+	int8_t   priority;	 /** The enum pn_priority of the watch */
+	uint8_t  pad;
+	uint32_t mask;		 /** For PN_RECORD_READY, the PN_* event mask */
+};
+
+/** The header of a record file, followed by the records in time order */
+struct pn_event_record_header {
+	char     magic[8];	 /** PN_RECORD_MAGIC */
+	uint32_t version;	 /** PN_RECORD_VERSION */
+	uint32_t record_size;	 /** sizeof(struct pn_event_record) */
+};
+
+#define PN_RECORD_MAGIC		"PNRECRD1"
+#define PN_RECORD_VERSION	1
+
+/**
+ * Start writing every watch that is added or cancelled, and every event
+ * that is added to the queue, to a file.
+ *
+ * The pnreplay(1) program feeds such a file back through the queue and
+ * the worker threads, using the simulated backend. Events are recorded
+ * after they have been coalesced, and include those of timers, signals,
+ * filesystem watches and posts; tasks are not recorded.
+ * Recording takes a lock for each record, so it is meant for capturing an
+ * episode rather than for running all the time.
+ *
+ * @return 0 if successful, or -1 if an error occurred; errno is EBUSY if
+ *   recording has already started
+ */
+int pnotify_record_start(const char *path);
+
+/**
+ * Stop recording, and close the file.
+ *
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int pnotify_record_stop(void);
+
+/**
+ * Report that a watch is ready, when the simulated backend is in use.
+ *
+ * The simulated backend is chosen by setting the environment variable
+ * PNOTIFY_BACKEND to "sim" before pnotify_init() is called. Descriptors
+ * are then never given to the kernel, and events only come from this
+ * function and from pnotify_sim_rate(). The event is queued by a poller
+ * thread, as a kernel event would be, and events are reported in the
+ * order they were injected.
+ *
+ * @param mask the PN_READ, PN_WRITE, PN_CLOSE or PN_ERROR flags to report
+ * @return 0 if successful, or -1 if an error occurred; errno is ENOTSUP
+ *   if the simulated backend is not in use
+ */
+int pnotify_sim_inject(struct watch *watch, int mask);
+
+/**
+ * Generate PN_READ events at a fixed rate, for watches chosen at random.
+ *
+ * Only descriptor watches (WATCH_FD, WATCH_BUFFER and WATCH_DATAGRAM) are
+ * chosen. The same @a seed gives the same sequence of watches, as long as
+ * the same watches were added in the same order.
+ *
+ * @param rate the number of events per second, or 0 to stop
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int pnotify_sim_rate(double rate, unsigned int seed);
+
 #endif /* _PNOTIFY_H */
@@ -0,0 +1,264 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  pnreplay - feed a file written by pnotify_record_start() back through
+ *  the event queue and the worker threads.
+ *
+ *  Usage: pnreplay [-p] [-x speed] file
+ *
+ *  The library is started with the simulated backend, and every recorded
+ *  watch becomes an fd watch with the same priority. Each recorded event
+ *  is injected with pnotify_sim_inject(), either as fast as possible or,
+ *  with -p, at the pace it was recorded at, sped up by the -x factor.
+ *  Events without any flags are skipped, since they cannot be injected.
+ *  The callbacks do nothing, so the result measures the queue and the
+ *  scheduling of the workers. It is printed as one line of JSON.
+ *
+ *  Recorded cancellations are not replayed, because the simulator drops
+ *  the events of a cancelled watch that are still waiting, and every
+ *  injected event has to be counted. A later watch at the same address
+ *  gets a new watch.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pnotify.h"
+
+/** A recorded watch, and the watch that stands in for it */
+struct replay_watch {
+	uint64_t id;
+	struct watch *watch;
+	int priority;
+};
+
+/** The recorded watches, in an open addressing table keyed by id */
+static struct replay_watch *TABLE;
+static size_t TABLE_SIZE, TABLE_COUNT;
+
+/** The descriptor that every watch is given; it is never written to */
+static int REPLAY_FD;
+
+/** The number of watches made by replay_watch() */
+static uint64_t WATCHES;
+
+/** The number of callbacks that have run */
+static uint64_t DONE;
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "clock_gettime(2)");
+
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+
+static void
+replay_cb(int fd, int mask, void *arg)
+{
+	(void) __atomic_add_fetch(&DONE, 1, __ATOMIC_RELAXED);
+}
+
+
+static struct replay_watch *
+table_find(uint64_t id)
+{
+	size_t i;
+
+	/* Watches are at least 8-byte aligned */
+	for (i = (id >> 3) * 2654435761U; ; i++) {
+		i &= TABLE_SIZE - 1;
+		if (TABLE[i].id == id || TABLE[i].id == 0)
+			return &TABLE[i];
+	}
+}
+
+
+static void
+table_grow(void)
+{
+	struct replay_watch *old = TABLE, *w;
+	size_t i, size = TABLE_SIZE;
+
+	TABLE_SIZE = (size > 0) ? size * 2 : 1024;
+	if ((TABLE = calloc(TABLE_SIZE, sizeof(*TABLE))) == NULL)
+		err(1, "calloc(3)");
+	for (i = 0; i < size; i++) {
+		if (old[i].id == 0)
+			continue;
+		w = table_find(old[i].id);
+		*w = old[i];
+	}
+	free(old);
+}
+
+
+/* Get the watch that stands in for a recorded one */
+static struct watch *
+replay_watch(const struct pn_event_record *rec)
+{
+	struct replay_watch *w;
+
+	if ((TABLE_COUNT + 1) * 2 > TABLE_SIZE)
+		table_grow();
+	w = table_find(rec->id);
+	if (w->id == 0) {
+		w->id = rec->id;
+		TABLE_COUNT++;
+	}
+	if (w->watch == NULL) {
+		if ((w->watch = watch_fd(REPLAY_FD, replay_cb, NULL)) == NULL)
+			errx(1, "watch_fd() failed");
+		w->priority = PN_PRIO_NORMAL;
+		WATCHES++;
+	}
+
+	/* The priority may have been changed after the watch was added */
+	if (rec->priority != w->priority) {
+		if (watch_priority(w->watch, rec->priority) < 0)
+			warn("watch_priority()");
+		w->priority = rec->priority;
+	}
+
+	return w->watch;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct pn_event_record_header hdr;
+	struct pn_event_record rec;
+	struct pnotify_stats *st;
+	struct timespec ts;
+	uint64_t start, due, sent = 0, last = 0;
+	double speed = 1.0, sec;
+	int c, fd[2], paced = 0;
+	FILE *f;
+
+	while ((c = getopt(argc, argv, "px:")) != -1) {
+		switch (c) {
+		case 'p':
+			paced = 1;
+			break;
+		case 'x':
+			if ((speed = atof(optarg)) <= 0)
+				errx(1, "the speed must be positive");
+			paced = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind + 1 != argc)
+		goto usage;
+
+	if ((f = fopen(argv[optind], "r")) == NULL)
+		err(1, "%s", argv[optind]);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			memcmp(hdr.magic, PN_RECORD_MAGIC, sizeof(hdr.magic)) != 0)
+		errx(1, "not a pnotify record file");
+	if (hdr.version != PN_RECORD_VERSION || hdr.record_size != sizeof(rec))
+		errx(1, "unsupported record file version %u", hdr.version);
+
+	if (setenv("PNOTIFY_BACKEND", "sim", 1) < 0)
+		err(1, "setenv(3)");
+	pnotify_init();
+	if (pipe(fd) < 0)
+		err(1, "pipe(2)");
+	REPLAY_FD = fd[0];
+
+	start = now_ns();
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+
+		/* Wait until the time of the record */
+		if (paced) {
+			due = start + (uint64_t) (rec.ts / speed);
+			ts.tv_sec = due / 1000000000;
+			ts.tv_nsec = due % 1000000000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&ts, NULL) == EINTR)
+				;
+		}
+		last = rec.ts;
+
+		switch (rec.op) {
+		case PN_RECORD_ADD:
+			(void) replay_watch(&rec);
+			break;
+
+		case PN_RECORD_READY:
+			/* An event with no flags cannot be injected */
+			if (rec.mask == 0)
+				break;
+			if (pnotify_sim_inject(replay_watch(&rec), rec.mask) < 0)
+				err(1, "pnotify_sim_inject()");
+			sent++;
+			break;
+
+		case PN_RECORD_CANCEL:
+			table_find(rec.id)->watch = NULL;
+			break;
+
+		default:
+			break;
+		}
+	}
+	if (ferror(f))
+		err(1, "fread(3)");
+	(void) fclose(f);
+
+	/* Wait for the callbacks to catch up */
+	while (__atomic_load_n(&DONE, __ATOMIC_RELAXED) < sent)
+		usleep(100);
+	sec = (now_ns() - start) / 1e9;
+
+	if ((st = malloc(sizeof(*st))) == NULL)
+		err(1, "malloc(3)");
+	if (pnotify_stats(st) < 0)
+		err(1, "pnotify_stats()");
+	printf("{\"events\":%llu,\"watches\":%llu,\"recorded_sec\":%.6f,"
+			"\"sec\":%.6f,\"events_per_sec\":%.0f,\"paced\":%d,"
+			"\"speed\":%.3f,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+			"\"p999_ns\":%llu,\"max_ns\":%llu,\"event_wait_ns\":%llu}\n",
+			(unsigned long long) sent, (unsigned long long) WATCHES,
+			last / 1e9, sec, (sec > 0) ? sent / sec : 0.0,
+			paced, speed,
+			(unsigned long long) pnotify_stats_percentile(&st->latency, 50),
+			(unsigned long long) pnotify_stats_percentile(&st->latency, 99),
+			(unsigned long long) pnotify_stats_percentile(&st->latency, 99.9),
+			(unsigned long long) st->latency.max,
+			(unsigned long long) st->mutex_wait_ns[PN_MUTEX_EVENT]);
+	exit(0);
+
+usage:
+	fprintf(stderr, "usage: pnreplay [-p] [-x speed] file\n");
+	exit(1);
+}
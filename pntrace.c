@@ -0,0 +1,142 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  pntrace - convert a file written by pnotify_trace_dump() into the JSON
+ *  format read by the Chrome trace viewer (chrome://tracing or Perfetto).
+ *
+ *  Usage: pntrace [file]
+ *
+ *  Callbacks and tasks become duration events on the thread that ran them,
+ *  and every other record becomes an instant event. Times are relative to
+ *  the earliest record.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pnotify.h"
+
+static const char *TYPE_NAME[] = {
+	"ready", "enqueue", "dequeue", "callback", "callback", "timer", "cancel",
+};
+
+static const char *WATCH_NAME[PN_WATCH_TYPES] = {
+	"fd", "timer", "signal", "mount", "tail", "poll", "buffer", "forward",
+	"listen", "datagram", "proc", "user",
+};
+
+
+/** A record, and its position in the file */
+struct entry {
+	struct pn_trace_record rec;
+	size_t seq;
+};
+
+
+/* Order by time, keeping the order of the file for records with the same time */
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct entry *x = a, *y = b;
+
+	if (x->rec.ts != y->rec.ts)
+		return (x->rec.ts < y->rec.ts) ? -1 : 1;
+	return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+
+static const char *
+watch_name(const struct pn_trace_record *rec)
+{
+	if (rec->wtype < 0)
+		return "task";
+	if (rec->wtype >= PN_WATCH_TYPES)
+		return "unknown";
+	return WATCH_NAME[(int) rec->wtype];
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct pn_trace_header hdr;
+	struct pn_trace_record *rec;
+	struct entry *ent = NULL;
+	size_t n = 0, size = 0, i, out = 0;
+	const char *ph;
+	FILE *f = stdin;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: pntrace [file]\n");
+		exit(1);
+	}
+	if (argc == 2 && (f = fopen(argv[1], "r")) == NULL)
+		err(1, "%s", argv[1]);
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			memcmp(hdr.magic, PN_TRACE_MAGIC, sizeof(hdr.magic)) != 0)
+		errx(1, "not a pnotify trace file");
+	if (hdr.version != PN_TRACE_VERSION || hdr.record_size != sizeof(*rec))
+		errx(1, "unsupported trace file version %u", hdr.version);
+
+	/* Read all the records, and put the threads in time order */
+	for (;;) {
+		if (n == size) {
+			size = (size == 0) ? 4096 : size * 2;
+			if ((ent = realloc(ent, size * sizeof(*ent))) == NULL)
+				err(1, "realloc(3)");
+		}
+		if (fread(&ent[n].rec, sizeof(ent[n].rec), 1, f) != 1)
+			break;
+		ent[n].seq = n;
+		n++;
+	}
+	if (ferror(f))
+		err(1, "fread(3)");
+	qsort(ent, n, sizeof(*ent), entry_cmp);
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = 0; i < n; i++) {
+		rec = &ent[i].rec;
+		if (rec->type > PN_TRACE_CANCEL)
+			continue;
+		if (rec->type == PN_TRACE_CB_START)
+			ph = "\"ph\":\"B\"";
+		else if (rec->type == PN_TRACE_CB_END)
+			ph = "\"ph\":\"E\"";
+		else
+			ph = "\"ph\":\"i\",\"s\":\"t\"";
+		printf("%s{\"name\":\"%s %s\",\"cat\":\"%s\",%s,\"ts\":%.3f,"
+				"\"pid\":1,\"tid\":%u,\"args\":{\"id\":\"0x%llx\","
+				"\"ident\":%d,\"mask\":\"0x%x\"}}\n",
+				(out++ > 0) ? "," : "",
+				TYPE_NAME[rec->type], watch_name(rec),
+				watch_name(rec), ph,
+				(rec->ts - ent[0].rec.ts) / 1000.0, rec->tid,
+				(unsigned long long) rec->id, rec->ident,
+				rec->mask);
+	}
+	printf("]}\n");
+
+	free(ent);
+	exit(0);
+}
@@ -0,0 +1,446 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  A polling fallback for filesystems that the kernel cannot watch,
+ *  such as NFS and FUSE (WATCH_POLL).
+ *
+ *  The tree is scanned periodically. Each directory is scanned by a
+ *  task on the worker pool, which compares the entries with the same
+ *  directory in the previous scan and generates an event for each
+ *  difference. The results of a scan are kept as a struct pn_tree (see
+ *  tree.c), a table of directories sorted by pathname, each pointing to
+ *  a run of records sorted by name, so that both the lookup and the
+ *  comparison are cheap.
+ *
+ *  The interval between scans grows while nothing changes, and drops back
+ *  to the base interval as soon as a change is seen. It never falls below
+ *  a few times the duration of the previous scan, so that a large tree on
+ *  a slow server does not keep the workers busy all the time.
+ */
+
+#include <limits.h>
+
+#if defined(__linux__)
+# include <sys/vfs.h>
+#endif
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The default interval between scans, in milliseconds */
+#define POLL_INTERVAL		1000
+
+/** The interval may grow to this multiple of the base interval */
+#define POLL_BACKOFF_MAX	16
+
+/** The time between scans is at least this multiple of the scan time */
+#define POLL_DUTY_CYCLE		4
+
+/** The entries of one directory, produced by a scan task */
+struct poll_chunk {
+	char  *rel;		/** The pathname relative to the root */
+	struct pn_tree tree;	/** The records, sorted by name, without a directory table */
+	SLIST_ENTRY(poll_chunk) entries;
+};
+
+/** The state of a WATCH_POLL watch */
+struct pn_poll {
+	struct watch *watch;
+	char root[PATH_MAX];
+
+	/** The base interval, and the current interval, in milliseconds */
+	unsigned int interval, cur;
+
+	/** The results of the previous scan; read-only while a scan runs */
+	struct pn_tree prev;
+
+	/** If true, the first scan has not finished yet */
+	bool initial;
+
+	/** The directories scanned so far by the current scan */
+	SLIST_HEAD(, poll_chunk) chunks;
+
+	/** The number of directories waiting to be scanned */
+	int pending;
+
+	/** The number of changes seen by the current scan */
+	int changes;
+
+	/** The time the current scan started */
+	uint64_t started;
+
+	/** The timer for the next scan; non-NULL while it is armed */
+	struct timer *timer;
+
+	/** If true, the watch was cancelled and the state must be freed */
+	bool closing;
+
+	/** A mutex to protect all of the above */
+	pthread_mutex_t mtx;
+};
+
+/** A directory waiting to be scanned */
+struct poll_task {
+	struct pn_poll *p;
+	char  rel[];
+};
+
+
+static void poll_scan_dir(void *arg);
+
+
+static struct poll_chunk *
+poll_chunk_new(const char *rel)
+{
+	struct poll_chunk *c;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL || (c->rel = strdup(rel)) == NULL)
+		err(1, "calloc(3)");
+
+	return c;
+}
+
+
+static void
+poll_chunk_free(struct poll_chunk *c)
+{
+	free(c->rel);
+	pn_tree_free(&c->tree);
+	free(c);
+}
+
+
+static void
+poll_free(struct pn_poll *p)
+{
+	struct poll_chunk *c;
+
+	while ((c = SLIST_FIRST(&p->chunks)) != NULL) {
+		SLIST_REMOVE_HEAD(&p->chunks, entries);
+		poll_chunk_free(c);
+	}
+	pn_tree_free(&p->prev);
+	(void) pthread_mutex_destroy(&p->mtx);
+	free(p);
+}
+
+
+/* Add a task to scan a directory. The caller must have counted it in p->pending. */
+static void
+poll_submit(struct pn_poll *p, const char *rel)
+{
+	struct poll_task *task;
+	size_t len = strlen(rel) + 1;
+
+	if ((task = malloc(sizeof(*task) + len)) == NULL)
+		err(1, "malloc(3)");
+	task->p = p;
+	memcpy(task->rel, rel, len);
+
+	pn_task_add(poll_scan_dir, task);
+}
+
+
+static void
+poll_schedule(struct pn_poll *p, const char *rel)
+{
+	MUTEX_LOCK(p->mtx);
+	p->pending++;
+	MUTEX_UNLOCK(p->mtx);
+
+	poll_submit(p, rel);
+}
+
+
+/* Called by the timer thread when the next scan is due */
+static void
+poll_tick(void *arg)
+{
+	struct pn_poll *p = arg;
+
+	MUTEX_LOCK(p->mtx);
+	p->timer = NULL;
+	if (p->closing) {
+		MUTEX_UNLOCK(p->mtx);
+		poll_free(p);
+		return;
+	}
+	p->started = pn_time_ms();
+	p->changes = 0;
+	p->pending++;
+	MUTEX_UNLOCK(p->mtx);
+
+	poll_submit(p, "");
+}
+
+
+/* Order the chunks of a scan by pathname */
+static int
+poll_chunkcmp(const void *a, const void *b)
+{
+	return pn_tree_pathcmp((*(struct poll_chunk * const *) a)->rel,
+			(*(struct poll_chunk * const *) b)->rel);
+}
+
+
+/*
+ * Combine the chunks of a finished scan into a new tree, replace
+ * the previous scan with it, and schedule the next scan.
+ * The caller must hold p->mtx.
+ */
+static void
+poll_finish(struct pn_poll *p)
+{
+	struct poll_chunk **chunk, *c;
+	struct pn_tree s;
+	size_t i, n = 0, di;
+	uint64_t elapsed;
+
+	SLIST_FOREACH(c, &p->chunks, entries)
+		n++;
+	if ((chunk = calloc(n + 1, sizeof(*chunk))) == NULL)
+		err(1, "calloc(3)");
+	for (i = 0; (c = SLIST_FIRST(&p->chunks)) != NULL; i++) {
+		SLIST_REMOVE_HEAD(&p->chunks, entries);
+		chunk[i] = c;
+	}
+	qsort(chunk, n, sizeof(*chunk), poll_chunkcmp);
+
+	memset(&s, 0, sizeof(s));
+	for (i = 0; i < n; i++) {
+		c = chunk[i];
+		di = pn_tree_add_dir(&s, c->rel);
+		pn_tree_append(&s, &c->tree, 0, c->tree.nrecs);
+		s.dir[di].count = c->tree.nrecs;
+		poll_chunk_free(c);
+	}
+	free(chunk);
+
+	pn_tree_free(&p->prev);
+	p->prev = s;
+
+	/* Back off while nothing is changing */
+	if (p->changes > 0)
+		p->cur = p->interval;
+	else
+		p->cur = MIN(MIN((uint64_t) p->cur * 2,
+				(uint64_t) p->interval * POLL_BACKOFF_MAX), UINT_MAX);
+	elapsed = pn_time_ms() - p->started;
+	if (p->cur < elapsed * POLL_DUTY_CYCLE)
+		p->cur = MIN(elapsed * POLL_DUTY_CYCLE, UINT_MAX);
+
+	if ((p->timer = pn_timer_start(p->cur, poll_tick, p)) == NULL)
+		errx(1, "unable to start the poll timer");
+}
+
+
+/* Scan one directory and compare it with the previous scan */
+static void
+poll_scan_dir(void *arg)
+{
+	struct poll_task *task = arg;
+	struct pn_poll *p = task->p;
+	const struct pn_tree_dir *d;
+	const struct pn_tree_rec *old, *new;
+	struct pn_tree_merge m;
+	struct poll_chunk *c = NULL;
+	char path[PATH_MAX], child[PATH_MAX];
+	const char *name;
+	int changes = 0, mask;
+	size_t i;
+	DIR *dirp;
+
+	if (snprintf(path, sizeof(path), "%s/%s", p->root, task->rel) >= sizeof(path))
+		goto out;
+	d = pn_tree_find_dir(&p->prev, task->rel);
+
+	if ((dirp = opendir(path)) == NULL) {
+		/* The directory is gone, and its parent reports it */
+		if (errno == ENOENT || errno == ENOTDIR)
+			goto out;
+
+		/*
+		 * Keep the entries from the previous scan through an error
+		 * such as ESTALE or EMFILE, so that they are not reported as
+		 * created once the directory can be read again.
+		 */
+		c = poll_chunk_new(task->rel);
+		if (d != NULL)
+			pn_tree_append(&c->tree, &p->prev, d->first, d->count);
+		for (i = 0; i < c->tree.nrecs; i++) {
+			if (S_ISDIR(c->tree.rec[i].mode) &&
+					pn_tree_join(child, sizeof(child), task->rel,
+						pn_tree_str(&c->tree, c->tree.rec[i].name)) == 0)
+				poll_schedule(p, child);
+		}
+		goto out;
+	}
+	c = poll_chunk_new(task->rel);
+	pn_tree_readdir(dirp, &c->tree);
+	(void) closedir(dirp);
+
+	/* Merge the sorted entries with the sorted records */
+	pn_tree_merge_init(&m, &p->prev, d, &c->tree);
+	while (pn_tree_merge_next(&m, &name, &old, &new)) {
+		if (pn_tree_join(child, sizeof(child), task->rel, name) < 0)
+			continue;
+		if (old == NULL) {
+			/* A new entry; the first scan only records the tree */
+			if (!p->initial) {
+				pn_tree_emit(p->watch, p->root, child, PN_CREATE);
+				changes++;
+			}
+			if (S_ISDIR(new->mode))
+				poll_schedule(p, child);
+		} else if (new == NULL) {
+			/* A deleted entry */
+			if (S_ISDIR(old->mode))
+				changes += pn_tree_delete(&p->prev, p->watch, p->root, child);
+			pn_tree_emit(p->watch, p->root, child, PN_DELETE);
+			changes++;
+		} else {
+			if ((mask = pn_tree_changed(old, new)) != 0) {
+				pn_tree_emit(p->watch, p->root, child, mask);
+				changes++;
+			}
+			if (S_ISDIR(new->mode))
+				poll_schedule(p, child);
+		}
+	}
+
+out:
+	MUTEX_LOCK(p->mtx);
+	if (c != NULL)
+		SLIST_INSERT_HEAD(&p->chunks, c, entries);
+	p->changes += changes;
+
+	/* The last task to finish completes the scan */
+	if (--p->pending == 0) {
+		if (p->closing) {
+			MUTEX_UNLOCK(p->mtx);
+			poll_free(p);
+			free(task);
+			return;
+		}
+		poll_finish(p);
+		if (p->initial) {
+			p->initial = false;
+			pn_event_add_path(p->watch, PN_READY, p->root);
+		}
+	}
+	MUTEX_UNLOCK(p->mtx);
+
+	free(task);
+}
+
+
+/**
+ * Check if the kernel is unable to report changes made to the filesystem
+ * containing @a path, so that it must be polled instead.
+ */
+bool
+pn_poll_required(const char *path)
+{
+#if defined(__linux__)
+	struct statfs sfs;
+
+	if (statfs(path, &sfs) < 0)
+		return false;
+
+	/* Remote and userspace filesystems only see local changes */
+	switch ((unsigned long) sfs.f_type) {
+		case 0x6969:		/* NFS */
+		case 0x65735546:	/* FUSE */
+		case 0x517b:		/* SMB */
+		case 0xff534d42:	/* CIFS */
+		case 0xfe534d42:	/* SMB2 */
+		case 0x73757245:	/* Coda */
+		case 0x5346414f:	/* AFS */
+		case 0x00c36400:	/* Ceph */
+		case 0x01021997:	/* 9P */
+			return true;
+		default:
+			return false;
+	}
+#else
+	/* kqueue(2) cannot watch a tree */
+	return true;
+#endif
+}
+
+
+/**
+ * Start polling a tree. The first scan records the state of the tree
+ * without generating any events, and then PN_READY is generated.
+ */
+int
+pn_poll_open(struct watch *watch)
+{
+	struct pn_poll *p;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	if (realpath(watch->path, p->root) == NULL) {
+		warn("realpath(3) of `%s'", watch->path);
+		free(p);
+		return -1;
+	}
+	if (pthread_mutex_init(&p->mtx, NULL) != 0) {
+		warn("pthread_mutex_init(3) failed");
+		free(p);
+		return -1;
+	}
+	p->watch = watch;
+	p->interval = p->cur = (watch->ident > 0) ? watch->ident : POLL_INTERVAL;
+	p->initial = true;
+	SLIST_INIT(&p->chunks);
+	watch->priv = p;
+
+	p->started = pn_time_ms();
+	poll_schedule(p, "");
+
+	return 0;
+}
+
+
+void
+pn_poll_close(struct watch *watch)
+{
+	struct pn_poll *p = watch->priv;
+	bool busy;
+
+	if (p == NULL)
+		return;
+	watch->priv = NULL;
+
+	MUTEX_LOCK(p->mtx);
+	p->closing = true;
+	if (p->timer != NULL && pn_timer_stop(p->timer) == 0)
+		p->timer = NULL;
+
+	/* A running scan or an expiring timer frees the state instead */
+	busy = (p->timer != NULL || p->pending > 0);
+	MUTEX_UNLOCK(p->mtx);
+
+	if (!busy)
+		poll_free(p);
+}
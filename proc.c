@@ -0,0 +1,128 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Waiting for a child process to exit (WATCH_PROC).
+ *
+ *  Under Linux, a pidfd for the child is added to the epoll set, and it
+ *  becomes readable when the child exits. BSD systems use an EVFILT_PROC
+ *  kevent instead. Either way, the worker thread reaps only that child,
+ *  so SIGCHLD is not needed and other children are not disturbed.
+ */
+
+#include <sys/wait.h>
+
+#if defined(__linux__)
+# include <sys/syscall.h>
+#endif
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+
+/* Free the state after the last reference is dropped */
+static void
+proc_release(void *arg)
+{
+	struct pn_proc *p = arg;
+
+	if (p->pidfd >= 0)
+		(void) close(p->pidfd);
+	free(p);
+}
+
+
+/**
+ * Set up a WATCH_PROC watch. Under Linux, this opens the pidfd.
+ */
+int
+pn_proc_open(struct watch *watch)
+{
+	struct pn_proc *p;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	p->pidfd = -1;
+
+#if defined(__linux__)
+# if defined(SYS_pidfd_open)
+	p->pidfd = syscall(SYS_pidfd_open, (pid_t) watch->ident, 0);
+# else
+	errno = ENOSYS;
+# endif
+	if (p->pidfd < 0) {
+		warn("pidfd_open(2)");
+		free(p);
+		return -1;
+	}
+#endif
+	pn_ref_init(&p->ref, proc_release);
+	watch->priv = p;
+
+	return 0;
+}
+
+
+/**
+ * Reap the child of a WATCH_PROC watch, and invoke the callback.
+ *
+ * This is called by a worker thread instead of the callback.
+ */
+void
+pn_proc_dispatch(struct watch *watch, int mask)
+{
+	struct pn_proc *p = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+	pid_t rv;
+	int status;
+
+	/* The watch has been cancelled; the event still holds the state */
+	if (p == NULL || p->done)
+		return;
+
+	do {
+		rv = waitpid((pid_t) watch->ident, &status, WNOHANG);
+	} while (rv < 0 && errno == EINTR);
+
+	/* The child is still running */
+	if (rv == 0)
+		return;
+
+	/* Only one worker may report the exit */
+	if (!__sync_bool_compare_and_swap(&p->done, false, true))
+		return;
+
+	/* Someone else has already collected the exit status */
+	if (rv < 0)
+		status = -1;
+
+	watch->cb((pid_t) watch->ident, status, watch->arg);
+}
+
+
+/**
+ * Drop the reference of the watch to its state. The pidfd is closed once
+ * the queued events and any running dispatch are done with it.
+ */
+void
+pn_proc_close(struct watch *watch)
+{
+	pn_ref_put(pn_ref_clear(&watch->priv));
+}
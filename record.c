@@ -0,0 +1,144 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  The event recorder.
+ *
+ *  Unlike the tracer, which keeps the most recent records of every thread
+ *  in memory, the recorder writes everything to a file, so that the pnreplay
+ *  program can feed it back through the library. The records are written
+ *  through one stdio buffer under RECORD_MUTEX, and the timestamp is taken
+ *  while the lock is held, so the file is in time order even when several
+ *  threads are recording. Events are recorded by pn_event_enqueue(), so
+ *  every event that reaches the queue is in the file, whatever its source.
+ */
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The size of the stdio buffer of the file */
+#define RECORD_BUFSIZ	(1 << 20)
+
+/** If nonzero, records are written */
+int RECORD_ENABLED;
+
+/** The file being written, protected by RECORD_MUTEX */
+static FILE *RECORD_FILE;
+static char *RECORD_BUF;
+static uint64_t RECORD_START;
+static pthread_mutex_t RECORD_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Write a record to the file.
+ *
+ * Use the PN_RECORD() macro instead, which does nothing unless recording
+ * has been started.
+ */
+void
+pn_record_write(int op, const struct watch *watch, int mask)
+{
+	struct pn_event_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.id = (uintptr_t) watch;
+	rec.op = op;
+	rec.wtype = watch->type;
+	rec.priority = watch->priority;
+	rec.mask = mask;
+
+	MUTEX_LOCK(RECORD_MUTEX);
+	if (RECORD_FILE != NULL) {
+		rec.ts = pn_time_ns() - RECORD_START;
+		if (fwrite(&rec, sizeof(rec), 1, RECORD_FILE) != 1) {
+			warn("unable to write an event record");
+			__atomic_store_n(&RECORD_ENABLED, 0, __ATOMIC_RELEASE);
+		}
+	}
+	MUTEX_UNLOCK(RECORD_MUTEX);
+}
+
+
+int
+pnotify_record_start(const char *path)
+{
+	struct pn_event_record_header hdr;
+	FILE *f;
+
+	MUTEX_LOCK(RECORD_MUTEX);
+	if (RECORD_FILE != NULL) {
+		MUTEX_UNLOCK(RECORD_MUTEX);
+		errno = EBUSY;
+		return -1;
+	}
+	if ((f = fopen(path, "w")) == NULL) {
+		MUTEX_UNLOCK(RECORD_MUTEX);
+		warn("fopen(3) of `%s'", path);
+		return -1;
+	}
+	if ((RECORD_BUF = malloc(RECORD_BUFSIZ)) != NULL)
+		(void) setvbuf(f, RECORD_BUF, _IOFBF, RECORD_BUFSIZ);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PN_RECORD_MAGIC, sizeof(hdr.magic));
+	hdr.version = PN_RECORD_VERSION;
+	hdr.record_size = sizeof(struct pn_event_record);
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+		MUTEX_UNLOCK(RECORD_MUTEX);
+		warn("unable to write `%s'", path);
+		(void) fclose(f);
+		free(RECORD_BUF);
+		RECORD_BUF = NULL;
+		return -1;
+	}
+
+	RECORD_FILE = f;
+	RECORD_START = pn_time_ns();
+	MUTEX_UNLOCK(RECORD_MUTEX);
+
+	__atomic_store_n(&RECORD_ENABLED, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+int
+pnotify_record_stop(void)
+{
+	int rv = 0;
+
+	__atomic_store_n(&RECORD_ENABLED, 0, __ATOMIC_RELEASE);
+
+	MUTEX_LOCK(RECORD_MUTEX);
+	if (RECORD_FILE == NULL) {
+		MUTEX_UNLOCK(RECORD_MUTEX);
+		errno = EINVAL;
+		return -1;
+	}
+	if (fclose(RECORD_FILE) != 0) {
+		warn("fclose(3) of the event record");
+		rv = -1;
+	}
+	RECORD_FILE = NULL;
+	free(RECORD_BUF);
+	RECORD_BUF = NULL;
+	MUTEX_UNLOCK(RECORD_MUTEX);
+
+	return rv;
+}
@@ -0,0 +1,228 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Reference counts for the private state of a watch.
+ *
+ *  The state cannot be freed as soon as the watch is cancelled, because
+ *  events for the watch may still be waiting in the queue, and a worker
+ *  may be in the middle of handling one. Instead, the state begins with a
+ *  struct pn_ref, and the watch, each queued event and each running
+ *  dispatch hold a reference to it. Cancelling the watch sets the pointer
+ *  to the state to NULL and drops the reference of the watch, and the
+ *  state is released when the last reference is dropped.
+ *
+ *  A reference is taken while holding one of a small set of mutexes,
+ *  chosen by the address of the pointer, and pn_ref_clear() takes the same
+ *  mutex, so a reference is never taken to state that is being released.
+ *
+ *  The poller threads are different, because they get a pointer to a watch
+ *  from the kernel, and may still be using it after the watch has been
+ *  removed from the kernel. State that a poller reads, such as the internal
+ *  watches of a WATCH_LISTEN watch, is released with pn_poller_defer()
+ *  instead. Each poller records the current epoch at the top of its loop,
+ *  before it waits for more events, and the deferred functions are called
+ *  once every poller has recorded a later epoch. A poller that has nothing
+ *  to do holds them back until it is woken up by its next event.
+ */
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The number of mutexes shared by all of the pointers */
+#define REF_LOCKS	64
+
+static pthread_mutex_t REF_MUTEX[REF_LOCKS] = {
+	[0 ... REF_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+/** The mutex that protects a pointer */
+#define REF_LOCK(slot)	REF_MUTEX[((uintptr_t) (slot) >> 4) % REF_LOCKS]
+
+/** A function to be called once the pollers have moved on */
+struct pn_deferred {
+	void (*func)(void *);
+	void *arg;
+	uint64_t epoch;		/** The epoch after which it may be called */
+	STAILQ_ENTRY(pn_deferred) entries;
+};
+
+STAILQ_HEAD(pn_deferred_list, pn_deferred);
+
+/** The deferred functions, oldest first, protected by DEFER_MUTEX */
+static struct pn_deferred_list DEFERRED = STAILQ_HEAD_INITIALIZER(DEFERRED);
+static pthread_mutex_t DEFER_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static size_t DEFER_COUNT;
+
+/** The current epoch, which is advanced by each deferred function */
+static uint64_t EPOCH;
+
+/** The epoch seen by each poller at the top of its loop */
+static uint64_t *POLLER_EPOCH;
+static unsigned int POLLER_NEXT;
+static __thread int POLLER_SELF = -1;
+
+
+/**
+ * Initialize the reference count of new state, which is held by the watch.
+ *
+ * @param release called to free the state after the last reference is dropped
+ */
+void
+pn_ref_init(struct pn_ref *ref, void (*release)(void *))
+{
+	ref->count = 1;
+	ref->release = release;
+}
+
+
+/**
+ * Take a reference to the state that a pointer refers to.
+ *
+ * @return the state, or NULL if the pointer is NULL
+ */
+void *
+pn_ref_get(void **slot)
+{
+	struct pn_ref *ref;
+
+	MUTEX_LOCK(REF_LOCK(slot));
+	if ((ref = *slot) != NULL)
+		(void) __atomic_add_fetch(&ref->count, 1, __ATOMIC_RELAXED);
+	MUTEX_UNLOCK(REF_LOCK(slot));
+
+	return ref;
+}
+
+
+/** Take another reference to state that the caller holds a reference to */
+void
+pn_ref_hold(void *obj)
+{
+	struct pn_ref *ref = obj;
+
+	(void) __atomic_add_fetch(&ref->count, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Drop a reference, and release the state if it was the last one.
+ * Nothing is done if @a obj is NULL.
+ */
+void
+pn_ref_put(void *obj)
+{
+	struct pn_ref *ref = obj;
+
+	if (ref != NULL && __atomic_sub_fetch(&ref->count, 1, __ATOMIC_ACQ_REL) == 0)
+		ref->release(ref);
+}
+
+
+/**
+ * Set a pointer to NULL, so that no more references can be taken.
+ *
+ * @return the previous value, whose reference now belongs to the caller
+ */
+void *
+pn_ref_clear(void **slot)
+{
+	void *obj;
+
+	MUTEX_LOCK(REF_LOCK(slot));
+	obj = *slot;
+	__atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+	MUTEX_UNLOCK(REF_LOCK(slot));
+
+	return obj;
+}
+
+
+/** Allocate the epochs of the pollers; called before they are started */
+void
+pn_poller_init(unsigned int count)
+{
+	if ((POLLER_EPOCH = calloc(count, sizeof(*POLLER_EPOCH))) == NULL)
+		err(1, "calloc(3)");
+}
+
+
+/**
+ * Call a function once every poller has finished with the events that it
+ * has already taken from the kernel. The caller must have removed the
+ * watches that @a arg refers to from the kernel.
+ */
+void
+pn_poller_defer(void (*func)(void *), void *arg)
+{
+	struct pn_deferred *d;
+
+	if ((d = malloc(sizeof(*d))) == NULL)
+		err(1, "malloc(3)");
+	d->func = func;
+	d->arg = arg;
+
+	MUTEX_LOCK(DEFER_MUTEX);
+	d->epoch = __atomic_add_fetch(&EPOCH, 1, __ATOMIC_SEQ_CST);
+	STAILQ_INSERT_TAIL(&DEFERRED, d, entries);
+	__atomic_store_n(&DEFER_COUNT, DEFER_COUNT + 1, __ATOMIC_RELAXED);
+	MUTEX_UNLOCK(DEFER_MUTEX);
+}
+
+
+/**
+ * Report that the calling poller is not using any watch, and call the
+ * deferred functions that every poller has moved past.
+ *
+ * This is called by each poller at the top of its loop.
+ */
+void
+pn_poller_quiescent(void)
+{
+	struct pn_deferred_list done;
+	struct pn_deferred *d;
+	uint64_t oldest;
+	unsigned int i;
+
+	if (POLLER_SELF < 0)
+		POLLER_SELF = __atomic_fetch_add(&POLLER_NEXT, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&POLLER_EPOCH[POLLER_SELF],
+			__atomic_load_n(&EPOCH, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&DEFER_COUNT, __ATOMIC_RELAXED) == 0)
+		return;
+
+	STAILQ_INIT(&done);
+	MUTEX_LOCK(DEFER_MUTEX);
+	oldest = UINT64_MAX;
+	for (i = 0; i < POLLER_COUNT; i++)
+		oldest = MIN(oldest, __atomic_load_n(&POLLER_EPOCH[i], __ATOMIC_SEQ_CST));
+	while ((d = STAILQ_FIRST(&DEFERRED)) != NULL && d->epoch <= oldest) {
+		STAILQ_REMOVE_HEAD(&DEFERRED, entries);
+		STAILQ_INSERT_TAIL(&done, d, entries);
+		__atomic_store_n(&DEFER_COUNT, DEFER_COUNT - 1, __ATOMIC_RELAXED);
+	}
+	MUTEX_UNLOCK(DEFER_MUTEX);
+
+	while ((d = STAILQ_FIRST(&done)) != NULL) {
+		STAILQ_REMOVE_HEAD(&done, entries);
+		d->func(d->arg);
+		free(d);
+	}
+}
@@ -0,0 +1,354 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  A simulated backend, used in place of epoll or kqueue when the
+ *  PNOTIFY_BACKEND environment variable is "sim".
+ *
+ *  Descriptors are never given to the kernel. Instead, the poller threads
+ *  report readiness from two in-memory sources: events added by
+ *  pnotify_sim_inject(), and events generated at a fixed rate for randomly
+ *  chosen watches by pnotify_sim_rate(). The events then go through the
+ *  same queue, workers and callbacks as kernel events, so the overhead of
+ *  the library can be measured without system call noise, and tests can
+ *  wait for a known number of events instead of sleeping.
+ *
+ *  Events are handed to the queue while SIM_MUTEX is held, so once
+ *  sim_rm_watch() has returned, no more events are added for the watch.
+ */
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The largest number of events reported by one wakeup of a poller */
+#define SIM_BATCH	100
+
+/** An injected event */
+struct sim_event {
+	struct watch *watch;
+	int mask;
+};
+
+static pthread_mutex_t SIM_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when there are events to report; uses CLOCK_MONOTONIC */
+static pthread_cond_t SIM_WAKE;
+
+/** The watches chosen from by the random source, protected by SIM_MUTEX */
+static struct watch **SIM_WATCH;
+static size_t SIM_NWATCH, SIM_WATCH_SIZE;
+
+/** A ring of injected events, protected by SIM_MUTEX */
+static struct sim_event *SIM_RING;
+static size_t SIM_HEAD, SIM_COUNT, SIM_RING_SIZE;
+
+/** The random source; a rate of zero turns it off */
+static double SIM_RATE;
+static uint64_t SIM_SEED;
+static uint64_t SIM_START;
+static uint64_t SIM_GENERATED;
+
+
+/* xorshift64*, which gives the same sequence for the same seed */
+static uint64_t
+sim_random(void)
+{
+	SIM_SEED ^= SIM_SEED >> 12;
+	SIM_SEED ^= SIM_SEED << 25;
+	SIM_SEED ^= SIM_SEED >> 27;
+
+	return SIM_SEED * 2685821657736338717ULL;
+}
+
+
+/* Get the number of random events that are due. The caller must hold SIM_MUTEX. */
+static uint64_t
+sim_due(uint64_t now)
+{
+	uint64_t total;
+
+	if (SIM_RATE <= 0 || SIM_NWATCH == 0)
+		return 0;
+	total = (uint64_t) ((now - SIM_START) / 1e9 * SIM_RATE);
+
+	return (total > SIM_GENERATED) ? total - SIM_GENERATED : 0;
+}
+
+
+/* Wait until an event is due. The caller must hold SIM_MUTEX. */
+static void
+sim_wait(void)
+{
+	struct timespec ts;
+	uint64_t next;
+
+	if (SIM_RATE <= 0 || SIM_NWATCH == 0) {
+		(void) pthread_cond_wait(&SIM_WAKE, &SIM_MUTEX);
+		return;
+	}
+
+	next = SIM_START + (uint64_t) ((SIM_GENERATED + 1) / SIM_RATE * 1e9);
+	ts.tv_sec = next / 1000000000;
+	ts.tv_nsec = next % 1000000000;
+	(void) pthread_cond_timedwait(&SIM_WAKE, &SIM_MUTEX, &ts);
+}
+
+
+static void *
+sim_loop(void *unused)
+{
+	struct sim_event *ev;
+	struct watch *w;
+	uint64_t due;
+	int n;
+
+	for (;;) {
+
+		/* Nothing from the previous batch is in use any more */
+		pn_poller_quiescent();
+
+		/* Hold back the events while the queue is full */
+		pn_event_throttle();
+
+		MUTEX_LOCK(SIM_MUTEX);
+		while (SIM_COUNT == 0 && (due = sim_due(pn_time_ns())) == 0)
+			sim_wait();
+		due = (SIM_COUNT == 0) ? MIN(due, SIM_BATCH) : 0;
+
+		/* Injected events come first, in the order they were added */
+		for (n = 0; n < SIM_BATCH && SIM_COUNT > 0; n++) {
+			ev = &SIM_RING[SIM_HEAD];
+			SIM_HEAD = (SIM_HEAD + 1) % SIM_RING_SIZE;
+			SIM_COUNT--;
+			PN_TRACE(PN_TRACE_READY, ev->watch, NULL, ev->mask);
+			pn_event_add(ev->watch, ev->mask);
+		}
+		for (; due > 0; due--, n++) {
+			SIM_GENERATED++;
+			w = SIM_WATCH[sim_random() % SIM_NWATCH];
+			PN_TRACE(PN_TRACE_READY, w, NULL, PN_READ);
+			pn_event_add(w, PN_READ);
+		}
+		MUTEX_UNLOCK(SIM_MUTEX);
+
+		pn_hist_record(&PN_STATS()->poll_batch, n);
+	}
+
+	return NULL;
+}
+
+
+static void
+sim_init_once(void)
+{
+	pthread_condattr_t attr;
+	pthread_t tid;
+	unsigned int i;
+
+	if (pthread_condattr_init(&attr) != 0 ||
+			pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+			pthread_cond_init(&SIM_WAKE, &attr) != 0)
+		errx(1, "pthread_cond_init(3) failed");
+	(void) pthread_condattr_destroy(&attr);
+
+	for (i = 0; i < POLLER_COUNT; i++) {
+		if (pthread_create(&tid, NULL, sim_loop, NULL) != 0)
+			errx(1, "pthread_create(3) failed");
+	}
+}
+
+
+static void
+sim_cleanup(void)
+{
+}
+
+
+/*
+ * Check if a random PN_READ makes sense for a watch. Timers, signals,
+ * posts, listening sockets and forwarding have their own sources, or
+ * would act on a readiness that the descriptor does not have.
+ */
+static bool
+sim_random_target(const struct watch *watch)
+{
+	switch (watch->type) {
+		case WATCH_FD:
+		case WATCH_BUFFER:
+		case WATCH_DATAGRAM:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+
+static int
+sim_add_watch(struct watch *watch)
+{
+	struct watch **p;
+
+	switch (watch->type) {
+
+		/* These need the kernel to tell them what changed */
+		case WATCH_MOUNT:
+		case WATCH_TAIL:
+		case WATCH_PROC:
+			warnx("watch type %d is not simulated", watch->type);
+			return -1;
+
+		default:
+			break;
+	}
+
+	/* Everything else is only reported when an event is injected */
+	if (!sim_random_target(watch))
+		return 0;
+
+	MUTEX_LOCK(SIM_MUTEX);
+	if (SIM_NWATCH == SIM_WATCH_SIZE) {
+		SIM_WATCH_SIZE = (SIM_WATCH_SIZE > 0) ? SIM_WATCH_SIZE * 2 : 64;
+		if ((p = realloc(SIM_WATCH, SIM_WATCH_SIZE * sizeof(*p))) == NULL)
+			err(1, "realloc(3)");
+		SIM_WATCH = p;
+	}
+	SIM_WATCH[SIM_NWATCH++] = watch;
+
+	/* The random source may have been waiting for a watch */
+	(void) pthread_cond_broadcast(&SIM_WAKE);
+	MUTEX_UNLOCK(SIM_MUTEX);
+
+	return 0;
+}
+
+
+static int
+sim_rm_watch(struct watch *watch)
+{
+	size_t i, j, n;
+
+	MUTEX_LOCK(SIM_MUTEX);
+	for (i = 0; i < SIM_NWATCH; i++) {
+		if (SIM_WATCH[i] == watch) {
+			SIM_WATCH[i] = SIM_WATCH[--SIM_NWATCH];
+			break;
+		}
+	}
+
+	/* Drop the injected events that have not been reported yet */
+	for (i = j = 0, n = SIM_COUNT; i < n; i++) {
+		if (SIM_RING[(SIM_HEAD + i) % SIM_RING_SIZE].watch == watch) {
+			SIM_COUNT--;
+			continue;
+		}
+		SIM_RING[(SIM_HEAD + j++) % SIM_RING_SIZE] =
+			SIM_RING[(SIM_HEAD + i) % SIM_RING_SIZE];
+	}
+	MUTEX_UNLOCK(SIM_MUTEX);
+
+	return 0;
+}
+
+
+static int
+sim_mod_watch(struct watch *watch, int mask)
+{
+	/* Every watch is reported whenever an event is injected for it */
+	return 0;
+}
+
+
+/* The eventfd of a WATCH_USER watch is not polled, so queue the post */
+static void
+sim_post(struct watch *watch)
+{
+	pn_event_add(watch, PN_READ);
+}
+
+
+int
+pnotify_sim_inject(struct watch *watch, int mask)
+{
+	struct sim_event *ring, *ev;
+	size_t i, size;
+
+	if (sys != &SIM_VTABLE) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (watch == NULL || mask == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	MUTEX_LOCK(SIM_MUTEX);
+	if (SIM_COUNT == SIM_RING_SIZE) {
+		size = (SIM_RING_SIZE > 0) ? SIM_RING_SIZE * 2 : 1024;
+		if ((ring = malloc(size * sizeof(*ring))) == NULL)
+			err(1, "malloc(3)");
+		for (i = 0; i < SIM_COUNT; i++)
+			ring[i] = SIM_RING[(SIM_HEAD + i) % SIM_RING_SIZE];
+		free(SIM_RING);
+		SIM_RING = ring;
+		SIM_RING_SIZE = size;
+		SIM_HEAD = 0;
+	}
+	ev = &SIM_RING[(SIM_HEAD + SIM_COUNT++) % SIM_RING_SIZE];
+	ev->watch = watch;
+	ev->mask = mask;
+	(void) pthread_cond_signal(&SIM_WAKE);
+	MUTEX_UNLOCK(SIM_MUTEX);
+
+	return 0;
+}
+
+
+int
+pnotify_sim_rate(double rate, unsigned int seed)
+{
+	if (sys != &SIM_VTABLE) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (rate < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	MUTEX_LOCK(SIM_MUTEX);
+	SIM_RATE = rate;
+	SIM_SEED = (uint64_t) seed * 0x9E3779B97F4A7C15ULL + 1;
+	SIM_START = pn_time_ns();
+	SIM_GENERATED = 0;
+	(void) pthread_cond_broadcast(&SIM_WAKE);
+	MUTEX_UNLOCK(SIM_MUTEX);
+
+	return 0;
+}
+
+
+const struct pnotify_vtable SIM_VTABLE = {
+	.init_once = sim_init_once,
+	.add_watch = sim_add_watch,
+	.rm_watch = sim_rm_watch,
+	.mod_watch = sim_mod_watch,
+	.cleanup = sim_cleanup,
+	.post = sim_post,
+};
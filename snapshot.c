@@ -0,0 +1,379 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Snapshots of a watched tree, used to find the changes that were made
+ *  while the program was not running.
+ *
+ *  A snapshot file contains a header, a table of directories sorted by
+ *  pathname, a table of directory entries grouped by directory and sorted
+ *  by name, and a string table. The file is mapped into memory and used
+ *  in place, so loading it costs nothing until a directory is looked up.
+ *
+ *  When a snapshot is compared with the live tree, a directory whose
+ *  inode number and modification time have not changed has the same set
+ *  of entries as before, so it is not read again; only the stat(2) of
+ *  each file in it is compared. Each directory is compared by a task
+ *  running on the worker pool.
+ *
+ *  The tables are those of a struct pn_tree (see tree.c), which the
+ *  polling fallback also uses, so the tree is read and compared with the
+ *  same code.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** Identifies a snapshot file, including the version of the format */
+static const char SNAP_MAGIC[8] = { 'P', 'N', 'S', 'N', 'A', 'P', 0, 1 };
+
+/** The header at the start of a snapshot file */
+struct snap_header {
+	char     magic[8];
+	uint32_t ndirs;		/** The number of entries in the directory table */
+	uint32_t nrecs;		/** The number of entries in the record table */
+	uint64_t strlen;	/** The size of the string table */
+};
+
+/** A snapshot being compared with the live tree */
+struct snap_diff {
+	struct watch *watch;
+	char root[PATH_MAX];
+	void *map;
+	size_t maplen;
+	const struct snap_header *hdr;
+
+	/** The tables, which point into the mapped file */
+	struct pn_tree tree;
+
+	/** The number of directories waiting to be compared */
+	int pending;
+};
+
+/** A directory waiting to be compared */
+struct snap_task {
+	struct snap_diff *sd;
+	bool  is_new;		/** If true, the directory is not in the snapshot */
+	char  rel[];
+};
+
+
+static int64_t
+snap_mtime(const struct stat *sb)
+{
+	return ((int64_t) sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec);
+}
+
+
+/* Add a directory and everything beneath it to the snapshot */
+static void
+snap_walk(struct pn_tree *t, const char *root, const char *rel,
+		const struct stat *st)
+{
+	char path[PATH_MAX], child[PATH_MAX];
+	struct pn_tree ents;
+	struct stat cst;
+	size_t di, i;
+	DIR *dirp;
+
+	if (pn_tree_join(path, sizeof(path), root, rel) < 0 ||
+			(dirp = opendir(rel[0] == '\0' ? root : path)) == NULL)
+		return;
+	memset(&ents, 0, sizeof(ents));
+	pn_tree_readdir(dirp, &ents);
+	(void) closedir(dirp);
+
+	/* Add the directory, with a record for each entry */
+	di = pn_tree_add_dir(t, rel);
+	t->dir[di].ino = st->st_ino;
+	t->dir[di].mtime = snap_mtime(st);
+	t->dir[di].count = ents.nrecs;
+	pn_tree_append(t, &ents, 0, ents.nrecs);
+
+	/* Visit the subdirectories in order */
+	for (i = 0; i < ents.nrecs; i++) {
+		if (!S_ISDIR(ents.rec[i].mode))
+			continue;
+		if (pn_tree_join(child, sizeof(child), rel,
+					pn_tree_str(&ents, ents.rec[i].name)) < 0 ||
+				pn_tree_join(path, sizeof(path), root, child) < 0 ||
+				lstat(path, &cst) < 0 || !S_ISDIR(cst.st_mode))
+			continue;
+		snap_walk(t, root, child, &cst);
+	}
+
+	pn_tree_free(&ents);
+}
+
+
+int
+pnotify_snapshot_save(struct watch *watch, const char *file)
+{
+	struct pn_tree t;
+	struct snap_header hdr;
+	char root[PATH_MAX], tmpfile[PATH_MAX];
+	struct stat st;
+	FILE *f;
+	int rv = -1;
+
+	if (watch->type != WATCH_MOUNT && watch->type != WATCH_POLL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (realpath(watch->path, root) == NULL || stat(root, &st) < 0) {
+		warn("unable to stat `%s'", watch->path);
+		return -1;
+	}
+	if (snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file) >= sizeof(tmpfile)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&t, 0, sizeof(t));
+	snap_walk(&t, root, "", &st);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.ndirs = t.ndirs;
+	hdr.nrecs = t.nrecs;
+	hdr.strlen = t.strlen;
+
+	/* Write a new file, then replace the old one */
+	if ((f = fopen(tmpfile, "w")) == NULL) {
+		warn("fopen(3) of `%s'", tmpfile);
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+			fwrite(t.dir, sizeof(*t.dir), t.ndirs, f) != t.ndirs ||
+			fwrite(t.rec, sizeof(*t.rec), t.nrecs, f) != t.nrecs ||
+			fwrite(t.str, 1, t.strlen, f) != t.strlen) {
+		warn("fwrite(3) of `%s'", tmpfile);
+		(void) fclose(f);
+		(void) unlink(tmpfile);
+		goto out;
+	}
+
+	/* The data must be on disk before the rename, or a crash may leave an empty file */
+	if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+		warn("unable to sync `%s'", tmpfile);
+		(void) fclose(f);
+		(void) unlink(tmpfile);
+		goto out;
+	}
+	if (fclose(f) != 0 || rename(tmpfile, file) < 0) {
+		warn("unable to write `%s'", file);
+		(void) unlink(tmpfile);
+		goto out;
+	}
+	rv = 0;
+
+out:
+	pn_tree_free(&t);
+	return rv;
+}
+
+
+/* Report a file as modified if it differs from its record */
+static void
+snap_compare(struct snap_diff *sd, int dfd, const char *rel,
+		const char *name, const struct pn_tree_rec *rec)
+{
+	struct pn_tree_rec cur;
+	int mask;
+
+	if (pn_tree_stat(dfd, name, &cur) < 0)
+		mask = PN_DELETE;
+	else
+		mask = pn_tree_changed(rec, &cur);
+	if (mask != 0)
+		pn_tree_emit(sd->watch, sd->root, rel, mask);
+}
+
+
+static void snap_diff_dir(void *arg);
+
+static void
+snap_schedule(struct snap_diff *sd, const char *rel, bool is_new)
+{
+	struct snap_task *task;
+	size_t len = strlen(rel) + 1;
+
+	if ((task = malloc(sizeof(*task) + len)) == NULL)
+		err(1, "malloc(3)");
+	task->sd = sd;
+	task->is_new = is_new;
+	memcpy(task->rel, rel, len);
+
+	(void) __sync_fetch_and_add(&sd->pending, 1);
+	pn_task_add(snap_diff_dir, task);
+}
+
+
+/* Compare one directory with the snapshot */
+static void
+snap_diff_dir(void *arg)
+{
+	struct snap_task *task = arg;
+	struct snap_diff *sd = task->sd;
+	const struct pn_tree *t = &sd->tree;
+	const struct pn_tree_dir *d = NULL;
+	const struct pn_tree_rec *rec, *old, *new;
+	struct pn_tree_merge m;
+	struct pn_tree ents;
+	char path[PATH_MAX], child[PATH_MAX];
+	struct stat st;
+	const char *name;
+	size_t i;
+	DIR *dirp;
+	int mask;
+
+	if (snprintf(path, sizeof(path), "%s/%s", sd->root, task->rel) >= sizeof(path) ||
+			(dirp = opendir(path)) == NULL)
+		goto out;
+	if (fstat(dirfd(dirp), &st) < 0) {
+		(void) closedir(dirp);
+		goto out;
+	}
+	if (!task->is_new)
+		d = pn_tree_find_dir(t, task->rel);
+
+	/* An unchanged directory still has the same entries */
+	if (d != NULL && d->ino == st.st_ino && d->mtime == snap_mtime(&st)) {
+		for (i = 0; i < d->count; i++) {
+			rec = &t->rec[d->first + i];
+			name = pn_tree_str(t, rec->name);
+			if (pn_tree_join(child, sizeof(child), task->rel, name) < 0)
+				continue;
+			if (S_ISDIR(rec->mode))
+				snap_schedule(sd, child, false);
+			else
+				snap_compare(sd, dirfd(dirp), child, name, rec);
+		}
+		(void) closedir(dirp);
+		goto out;
+	}
+
+	/* Merge the sorted entries with the sorted records */
+	memset(&ents, 0, sizeof(ents));
+	pn_tree_readdir(dirp, &ents);
+	(void) closedir(dirp);
+	pn_tree_merge_init(&m, t, d, &ents);
+	while (pn_tree_merge_next(&m, &name, &old, &new)) {
+		if (pn_tree_join(child, sizeof(child), task->rel, name) < 0)
+			continue;
+		if (old == NULL) {
+			/* A new entry */
+			pn_tree_emit(sd->watch, sd->root, child, PN_CREATE);
+			if (S_ISDIR(new->mode))
+				snap_schedule(sd, child, true);
+		} else if (new == NULL) {
+			/* A deleted entry */
+			if (S_ISDIR(old->mode))
+				(void) pn_tree_delete(t, sd->watch, sd->root, child);
+			pn_tree_emit(sd->watch, sd->root, child, PN_DELETE);
+		} else if (S_ISDIR(old->mode)) {
+			snap_schedule(sd, child, false);
+		} else if ((mask = pn_tree_changed(old, new)) != 0) {
+			pn_tree_emit(sd->watch, sd->root, child, mask);
+		}
+	}
+	pn_tree_free(&ents);
+
+out:
+	/* The last task to finish releases the snapshot */
+	if (__sync_sub_and_fetch(&sd->pending, 1) == 0) {
+		(void) munmap(sd->map, sd->maplen);
+		free(sd);
+	}
+	free(task);
+}
+
+
+int
+pnotify_snapshot_load(struct watch *watch, const char *file)
+{
+	struct snap_diff *sd;
+	struct stat st;
+	size_t need;
+	int fd;
+
+	if (watch->type != WATCH_MOUNT && watch->type != WATCH_POLL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((sd = calloc(1, sizeof(*sd))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	sd->watch = watch;
+	if (realpath(watch->path, sd->root) == NULL) {
+		warn("realpath(3) of `%s'", watch->path);
+		goto err1;
+	}
+
+	/* Map the snapshot into memory */
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+		goto err1;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct snap_header)) {
+		(void) close(fd);
+		errno = EINVAL;
+		goto err1;
+	}
+	sd->maplen = st.st_size;
+	sd->map = mmap(NULL, sd->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close(fd);
+	if (sd->map == MAP_FAILED) {
+		warn("mmap(2) of `%s'", file);
+		goto err1;
+	}
+
+	/* Validate the header */
+	sd->hdr = sd->map;
+	need = sizeof(*sd->hdr) + (size_t) sd->hdr->ndirs * sizeof(struct pn_tree_dir) +
+		(size_t) sd->hdr->nrecs * sizeof(struct pn_tree_rec) + sd->hdr->strlen;
+	if (memcmp(sd->hdr->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+			need != sd->maplen || sd->hdr->strlen == 0 ||
+			((const char *) sd->map)[sd->maplen - 1] != '\0') {
+		warnx("`%s' is not a valid snapshot", file);
+		errno = EINVAL;
+		goto err2;
+	}
+	sd->tree.dir = (struct pn_tree_dir *) (sd->hdr + 1);
+	sd->tree.ndirs = sd->hdr->ndirs;
+	sd->tree.rec = (struct pn_tree_rec *) (sd->tree.dir + sd->tree.ndirs);
+	sd->tree.nrecs = sd->hdr->nrecs;
+	sd->tree.str = (char *) (sd->tree.rec + sd->tree.nrecs);
+	sd->tree.strlen = sd->hdr->strlen;
+
+	/* Compare the tree with the snapshot, starting at the root */
+	snap_schedule(sd, "", false);
+
+	return 0;
+
+err2:
+	(void) munmap(sd->map, sd->maplen);
+
+err1:
+	free(sd);
+	return -1;
+}
@@ -0,0 +1,281 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Runtime statistics.
+ *
+ *  Each thread that counts something gets its own struct pnotify_stats,
+ *  which only that thread writes to. pnotify_stats() adds them all up.
+ *  When a thread exits, its counts are added to a total for the exited
+ *  threads, and its copy is freed.
+ *
+ *  The histograms are log-linear, in the style of HdrHistogram: every
+ *  power of two is divided into HIST_SUB buckets of equal width.
+ */
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The number of buckets for each power of two, as a power of two */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+
+/** The statistics of one thread */
+struct pn_stats_thread {
+	struct pnotify_stats stats;
+	LIST_ENTRY(pn_stats_thread) entries;
+};
+
+/** The statistics of the current thread */
+__thread struct pnotify_stats *STATS_SELF;
+
+/** The statistics of every running thread, protected by STATS_MUTEX */
+static LIST_HEAD(, pn_stats_thread) STATS_THREADS = LIST_HEAD_INITIALIZER(STATS_THREADS);
+
+/** The total of the threads that have exited, protected by STATS_MUTEX */
+static struct pnotify_stats STATS_EXITED;
+
+static pthread_mutex_t STATS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t STATS_KEY;
+static pthread_once_t STATS_ONCE = PTHREAD_ONCE_INIT;
+
+
+static unsigned int
+hist_bucket(uint64_t value)
+{
+	unsigned int exp;
+
+	if (value < HIST_SUB)
+		return value;
+	exp = 63 - __builtin_clzll(value);
+
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB +
+		((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+
+/* Get the largest value that falls into a bucket */
+static uint64_t
+hist_upper(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+	shift = bucket / HIST_SUB - 1;
+
+	return ((uint64_t) (HIST_SUB + bucket % HIST_SUB) << shift) +
+		(((uint64_t) 1 << shift) - 1);
+}
+
+
+static void
+hist_merge(struct pn_histogram *dst, const struct pn_histogram *src)
+{
+	unsigned int i;
+	uint64_t max;
+
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > dst->max)
+		dst->max = max;
+	for (i = 0; i < PN_HIST_BUCKETS; i++)
+		dst->bucket[i] += __atomic_load_n(&src->bucket[i], __ATOMIC_RELAXED);
+}
+
+
+static void
+stats_merge(struct pnotify_stats *dst, const struct pnotify_stats *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < PN_WATCH_TYPES; i++) {
+		dst->enqueued[i] += __atomic_load_n(&src->enqueued[i], __ATOMIC_RELAXED);
+		dst->dispatched[i] += __atomic_load_n(&src->dispatched[i], __ATOMIC_RELAXED);
+	}
+	dst->tasks_submitted += __atomic_load_n(&src->tasks_submitted, __ATOMIC_RELAXED);
+	dst->tasks_run += __atomic_load_n(&src->tasks_run, __ATOMIC_RELAXED);
+	dst->timers_fired += __atomic_load_n(&src->timers_fired, __ATOMIC_RELAXED);
+	for (i = 0; i < PN_MUTEX_COUNT; i++) {
+		dst->mutex_waits[i] += __atomic_load_n(&src->mutex_waits[i], __ATOMIC_RELAXED);
+		dst->mutex_wait_ns[i] += __atomic_load_n(&src->mutex_wait_ns[i], __ATOMIC_RELAXED);
+	}
+	dst->spins += __atomic_load_n(&src->spins, __ATOMIC_RELAXED);
+	dst->spin_hits += __atomic_load_n(&src->spin_hits, __ATOMIC_RELAXED);
+	dst->spin_ns += __atomic_load_n(&src->spin_ns, __ATOMIC_RELAXED);
+	hist_merge(&dst->poll_batch, &src->poll_batch);
+	hist_merge(&dst->latency, &src->latency);
+	hist_merge(&dst->callback, &src->callback);
+}
+
+
+/* Fold the statistics of an exiting thread into STATS_EXITED */
+static void
+stats_exit(void *arg)
+{
+	struct pn_stats_thread *t = arg;
+
+	MUTEX_LOCK(STATS_MUTEX);
+	LIST_REMOVE(t, entries);
+	stats_merge(&STATS_EXITED, &t->stats);
+	MUTEX_UNLOCK(STATS_MUTEX);
+
+	STATS_SELF = NULL;
+	free(t);
+}
+
+
+static void
+stats_init_once(void)
+{
+	if (pthread_key_create(&STATS_KEY, stats_exit) != 0)
+		errx(1, "pthread_key_create(3) failed");
+}
+
+
+/**
+ * Create the statistics of the current thread.
+ *
+ * This is called by PN_STATS() the first time a thread counts something.
+ */
+struct pnotify_stats *
+pn_stats_alloc(void)
+{
+	struct pn_stats_thread *t;
+
+	(void) pthread_once(&STATS_ONCE, stats_init_once);
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		err(1, "calloc(3)");
+	if (pthread_setspecific(STATS_KEY, t) != 0)
+		errx(1, "pthread_setspecific(3) failed");
+
+	MUTEX_LOCK(STATS_MUTEX);
+	LIST_INSERT_HEAD(&STATS_THREADS, t, entries);
+	MUTEX_UNLOCK(STATS_MUTEX);
+
+	STATS_SELF = &t->stats;
+	return STATS_SELF;
+}
+
+
+/**
+ * Add a value to a histogram owned by the current thread.
+ */
+void
+pn_hist_record(struct pn_histogram *hist, uint64_t value)
+{
+	PN_STAT_ADD(hist->count, 1);
+	PN_STAT_ADD(hist->sum, value);
+	if (value > hist->max)
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+	PN_STAT_ADD(hist->bucket[hist_bucket(value)], 1);
+}
+
+
+/**
+ * Lock a mutex that another thread holds, and count the time spent waiting.
+ *
+ * This is called by MUTEX_LOCK() when pthread_mutex_trylock(3) fails.
+ */
+void
+pn_mutex_wait(pthread_mutex_t *mtx)
+{
+	struct pnotify_stats *st = STATS_SELF;
+	enum pn_mutex_id id;
+	uint64_t start;
+
+	/* Creating the statistics takes a lock, so do not count this one */
+	if (st == NULL) {
+		(void) pthread_mutex_lock(mtx);
+		return;
+	}
+
+	start = pn_time_ns();
+	(void) pthread_mutex_lock(mtx);
+
+	if (mtx == &EVENT_MUTEX)
+		id = PN_MUTEX_EVENT;
+	else if (mtx == &WATCH_MUTEX)
+		id = PN_MUTEX_WATCH;
+	else if (mtx == &TIMER_MUTEX)
+		id = PN_MUTEX_TIMER;
+	else
+		id = PN_MUTEX_OTHER;
+	PN_STAT_ADD(st->mutex_waits[id], 1);
+	PN_STAT_ADD(st->mutex_wait_ns[id], pn_time_ns() - start);
+}
+
+
+int
+pnotify_stats(struct pnotify_stats *stats)
+{
+	struct pn_stats_thread *t;
+	size_t idle;
+
+	if (stats == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+
+	MUTEX_LOCK(STATS_MUTEX);
+	stats_merge(stats, &STATS_EXITED);
+	LIST_FOREACH(t, &STATS_THREADS, entries)
+		stats_merge(stats, &t->stats);
+	MUTEX_UNLOCK(STATS_MUTEX);
+
+	stats->queue_depth = pn_event_count();
+	stats->timers_active = pn_timer_count();
+	idle = pn_worker_idle();
+	stats->workers_idle = MIN(idle, WORKER_COUNT);
+	stats->workers_busy = WORKER_COUNT - stats->workers_idle;
+
+	return 0;
+}
+
+
+uint64_t
+pnotify_stats_percentile(const struct pn_histogram *hist, double pct)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	/* The rank of the percentile, counting from 1 */
+	if (pct <= 0)
+		rank = 1;
+	else if (pct >= 100)
+		rank = hist->count;
+	else
+		rank = (uint64_t) ((pct / 100) * hist->count + 0.5);
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < PN_HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= rank)
+			return MIN(hist_upper(i), hist->max);
+	}
+
+	return hist->max;
+}
@@ -0,0 +1,226 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Log file tailing (WATCH_TAIL).
+ *
+ *  The system-specific code generates an event whenever the file is
+ *  written to, or when a file is created, renamed or deleted at the
+ *  watched pathname. The worker thread then reads any data that was
+ *  appended since the last event and passes it to the callback.
+ */
+
+#include <fcntl.h>
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/**
+ * The size of the buffer used for pread(2).
+ *
+ * The file is not mapped into memory, because a copytruncate rotation
+ * would raise SIGBUS while the callback is reading the mapping.
+ */
+#define TAIL_CHUNK	(64 * 1024)
+
+
+/* Open the file at the watched pathname, if there is one */
+static int
+tail_reopen(struct watch *watch, struct pn_tail *t)
+{
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(watch->path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			warn("open(2) of `%s'", watch->path);
+		return -1;
+	}
+	if (fstat(fd, &sb) < 0) {
+		warn("fstat(2)");
+		(void) close(fd);
+		return -1;
+	}
+
+	if (t->fd >= 0)
+		(void) close(t->fd);
+	t->fd = fd;
+	t->dev = sb.st_dev;
+	t->ino = sb.st_ino;
+	t->offset = 0;
+
+	return 0;
+}
+
+
+/* Pass all data between the current offset and end-of-file to the callback */
+static void
+tail_drain(struct watch *watch, struct pn_tail *t)
+{
+	struct stat sb;
+	ssize_t n;
+
+	if (t->fd < 0)
+		return;
+
+	for (;;) {
+		if (fstat(t->fd, &sb) < 0) {
+			warn("fstat(2)");
+			return;
+		}
+
+		/* A file that shrank has been truncated */
+		if (sb.st_size < t->offset) {
+			t->offset = 0;
+			watch->cb(NULL, 0, PN_TRUNCATE, watch->arg);
+		}
+		if (sb.st_size == t->offset)
+			return;
+
+		n = pread(t->fd, t->buf, TAIL_CHUNK, t->offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("pread(2)");
+			return;
+		}
+		if (n == 0)
+			return;
+		t->offset += n;
+		watch->cb(t->buf, (size_t) n, PN_READ, watch->arg);
+	}
+}
+
+
+/* Free the state after the last reference is dropped */
+static void
+tail_release(void *arg)
+{
+	struct pn_tail *t = arg;
+
+	if (t->fd >= 0)
+		(void) close(t->fd);
+	if (t->notify_fd >= 0)
+		(void) close(t->notify_fd);
+	(void) pthread_mutex_destroy(&t->mtx);
+	free(t->buf);
+	free(t);
+}
+
+
+/**
+ * Open the file to be tailed. Reading begins at the current end-of-file.
+ *
+ * If the file does not exist yet, reading begins when it is created.
+ */
+int
+pn_tail_open(struct watch *watch)
+{
+	struct pn_tail *t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	pn_ref_init(&t->ref, tail_release);
+	t->fd = -1;
+	t->notify_fd = -1;
+	t->wd_file = -1;
+	if ((t->buf = malloc(TAIL_CHUNK)) == NULL) {
+		warn("malloc(3)");
+		goto err1;
+	}
+	if (pthread_mutex_init(&t->mtx, NULL) != 0) {
+		warn("pthread_mutex_init(3) failed");
+		goto err1;
+	}
+
+	if (tail_reopen(watch, t) == 0 &&
+			(t->offset = lseek(t->fd, 0, SEEK_END)) < 0) {
+		warn("lseek(2)");
+		(void) close(t->fd);
+		goto err2;
+	}
+
+	watch->priv = t;
+	return 0;
+
+err2:
+	(void) pthread_mutex_destroy(&t->mtx);
+
+err1:
+	free(t->buf);
+	free(t);
+	return -1;
+}
+
+
+/**
+ * Handle an event for a WATCH_TAIL watch.
+ *
+ * This is called by a worker thread instead of the callback.
+ */
+void
+pn_tail_dispatch(struct watch *watch, int mask)
+{
+	struct pn_tail *t = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+	struct stat sb;
+
+	/* The watch has been cancelled; the event still holds the state */
+	if (t == NULL)
+		return;
+
+	MUTEX_LOCK(t->mtx);
+
+	/* Check if the file was rotated */
+	if ((mask & (PN_CREATE | PN_DELETE | PN_RENAME)) || t->fd < 0) {
+		if (stat(watch->path, &sb) == 0 &&
+				(t->fd < 0 || sb.st_dev != t->dev || sb.st_ino != t->ino)) {
+
+			/* Finish reading the old file first */
+			tail_drain(watch, t);
+
+			if (tail_reopen(watch, t) == 0) {
+				watch->cb(NULL, 0, PN_RENAME, watch->arg);
+
+				/* Start watching the new file */
+				(void) sys->add_watch(watch);
+			}
+		}
+	}
+
+	tail_drain(watch, t);
+
+	MUTEX_UNLOCK(t->mtx);
+}
+
+
+/**
+ * Drop the reference of the watch to its state. The state is freed once
+ * the queued events, any running dispatch and the pollers, which read the
+ * inotify descriptor, are done with it.
+ */
+void
+pn_tail_close(struct watch *watch)
+{
+	struct pn_tail *t;
+
+	if ((t = pn_ref_clear(&watch->priv)) != NULL)
+		pn_poller_defer(pn_ref_put, t);
+}
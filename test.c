@@ -1,10 +1,15 @@
 #include <err.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "pnotify.h"
@@ -13,6 +18,34 @@
 int FD_RESULT = -1;
 int TIMER_RESULT = -1;
 int SIGNAL_RESULT = -1;
+int MOUNT_RESULT = -1;
+int DEBOUNCE_RESULT = -1;
+int TAIL_RESULT = -1;
+int SNAPSHOT_RESULT = -1;
+int POLL_RESULT = -1;
+int CHECKSUM_RESULT = -1;
+int BUFFER_RESULT = -1;
+int FORWARD_RESULT = -1;
+int FRAME_RESULT = -1;
+int LISTEN_RESULT = -1;
+int DGRAM_RESULT = -1;
+int PROC_RESULT = -1;
+int USER_RESULT = -1;
+int SUBMIT_RESULT = -1;
+int PINNED_RESULT = -1;
+int PRIORITY_RESULT = -1;
+int STATS_RESULT = -1;
+int TRACE_RESULT = -1;
+int SIM_RESULT = -1;
+int REPLAY_RESULT = -1;
+int CANCEL_RESULT = -1;
+int POLLERS_RESULT = -1;
+
+/* The two ends of the socket pair used by test_buffer() */
+int BUFFER_SV[2];
+
+/* The number of filesystem watches that have finished scanning */
+volatile int READY_COUNT = 0;
 
 #define test(x) do { \
    printf(" * " #x ": "); 				\
@@ -69,10 +102,1085 @@ test_timer()
 	test ((w = watch_timer(1, timer_cb, NULL)));
 }
 
+/* Wait for the initial scan of a filesystem watch to complete */
+static void
+wait_ready(int count)
+{
+	int i;
+
+	for (i = 0; i < 500 && READY_COUNT < count; i++)
+		usleep(10000);
+	test (READY_COUNT >= count ? 0 : -1);
+}
+
+void
+mount_cb(const char *path, int evt, void *arg)
+{
+	if (evt & PN_READY)
+		__sync_fetch_and_add(&READY_COUNT, 1);
+	if ((evt & PN_CREATE) && strstr(path, ".check/dir/file") != NULL)
+		MOUNT_RESULT = 0;
+}
+
+static void
+test_mount()
+{
+ 	struct watch *w;
+	int fd;
+
+	printf("mount tests\n");
+	test ((w = watch_mount(".check", mount_cb, NULL)) ? 0 : -1);
+	wait_ready(1);
+	test ((fd = open(".check/dir/file", O_CREAT | O_WRONLY, 0644)));
+	(void) close(fd);
+}
+
+void
+debounce_cb(const char *path, int evt, void *arg)
+{
+	if (evt & PN_READY)
+		__sync_fetch_and_add(&READY_COUNT, 1);
+	if (strstr(path, "storm") == NULL)
+		return;
+
+	/* Exactly one merged event is expected */
+	if (DEBOUNCE_RESULT < 0 && (evt & (PN_CREATE | PN_MODIFY)) == (PN_CREATE | PN_MODIFY))
+		DEBOUNCE_RESULT = 0;
+	else
+		DEBOUNCE_RESULT = 1;
+}
+
+static void
+test_debounce()
+{
+ 	struct watch *w;
+	int i, fd;
+
+	printf("debounce tests\n");
+	test ((w = watch_mount(".check/dir", debounce_cb, NULL)) ? 0 : -1);
+	test (watch_debounce(w, 500));
+	wait_ready(2);
+	test ((fd = open(".check/dir/storm", O_CREAT | O_WRONLY, 0644)));
+	for (i = 0; i < 10; i++) {
+		if (write(fd, "a", 1) != 1)
+			err(1, "write(2)");
+	}
+	(void) close(fd);
+}
+
+void
+tail_cb(const char *buf, size_t len, int evt, void *arg)
+{
+	static int state = 0;
+
+	/* Expect the appended data, the rotation, then the new file */
+	if (state == 0 && (evt & PN_READ) && len == 6 && memcmp(buf, "hello\n", 6) == 0)
+		state = 1;
+	else if (state == 1 && (evt & PN_RENAME))
+		state = 2;
+	else if (state == 2 && (evt & PN_READ) && len == 6 && memcmp(buf, "world\n", 6) == 0)
+		TAIL_RESULT = 0;
+	else
+		TAIL_RESULT = 1;
+}
+
+static void
+test_tail()
+{
+ 	struct watch *w;
+	int fd;
+
+	printf("tail tests\n");
+	test ((fd = open(".check/log", O_CREAT | O_WRONLY, 0644)));
+	test (write(fd, "old\n", 4));
+	test ((w = watch_tail(".check/log", tail_cb, NULL)) ? 0 : -1);
+	test (write(fd, "hello\n", 6));
+	(void) close(fd);
+	usleep(100000);
+	test (rename(".check/log", ".check/log.1"));
+	test ((fd = open(".check/log", O_CREAT | O_WRONLY, 0644)));
+	test (write(fd, "world\n", 6));
+	(void) close(fd);
+}
+
+void
+snapshot_cb(const char *path, int evt, void *arg)
+{
+	static int seen = 0;
+
+	if (evt & PN_READY)
+		__sync_fetch_and_add(&READY_COUNT, 1);
+	else if (strstr(path, "/snap/a") != NULL && (evt & PN_DELETE))
+		seen |= 1;
+	else if (strstr(path, "/snap/b") != NULL && (evt & PN_MODIFY))
+		seen |= 2;
+	else if (strstr(path, "/snap/c") != NULL && (evt & PN_CREATE))
+		seen |= 4;
+	else
+		SNAPSHOT_RESULT = 1;
+
+	if (seen == 7 && SNAPSHOT_RESULT < 0)
+		SNAPSHOT_RESULT = 0;
+}
+
+static void
+test_snapshot()
+{
+ 	struct watch *w;
+
+	printf("snapshot tests\n");
+	if (system("mkdir .check/snap && touch .check/snap/a .check/snap/b") != 0)
+		err(1, "system(3)");
+	test ((w = watch_mount(".check/snap", snapshot_cb, NULL)) ? 0 : -1);
+	test (pnotify_snapshot_save(w, ".check/snap.db"));
+	test (watch_cancel(w));
+
+	/* Make some changes while nothing is watching */
+	if (system("rm .check/snap/a && echo x > .check/snap/b && touch .check/snap/c") != 0)
+		err(1, "system(3)");
+
+	test ((w = watch_mount(".check/snap", snapshot_cb, NULL)) ? 0 : -1);
+	wait_ready(4);
+	test (pnotify_snapshot_load(w, ".check/snap.db"));
+}
+
+void
+poll_cb(const char *path, int evt, void *arg)
+{
+	if (evt & PN_READY)
+		__sync_fetch_and_add(&READY_COUNT, 1);
+	else if (strstr(path, "/poll/file") != NULL && (evt & PN_CREATE))
+		POLL_RESULT = 0;
+	else
+		POLL_RESULT = 1;
+}
+
+static void
+test_poll()
+{
+ 	struct watch *w;
+
+	printf("poll tests\n");
+	if (system("mkdir .check/poll") != 0)
+		err(1, "system(3)");
+	test ((w = watch_poll(".check/poll", 100, poll_cb, NULL)) ? 0 : -1);
+	wait_ready(5);
+	if (system("touch .check/poll/file") != 0)
+		err(1, "system(3)");
+}
+
+static void
+test_checksum()
+{
+	struct watch w;
+	const char *path = ".check/checksum";
+	pid_t pid;
+
+	printf("checksum tests\n");
+	memset(&w, 0, sizeof(w));
+	w.type = WATCH_MOUNT;
+	test (watch_checksum(&w, SIZE_MAX));
+
+	/* The first event is delivered, rewriting the same data is not */
+	if (system("echo a > .check/checksum") != 0)
+		err(1, "system(3)");
+	CHECKSUM_RESULT = (pn_crc32c(0, "123456789", 9) == 0xe3069283) ? 0 : 1;
+	if (!pn_checksum_filter(&w, path, PN_MODIFY))
+		CHECKSUM_RESULT = 1;
+	if (system("sleep 0.01 && echo a > .check/checksum && touch .check/checksum") != 0)
+		err(1, "system(3)");
+	if (pn_checksum_filter(&w, path, PN_MODIFY | PN_ATTRIB))
+		CHECKSUM_RESULT = 1;
+	if (system("echo b > .check/checksum") != 0)
+		err(1, "system(3)");
+	if (!pn_checksum_filter(&w, path, PN_MODIFY))
+		CHECKSUM_RESULT = 1;
+	test (watch_checksum(&w, 0));
+
+	/* A file larger than the limit is still checked once the bucket is full */
+	test (watch_checksum(&w, 4096));
+	if (system("head -c 8192 /dev/zero > .check/checksum") != 0)
+		err(1, "system(3)");
+	if (!pn_checksum_filter(&w, path, PN_MODIFY) ||
+			pn_checksum_filter(&w, path, PN_ATTRIB))
+		CHECKSUM_RESULT = 1;
+	test (watch_checksum(&w, 0));
+
+	/* A FIFO is never opened, which would wake a writer waiting for a reader */
+	test (watch_checksum(&w, SIZE_MAX));
+	test (mkfifo(".check/checksum.fifo", 0644));
+	if ((pid = fork()) < 0)
+		err(1, "fork(2)");
+	if (pid == 0)
+		_exit(open(".check/checksum.fifo", O_WRONLY) < 0);
+	usleep(100000);
+	if (!pn_checksum_filter(&w, ".check/checksum.fifo", PN_MODIFY))
+		CHECKSUM_RESULT = 1;
+	usleep(100000);
+	if (waitpid(pid, NULL, WNOHANG) != 0)
+		CHECKSUM_RESULT = 1;
+	(void) kill(pid, SIGKILL);
+	(void) waitpid(pid, NULL, 0);
+	test (watch_checksum(&w, 0));
+}
+
+void
+buffer_cb(struct watch *w, int evt, void *arg)
+{
+	char buf[5];
+
+	/* Answer "ping" with "pong", then check the reply arrived */
+	if (evt & PN_READ) {
+		if (pnotify_buffer_length(w) < 4)
+			return;
+		memset(buf, 0, sizeof(buf));
+		if (pnotify_buffer_read(w, buf, 4) != 4 || strcmp(buf, "ping") != 0 ||
+				pnotify_buffer_write(w, "pong", 4) != 0)
+			BUFFER_RESULT = 1;
+	}
+	if (evt & PN_WRITE) {
+		memset(buf, 0, sizeof(buf));
+		if (recv(BUFFER_SV[1], buf, 4, MSG_DONTWAIT) == 4 && strcmp(buf, "pong") == 0)
+			BUFFER_RESULT = 0;
+		else
+			BUFFER_RESULT = 1;
+	}
+}
+
+static void
+test_buffer()
+{
+ 	struct watch *w;
+
+	printf("buffer tests\n");
+	test (socketpair(AF_UNIX, SOCK_STREAM, 0, BUFFER_SV));
+	test ((w = watch_buffer(BUFFER_SV[0], buffer_cb, NULL)) ? 0 : -1);
+	if (write(BUFFER_SV[1], "ping", 4) != 4)
+		err(1, "write(2)");
+}
+
+/* The descriptors of a forward test; file is -1 unless it reads a file */
+struct forward_test {
+	int sv[2];
+	int file;
+};
+
+void
+forward_cb(struct watch *w, int evt, void *arg)
+{
+	static int passed = 0;
+	struct forward_test *ft = arg;
+	char buf[6];
+
+	/* A file is sent from its offset, which is left at the end */
+	memset(buf, 0, sizeof(buf));
+	if ((evt & PN_CLOSE) && recv(ft->sv[1], buf, 5, MSG_DONTWAIT) == 5 &&
+			strcmp(buf, "hello") == 0 &&
+			(ft->file < 0 || lseek(ft->file, 0, SEEK_CUR) == 10)) {
+		if (++passed == 2 && FORWARD_RESULT < 0)
+			FORWARD_RESULT = 0;
+	} else
+		FORWARD_RESULT = 1;
+}
+
+static void
+test_forward()
+{
+	static struct forward_test pipe_test, file_test;
+	int fildes[2];
+
+	printf("forward tests\n");
+	test (pipe(fildes));
+	test (socketpair(AF_UNIX, SOCK_STREAM, 0, pipe_test.sv));
+	pipe_test.file = -1;
+	test (watch_forward(fildes[0], pipe_test.sv[0], forward_cb, &pipe_test) ? 0 : -1);
+	if (write(fildes[1], "hello", 5) != 5)
+		err(1, "write(2)");
+	(void) close(fildes[1]);
+
+	if (system("printf 'skip hello' > .check/forward") != 0)
+		err(1, "system(3)");
+	test ((file_test.file = open(".check/forward", O_RDONLY)));
+	test (lseek(file_test.file, 5, SEEK_SET) == 5 ? 0 : -1);
+	test (socketpair(AF_UNIX, SOCK_STREAM, 0, file_test.sv));
+	test (watch_forward(file_test.file, file_test.sv[0], forward_cb, &file_test) ? 0 : -1);
+}
+
+void
+frame_cb(struct watch *w, const struct pn_record *rec, size_t count, void *arg)
+{
+	static const char *expect[] = { "one", "two", "three" };
+	static int seen = 0;
+	size_t i;
+
+	/* The last record has no delimiter, and is delivered at EOF */
+	for (i = 0; i < count; i++, seen++) {
+		if (seen > 2 || rec[i].len != strlen(expect[seen]) ||
+				memcmp(rec[i].data, expect[seen], rec[i].len) != 0) {
+			FRAME_RESULT = 1;
+			return;
+		}
+	}
+	if (seen == 3)
+		FRAME_RESULT = 0;
+}
+
+void
+frame_close_cb(struct watch *w, int evt, void *arg)
+{
+	if (evt & (PN_READ | PN_ERROR))
+		FRAME_RESULT = 1;
+}
+
+static void
+test_frame()
+{
+	struct watch *w;
+	int sv[2];
+
+	printf("frame tests\n");
+	test (socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	test ((w = watch_buffer(sv[0], frame_close_cb, NULL)) ? 0 : -1);
+	test (pnotify_buffer_framing(w, PN_FRAME_DELIM, '\n', frame_cb));
+	if (write(sv[1], "one\ntwo\nthree", 13) != 13)
+		err(1, "write(2)");
+	(void) close(sv[1]);
+}
+
+void
+listen_cb(struct watch *w, int fd, void *arg)
+{
+	static int count = 0;
+
+	(void) close(fd);
+	if (__sync_add_and_fetch(&count, 1) == 3)
+		LISTEN_RESULT = 0;
+}
+
+static void
+test_listen()
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int i, s, c, on = 1;
+
+	printf("listen tests\n");
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	test ((s = socket(AF_INET, SOCK_STREAM, 0)));
+	test (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)));
+	test (bind(s, (struct sockaddr *) &sin, sizeof(sin)));
+	test (listen(s, 16));
+	test (getsockname(s, (struct sockaddr *) &sin, &len));
+	test (watch_listen(s, 2, listen_cb, NULL) ? 0 : -1);
+
+	/* The connections are closed by the callback */
+	for (i = 0; i < 3; i++) {
+		if ((c = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+				connect(c, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+			err(1, "connect(2)");
+		(void) close(c);
+	}
+}
+
+void
+dgram_cb(struct watch *w, const struct pn_datagram *dgram, size_t count, void *arg)
+{
+	static const char *expect[] = { "a", "bb", "ccc" };
+	static size_t seen = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++, seen++) {
+		if (seen > 2 || dgram[i].len != strlen(expect[seen]) ||
+				memcmp(dgram[i].data, expect[seen], dgram[i].len) != 0) {
+			DGRAM_RESULT = 1;
+			return;
+		}
+	}
+	if (seen == 3)
+		DGRAM_RESULT = 0;
+}
+
+void
+dgram_unused_cb(struct watch *w, const struct pn_datagram *dgram, size_t count, void *arg)
+{
+	DGRAM_RESULT = 1;
+}
+
+static void
+test_dgram()
+{
+	struct pn_datagram out[3] = {
+		{ "a", 1, NULL, 0, 0 },
+		{ "bb", 2, NULL, 0, 0 },
+		{ "ccc", 3, NULL, 0, 0 },
+	};
+	struct watch *w;
+	int sv[2];
+
+	printf("datagram tests\n");
+	test (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv));
+	test (watch_datagram(sv[0], dgram_cb, NULL) ? 0 : -1);
+	test ((w = watch_datagram(sv[1], dgram_unused_cb, NULL)) ? 0 : -1);
+	test (pnotify_datagram_send(w, out, 3) == 3 ? 0 : -1);
+}
+
+void
+proc_cb(pid_t pid, int status, void *arg)
+{
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 7)
+		PROC_RESULT = 0;
+	else
+		PROC_RESULT = 1;
+}
+
+static void
+test_proc()
+{
+	pid_t pid;
+
+	printf("proc tests\n");
+	if ((pid = fork()) < 0)
+		err(1, "fork(2)");
+	if (pid == 0)
+		_exit(7);
+
+	/* The child may have exited already */
+	test (watch_proc(pid, proc_cb, NULL) ? 0 : -1);
+}
+
+void
+user_cb(struct watch *w, uint64_t value, void *arg)
+{
+	static uint64_t total = 0;
+
+	/* Some of the posts may be combined */
+	total += value;
+	if (total == 1 + 2 + 3)
+		USER_RESULT = 0;
+	else if (total > 1 + 2 + 3)
+		USER_RESULT = 1;
+}
+
+static void
+test_user()
+{
+	struct watch *w;
+
+	printf("user tests\n");
+	test ((w = watch_user(user_cb, NULL)) ? 0 : -1);
+	test (pnotify_post(w, 1));
+	test (pnotify_post(w, 2));
+	test (pnotify_post(w, 3));
+}
+
+static int SUBMIT_SUM = 0;
+
+void
+submit_fn(void *arg)
+{
+	(void) __sync_add_and_fetch(&SUBMIT_SUM, *(int *) arg);
+}
+
+/* The state of the tasks pinned to one worker by test_submit() */
+static int PINNED_NEXT = 0, PINNED_RUNNING = 0, PINNED_BAD = 0;
+
+/* Check that pinned tasks run one at a time, in order */
+void
+pinned_fn(void *arg)
+{
+	if (__sync_add_and_fetch(&PINNED_RUNNING, 1) != 1 ||
+			*(int *) arg != PINNED_NEXT)
+		PINNED_BAD = 1;
+	PINNED_NEXT = *(int *) arg + 1;
+	usleep(1000);
+	(void) __sync_sub_and_fetch(&PINNED_RUNNING, 1);
+}
+
+void
+submit_done_cb(struct watch *w, uint64_t value, void *arg)
+{
+	static uint64_t done = 0;
+
+	/* Every task has finished once all 100 have posted */
+	done += value;
+	if (done == 100)
+		SUBMIT_RESULT = (SUBMIT_SUM == 100 * 101 / 2) ? 0 : 1;
+}
+
+static void
+test_submit()
+{
+	static int num[100];
+	static void *args[100];
+	struct watch *w;
+	int i;
+
+	printf("submit tests\n");
+	for (i = 0; i < 100; i++) {
+		num[i] = i + 1;
+		args[i] = &num[i];
+	}
+	test ((w = watch_user(submit_done_cb, NULL)) ? 0 : -1);
+	test (pnotify_submit_batch(submit_fn, args, 99, -1, w));
+	test (pnotify_submit(submit_fn, args[99], 0, w));
+}
+
+/* Run by test_pinned() in a new process with several workers */
+static int
+pinned_main()
+{
+	static int seq[100];
+	int i;
+
+	pnotify_init();
+
+	/* Idle workers must not take tasks pinned to a busy one */
+	for (i = 0; i < 100; i++) {
+		seq[i] = i;
+		if (pnotify_submit(pinned_fn, &seq[i], 1, NULL) < 0)
+			return 1;
+		usleep(200);
+	}
+	for (i = 0; i < 10000 && __atomic_load_n(&PINNED_NEXT, __ATOMIC_SEQ_CST) < 100; i++)
+		usleep(1000);
+
+	return (PINNED_NEXT == 100 && !PINNED_BAD) ? 0 : 1;
+}
+
+/* Pinned tasks, with more workers than there may be CPUs */
+static void
+test_pinned(const char *prog)
+{
+	char cmd[1024];
+
+	printf("pinned tests\n");
+	snprintf(cmd, sizeof(cmd), "PNOTIFY_WORKERS=4 %s pinned", prog);
+	PINNED_RESULT = (system(cmd) == 0) ? 0 : 1;
+}
+
+void
+priority_cb(struct watch *w, uint64_t value, void *arg)
+{
+	PRIORITY_RESULT = (value == 42) ? 0 : 1;
+}
+
+static void
+test_priority()
+{
+	struct watch *w;
+
+	printf("priority tests\n");
+	test ((w = watch_user(priority_cb, NULL)) ? 0 : -1);
+	test ((watch_priority(w, 2) < 0 && errno == EINVAL) ? 0 : -1);
+	test (watch_priority(w, PN_PRIO_LOW));
+	test (pnotify_post(w, 42));
+}
+
+static void
+test_queue()
+{
+	printf("queue tests\n");
+	test ((pnotify_queue_limit(4, 4) < 0 && errno == EINVAL) ? 0 : -1);
+
+	/* The remaining tests run with a very short queue */
+	test (pnotify_queue_limit(4, 2));
+}
+
+/* Write a trace record from a short-lived thread */
+void *
+trace_thread(void *arg)
+{
+	PN_TRACE(PN_TRACE_CANCEL, NULL, (void (*)(void *)) trace_thread,
+			(int) (uintptr_t) arg);
+	return NULL;
+}
+
+/* Run after the other tests have finished */
+static void
+test_trace()
+{
+	struct pn_trace_header hdr;
+	struct pn_trace_record rec;
+	pthread_t tid;
+	uint32_t thread_tid[2] = { 0, 0 };
+	uintptr_t i;
+	int fd, ready = 0, cb = 0;
+
+	printf("trace tests\n");
+
+	/* The second thread takes over the ring of the first, which keeps its record */
+	for (i = 0; i < 2; i++) {
+		if (pthread_create(&tid, NULL, trace_thread, (void *) i) != 0 ||
+				pthread_join(tid, NULL) != 0)
+			errx(1, "pthread_create(3)");
+	}
+	pnotify_trace_stop();
+	test (pnotify_trace_dump(".check/trace"));
+	if ((fd = open(".check/trace", O_RDONLY)) < 0)
+		err(1, "open(2)");
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			memcmp(hdr.magic, PN_TRACE_MAGIC, sizeof(hdr.magic)) != 0)
+		errx(1, "bad trace header");
+	while (read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+		if (rec.type == PN_TRACE_READY)
+			ready++;
+		if (rec.type == PN_TRACE_CB_START)
+			cb++;
+		if (rec.id == (uintptr_t) trace_thread && rec.mask < 2)
+			thread_tid[rec.mask] = rec.tid;
+	}
+	(void) close(fd);
+
+	TRACE_RESULT = (ready > 0 && cb > 0 && thread_tid[0] != 0 &&
+			thread_tid[1] != 0 && thread_tid[0] != thread_tid[1] &&
+			system("./pntrace .check/trace > .check/trace.json") == 0) ? 0 : 1;
+}
+
+/* Run after the other tests have finished */
+static void
+test_stats()
+{
+	static struct pnotify_stats st;
+	uint64_t p50, p99;
+	int i, waits = 0;
+
+	printf("stats tests\n");
+	test (pnotify_stats(&st));
+	p50 = pnotify_stats_percentile(&st.latency, 50);
+	p99 = pnotify_stats_percentile(&st.latency, 99);
+	printf("latency: p50=%llu p99=%llu max=%llu ns\n",
+			(unsigned long long) p50, (unsigned long long) p99,
+			(unsigned long long) st.latency.max);
+	printf("spin: %llu spins, %llu found work, %llu ns\n",
+			(unsigned long long) st.spins,
+			(unsigned long long) st.spin_hits,
+			(unsigned long long) st.spin_ns);
+	for (i = 0; i < PN_MUTEX_COUNT; i++) {
+		printf("mutex %d: %llu waits, %llu ns\n", i,
+				(unsigned long long) st.mutex_waits[i],
+				(unsigned long long) st.mutex_wait_ns[i]);
+		if (st.mutex_waits[i] == 0 && st.mutex_wait_ns[i] != 0)
+			waits = -1;
+	}
+	STATS_RESULT = (st.enqueued[WATCH_USER] > 0 &&
+			st.dispatched[WATCH_TIMER] > 0 &&
+			st.tasks_submitted >= 100 && st.tasks_run >= 100 &&
+			st.latency.count >= st.tasks_run &&
+			st.callback.count == st.latency.count &&
+			st.poll_batch.count > 0 &&
+			p50 <= p99 && p99 <= st.latency.max && waits == 0 &&
+			st.spins > 0 && st.spin_hits <= st.spins) ? 0 : 1;
+}
+
+/* The events delivered by the simulated backend, in sim_main() */
+static pthread_mutex_t SIM_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t SIM_COND = PTHREAD_COND_INITIALIZER;
+static uint64_t SIM_EVENTS = 0;
+
+static void
+sim_count(uint64_t n)
+{
+	pthread_mutex_lock(&SIM_LOCK);
+	SIM_EVENTS += n;
+	pthread_cond_broadcast(&SIM_COND);
+	pthread_mutex_unlock(&SIM_LOCK);
+}
+
+void
+sim_fd_cb(int fd, int mask, void *arg)
+{
+	if (mask == PN_READ)
+		sim_count(1);
+}
+
+/* The number of times that sim_user_cb() has run */
+static int SIM_USER_CALLS = 0;
+
+void
+sim_user_cb(struct watch *w, uint64_t value, void *arg)
+{
+	(void) __sync_add_and_fetch(&SIM_USER_CALLS, 1);
+	sim_count(value);
+}
+
+/* Wait for a number of events, without depending on how long they take */
+static int
+sim_wait(uint64_t target)
+{
+	struct timespec ts;
+	int rv = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 30;
+	pthread_mutex_lock(&SIM_LOCK);
+	while (SIM_EVENTS < target && rv == 0)
+		rv = pthread_cond_timedwait(&SIM_COND, &SIM_LOCK, &ts);
+	pthread_mutex_unlock(&SIM_LOCK);
+
+	return (SIM_EVENTS >= target) ? 0 : -1;
+}
+
+/* Run by test_sim() in a new process with PNOTIFY_BACKEND=sim */
+static int
+sim_main()
+{
+	struct watch *w, *u;
+	int fd[2], i, rv = 0;
+
+	pnotify_init();
+	if (pipe(fd) < 0)
+		err(1, "pipe(2)");
+	if ((w = watch_fd(fd[0], sim_fd_cb, NULL)) == NULL ||
+			(u = watch_user(sim_user_cb, NULL)) == NULL)
+		errx(1, "unable to add a watch");
+
+	/* Injected events; nothing is ever written to the pipe */
+	for (i = 0; i < 1000; i++)
+		rv |= pnotify_sim_inject(w, PN_READ);
+	rv |= sim_wait(1000);
+
+	/* Posts do not go through an eventfd */
+	rv |= pnotify_post(u, 5);
+	rv |= sim_wait(1005);
+
+	/* Random events, which only go to the fd watch */
+	rv |= pnotify_sim_rate(20000, 1);
+	rv |= sim_wait(1505);
+	rv |= pnotify_sim_rate(0, 0);
+	if (SIM_USER_CALLS != 1)
+		rv = -1;
+
+	return (rv == 0) ? 0 : 1;
+}
+
+/* Run after the other tests, which have been recorded */
+static void
+test_replay()
+{
+	char buf[1024];
+	FILE *f;
+
+	printf("replay tests\n");
+	test (pnotify_record_stop());
+	test ((pnotify_record_stop() < 0 && errno == EINVAL) ? 0 : -1);
+	if (system("./pnreplay .check/record > .check/replay.json") != 0 ||
+			system("./pnreplay -x 100 .check/record >> .check/replay.json") != 0 ||
+			(f = fopen(".check/replay.json", "r")) == NULL) {
+		REPLAY_RESULT = 1;
+		return;
+	}
+	REPLAY_RESULT = 0;
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		fputs(buf, stdout);
+		if (strstr(buf, "\"events\":0,") != NULL)
+			REPLAY_RESULT = 1;
+	}
+	(void) fclose(f);
+}
+
+static void
+test_sim(const char *prog)
+{
+	struct watch *w;
+	char cmd[1024];
+
+	printf("sim tests\n");
+	test ((w = watch_user(sim_user_cb, NULL)) ? 0 : -1);
+	test ((pnotify_sim_inject(w, PN_READ) < 0 && errno == ENOTSUP) ? 0 : -1);
+	snprintf(cmd, sizeof(cmd), "PNOTIFY_BACKEND=sim %s sim", prog);
+	SIM_RESULT = (system(cmd) == 0) ? 0 : 1;
+}
+
+
+/* The callbacks run for cancelled watches, in cancel_main() */
+static int CANCEL_CALLS = 0;
+
+/* Pipes between cancel_main() and the callbacks or tasks it waits for */
+static int CANCEL_RUNNING[2], CANCEL_DONE[2];
+
+void
+cancel_cb(struct watch *w, int evt, void *arg)
+{
+	(void) __sync_add_and_fetch(&CANCEL_CALLS, 1);
+}
+
+void
+cancel_running_cb(struct watch *w, int evt, void *arg)
+{
+	char c = 0;
+
+	/* Wait while the watch is cancelled, then use it */
+	if (write(CANCEL_RUNNING[1], &c, 1) != 1 ||
+			read(CANCEL_DONE[0], &c, 1) != 1)
+		err(1, "pipe");
+	c = (pnotify_buffer_read(w, &c, 1) == 0 &&
+			pnotify_buffer_write(w, "x", 1) < 0 && errno == EINVAL &&
+			pnotify_buffer_framing(w, PN_FRAME_DELIM, '\n', frame_cb) < 0 &&
+			errno == EINVAL);
+	if (write(CANCEL_RUNNING[1], &c, 1) != 1)
+		err(1, "write(2)");
+}
+
+void
+cancel_user_cb(struct watch *w, uint64_t value, void *arg)
+{
+	(void) __sync_add_and_fetch(&CANCEL_CALLS, 1);
+}
+
+void
+cancel_proc_cb(pid_t pid, int status, void *arg)
+{
+	(void) __sync_add_and_fetch(&CANCEL_CALLS, 1);
+}
+
+void
+cancel_task(void *arg)
+{
+}
+
+void
+cancel_listen_cb(struct watch *w, int fd, void *arg)
+{
+	(void) close(fd);
+	(void) __sync_add_and_fetch(&CANCEL_CALLS, 1);
+}
+
+/* Keep the only worker busy until cancel_unblock() */
+void
+cancel_block(void *arg)
+{
+	char c = 0;
+
+	if (write(CANCEL_RUNNING[1], &c, 1) != 1 ||
+			read(CANCEL_DONE[0], &c, 1) != 1)
+		err(1, "pipe");
+}
+
+static int
+cancel_block_start(void)
+{
+	char c;
+
+	if (pnotify_submit(cancel_block, NULL, -1, NULL) < 0)
+		return -1;
+	if (read(CANCEL_RUNNING[0], &c, 1) != 1)
+		err(1, "read(2)");
+
+	return 0;
+}
+
+static void
+cancel_unblock(void)
+{
+	char c = 0;
+
+	if (write(CANCEL_DONE[1], &c, 1) != 1)
+		err(1, "write(2)");
+}
+
+/* Wait until a number of events have been queued for a type of watch */
+static int
+cancel_queued(enum pn_watch_type type, uint64_t count)
+{
+	struct pnotify_stats st;
+	int i;
+
+	for (i = 0; i < 5000; i++) {
+		if (pnotify_stats(&st) < 0)
+			return -1;
+		if (st.enqueued[type] >= count)
+			return 0;
+		usleep(1000);
+	}
+
+	return -1;
+}
+
+/* Run by test_cancel() in a new process with one worker thread */
+static int
+cancel_main()
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	struct watch *w;
+	int sv[2], i, s, c, on = 1, rv = 0;
+	char ch = 0;
+	pid_t pid;
+
+	pnotify_init();
+	if (pipe(CANCEL_RUNNING) < 0 || pipe(CANCEL_DONE) < 0)
+		err(1, "pipe(2)");
+
+	/* An event that is still queued when the watch is cancelled */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		err(1, "socketpair(2)");
+	if ((w = watch_buffer(sv[0], cancel_cb, NULL)) == NULL)
+		errx(1, "watch_buffer() failed");
+	rv |= cancel_block_start();
+	if (write(sv[1], "x", 1) != 1)
+		err(1, "write(2)");
+	rv |= cancel_queued(WATCH_BUFFER, 1);
+	rv |= watch_cancel(w);
+	cancel_unblock();
+
+	/* Connections waiting on any of the sockets of a WATCH_LISTEN watch */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+			setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+			bind(s, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+			listen(s, 16) < 0 ||
+			getsockname(s, (struct sockaddr *) &sin, &len) < 0)
+		err(1, "unable to create a listening socket");
+	if ((w = watch_listen(s, 4, cancel_listen_cb, NULL)) == NULL)
+		errx(1, "watch_listen() failed");
+	rv |= cancel_block_start();
+	for (i = 0; i < 8; i++) {
+		if ((c = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+				connect(c, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+			err(1, "connect(2)");
+		(void) close(c);
+	}
+	rv |= cancel_queued(WATCH_LISTEN, 1);
+	rv |= watch_cancel(w);
+	cancel_unblock();
+
+	/* A wakeup, and the done post of a task, for a cancelled WATCH_USER watch */
+	if ((w = watch_user(cancel_user_cb, NULL)) == NULL)
+		errx(1, "watch_user() failed");
+	rv |= cancel_block_start();
+	rv |= pnotify_submit(cancel_task, NULL, -1, w);
+	rv |= pnotify_post(w, 1);
+	rv |= cancel_queued(WATCH_USER, 1);
+	rv |= watch_cancel(w);
+	if (pnotify_post(w, 1) == 0 || errno != EINVAL)
+		rv = -1;
+	cancel_unblock();
+
+	/* The exit of a child, for a cancelled WATCH_PROC watch */
+	rv |= cancel_block_start();
+	if ((pid = fork()) < 0)
+		err(1, "fork(2)");
+	if (pid == 0)
+		_exit(0);
+	if ((w = watch_proc(pid, cancel_proc_cb, NULL)) == NULL)
+		errx(1, "watch_proc() failed");
+	rv |= cancel_queued(WATCH_PROC, 1);
+	rv |= watch_cancel(w);
+	cancel_unblock();
+	(void) waitpid(pid, NULL, 0);
+
+	/* A callback that is running when the watch is cancelled */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		err(1, "socketpair(2)");
+	if ((w = watch_buffer(sv[0], cancel_running_cb, NULL)) == NULL)
+		errx(1, "watch_buffer() failed");
+	if (write(sv[1], "x", 1) != 1 || read(CANCEL_RUNNING[0], &ch, 1) != 1)
+		err(1, "pipe");
+	rv |= watch_cancel(w);
+	if (write(CANCEL_DONE[1], &ch, 1) != 1 || read(CANCEL_RUNNING[0], &ch, 1) != 1)
+		err(1, "pipe");
+	if (!ch)
+		rv = -1;
+
+	/* Give the queued event time to be dropped */
+	usleep(500000);
+
+	return (rv == 0 && CANCEL_CALLS == 0) ? 0 : 1;
+}
+
+/* Cancel watches while their events are queued or being handled */
+static void
+test_cancel(const char *prog)
+{
+	char cmd[1024];
+
+	printf("cancel tests\n");
+	snprintf(cmd, sizeof(cmd), "PNOTIFY_WORKERS=1 %s cancel", prog);
+	CANCEL_RESULT = (system(cmd) == 0) ? 0 : 1;
+}
+
+
+/* The next file expected by pollers_cb(), and whether one came out of order */
+static int POLLERS_NEXT = 0, POLLERS_BAD = 0;
+
+void
+pollers_cb(const char *path, int evt, void *arg)
+{
+	const char *name;
+
+	if (evt & PN_READY)
+		__sync_fetch_and_add(&READY_COUNT, 1);
+	if (!(evt & PN_CREATE) || (name = strstr(path, "/pollers/f")) == NULL)
+		return;
+	if (atoi(name + strlen("/pollers/f")) != POLLERS_NEXT)
+		POLLERS_BAD = 1;
+	__atomic_add_fetch(&POLLERS_NEXT, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Run by test_pollers() in a new process with several pollers and one worker */
+static int
+pollers_main()
+{
+	char path[64];
+	int i, fd;
+
+	pnotify_init();
+	if (mkdir(".check/pollers", 0755) < 0)
+		err(1, "mkdir(2)");
+	if (watch_mount(".check/pollers", pollers_cb, NULL) == NULL)
+		errx(1, "watch_mount() failed");
+	wait_ready(1);
+
+	/* The files must be reported in the order they were created */
+	for (i = 0; i < 200; i++) {
+		snprintf(path, sizeof(path), ".check/pollers/f%d", i);
+		if ((fd = open(path, O_CREAT | O_WRONLY, 0644)) < 0)
+			err(1, "open(2)");
+		(void) close(fd);
+		if (i % 10 == 0)
+			usleep(100);
+	}
+	for (i = 0; i < 5000 && __atomic_load_n(&POLLERS_NEXT, __ATOMIC_SEQ_CST) < 200; i++)
+		usleep(1000);
+
+	return (POLLERS_NEXT == 200 && !POLLERS_BAD) ? 0 : 1;
+}
+
+/* A filesystem watch whose descriptor is read by several pollers */
+static void
+test_pollers(const char *prog)
+{
+	char cmd[1024];
+
+	printf("pollers tests\n");
+	snprintf(cmd, sizeof(cmd), "PNOTIFY_POLLERS=4 PNOTIFY_WORKERS=1 %s pollers", prog);
+	POLLERS_RESULT = (system(cmd) == 0) ? 0 : 1;
+}
+
 
 int
 main(int argc, char **argv)
 {
+	/* The second half of test_sim() */
+	if (argc == 2 && strcmp(argv[1], "sim") == 0)
+		exit(sim_main());
+
+	/* The second half of test_pinned() */
+	if (argc == 2 && strcmp(argv[1], "pinned") == 0)
+		exit(pinned_main());
+
+	/* The second half of test_cancel() */
+	if (argc == 2 && strcmp(argv[1], "cancel") == 0)
+		exit(cancel_main());
+
+	/* The second half of test_pollers() */
+	if (argc == 2 && strcmp(argv[1], "pollers") == 0)
+		exit(pollers_main());
+
 	/* Create a test directory */
 	(void) system("rm -rf .check");
 	if (system("mkdir .check") < 0)
@@ -82,15 +1190,72 @@ main(int argc, char **argv)
 
 	pnotify_init();
 
+	test_queue();
+	test (pnotify_trace_start(4096));
+	test (pnotify_record_start(".check/record"));
+	test ((pnotify_spin_limit(2000000000) < 0 && errno == EINVAL) ? 0 : -1);
+	test (pnotify_spin_limit(20000));
+	test ((pnotify_busy_poll(0) == 0 || errno == ENOTSUP) ? 0 : -1);
 	test_fd();
 	test_signals();
 	test_timer();
+	test_mount();
+	test_debounce();
+	test_tail();
+	test_snapshot();
+	test_poll();
+	test_checksum();
+	test_buffer();
+	test_forward();
+	test_frame();
+	test_listen();
+	test_dgram();
+	test_proc();
+	test_user();
+	test_submit();
+	test_pinned(argv[0]);
+	test_priority();
+	test_sim(argv[0]);
+	test_cancel(argv[0]);
+	test_pollers(argv[0]);
 	sleep(5);	/*XXX-FIXME*/
+	test_stats();
+	test_trace();
+	test_replay();
 	printf ("fd: %d\n", FD_RESULT);
 	printf ("timer: %d\n", TIMER_RESULT);
 	printf ("signal: %d\n", SIGNAL_RESULT);
+	printf ("mount: %d\n", MOUNT_RESULT);
+	printf ("debounce: %d\n", DEBOUNCE_RESULT);
+	printf ("tail: %d\n", TAIL_RESULT);
+	printf ("snapshot: %d\n", SNAPSHOT_RESULT);
+	printf ("poll: %d\n", POLL_RESULT);
+	printf ("checksum: %d\n", CHECKSUM_RESULT);
+	printf ("buffer: %d\n", BUFFER_RESULT);
+	printf ("forward: %d\n", FORWARD_RESULT);
+	printf ("frame: %d\n", FRAME_RESULT);
+	printf ("listen: %d\n", LISTEN_RESULT);
+	printf ("datagram: %d\n", DGRAM_RESULT);
+	printf ("proc: %d\n", PROC_RESULT);
+	printf ("user: %d\n", USER_RESULT);
+	printf ("submit: %d\n", SUBMIT_RESULT);
+	printf ("pinned: %d\n", PINNED_RESULT);
+	printf ("priority: %d\n", PRIORITY_RESULT);
+	printf ("stats: %d\n", STATS_RESULT);
+	printf ("trace: %d\n", TRACE_RESULT);
+	printf ("sim: %d\n", SIM_RESULT);
+	printf ("replay: %d\n", REPLAY_RESULT);
+	printf ("cancel: %d\n", CANCEL_RESULT);
+	printf ("pollers: %d\n", POLLERS_RESULT);
 
-	if ( FD_RESULT || TIMER_RESULT || SIGNAL_RESULT ) 
+	if ( FD_RESULT || TIMER_RESULT || SIGNAL_RESULT || MOUNT_RESULT ||
+			DEBOUNCE_RESULT || TAIL_RESULT || SNAPSHOT_RESULT || POLL_RESULT ||
+			CHECKSUM_RESULT || BUFFER_RESULT ||
+			FORWARD_RESULT || FRAME_RESULT || LISTEN_RESULT ||
+			DGRAM_RESULT || PROC_RESULT || USER_RESULT ||
+			SUBMIT_RESULT || PINNED_RESULT || PRIORITY_RESULT || STATS_RESULT ||
+			TRACE_RESULT || SIM_RESULT || REPLAY_RESULT ||
+			CANCEL_RESULT || POLLERS_RESULT ) 
 		errx(1, "one or more test(s) failed");
 	exit(0);
 }
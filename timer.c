@@ -19,23 +19,230 @@
 /** @file
  *
  * Timer functions to support the PN_TIMEOUT event class
+ *
+ * All timers are kept in a binary min-heap ordered by expiration time,
+ * and the timer thread sleeps until the earliest one expires. Besides
+ * the WATCH_TIMER watches, the heap holds internal timers which call a
+ * function on the timer thread instead of generating an event.
  */
 
 #include <sys/time.h>
+#include <time.h>
 
 #include "pnotify.h"
 #include "pnotify-internal.h"
 
+/** The index of a timer that is not in the heap */
+#define TIMER_NONE	((size_t) -1)
 
-/** A list of all active timers */
-LIST_HEAD(, timer) TIMER;
+/** All active timers, stored as a binary min-heap */
+static struct timer **TIMER;
 
-/** The smallest interval (in seconds) of all timers in the TIMER list. */
-size_t TIMER_INTERVAL = 1;
+/** The number of timers in the heap, and the number of allocated slots */
+static size_t TIMER_COUNT, TIMER_SIZE;
 
 /** A mutex to protect all global TIMER variables */
 pthread_mutex_t TIMER_MUTEX = PTHREAD_MUTEX_INITIALIZER;
 
+/** Signalled when the earliest expiration time changes */
+static pthread_cond_t TIMER_COND;
+
+
+uint64_t
+pn_time_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "clock_gettime(2)");
+
+	return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+uint64_t
+pn_time_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "clock_gettime(2)");
+
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+
+/** Get the number of timers that have not expired */
+size_t
+pn_timer_count(void)
+{
+	size_t count;
+
+	MUTEX_LOCK(TIMER_MUTEX);
+	count = TIMER_COUNT;
+	MUTEX_UNLOCK(TIMER_MUTEX);
+
+	return count;
+}
+
+
+void
+pn_timer_init(void)
+{
+	pthread_condattr_t attr;
+
+	if (pthread_condattr_init(&attr) != 0 ||
+			pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+			pthread_cond_init(&TIMER_COND, &attr) != 0)
+		errx(1, "unable to initialize the timer condition variable");
+	(void) pthread_condattr_destroy(&attr);
+}
+
+
+static void
+heap_swap(size_t a, size_t b)
+{
+	struct timer *tmp = TIMER[a];
+
+	TIMER[a] = TIMER[b];
+	TIMER[b] = tmp;
+	TIMER[a]->index = a;
+	TIMER[b]->index = b;
+}
+
+
+static void
+heap_sift_up(size_t i)
+{
+	while (i > 0 && TIMER[(i - 1) / 2]->expires > TIMER[i]->expires) {
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+
+static void
+heap_sift_down(size_t i)
+{
+	size_t child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= TIMER_COUNT)
+			break;
+		if (child + 1 < TIMER_COUNT &&
+				TIMER[child + 1]->expires < TIMER[child]->expires)
+			child++;
+		if (TIMER[i]->expires <= TIMER[child]->expires)
+			break;
+		heap_swap(i, child);
+		i = child;
+	}
+}
+
+
+/* Remove a timer from the heap. The caller must hold TIMER_MUTEX. */
+static void
+heap_remove(struct timer *timer)
+{
+	size_t i = timer->index;
+
+	TIMER_COUNT--;
+	if (i != TIMER_COUNT) {
+		TIMER[i] = TIMER[TIMER_COUNT];
+		TIMER[i]->index = i;
+		heap_sift_up(i);
+		heap_sift_down(TIMER[i]->index);
+	}
+	timer->index = TIMER_NONE;
+}
+
+
+/* Add a timer to the heap. The caller must hold TIMER_MUTEX. */
+static int
+heap_insert(struct timer *timer)
+{
+	struct timer **heap;
+	size_t size;
+
+	if (TIMER_COUNT == TIMER_SIZE) {
+		size = (TIMER_SIZE == 0) ? 64 : TIMER_SIZE * 2;
+		if ((heap = realloc(TIMER, size * sizeof(*heap))) == NULL) {
+			warn("realloc(3)");
+			return -1;
+		}
+		TIMER = heap;
+		TIMER_SIZE = size;
+	}
+
+	timer->index = TIMER_COUNT;
+	TIMER[TIMER_COUNT++] = timer;
+	heap_sift_up(timer->index);
+
+	/* Wake up the timer thread if this is now the earliest timer */
+	if (timer->index == 0)
+		(void) pthread_cond_signal(&TIMER_COND);
+
+	return 0;
+}
+
+
+/**
+ * Start an internal timer.
+ *
+ * When the timer expires, @a func is called from the timer thread.
+ * The timer is freed after @a func returns.
+ *
+ * @param msec the number of milliseconds until the timer expires
+ * @return a timer handle, or NULL if an error occurred
+ */
+struct timer *
+pn_timer_start(unsigned int msec, void (*func)(void *), void *arg)
+{
+	struct timer *timer;
+
+	if ((timer = calloc(1, sizeof(*timer))) == NULL) {
+		warn("calloc(3)");
+		return NULL;
+	}
+	timer->expires = pn_time_ms() + msec;
+	timer->func = func;
+	timer->arg = arg;
+
+	MUTEX_LOCK(TIMER_MUTEX);
+	if (heap_insert(timer) != 0) {
+		MUTEX_UNLOCK(TIMER_MUTEX);
+		free(timer);
+		return NULL;
+	}
+	MUTEX_UNLOCK(TIMER_MUTEX);
+
+	return timer;
+}
+
+
+/**
+ * Stop an internal timer.
+ *
+ * @return 0 if the timer was stopped, or -1 if it has already expired
+ *   and its function has been (or is about to be) called.
+ */
+int
+pn_timer_stop(struct timer *timer)
+{
+	MUTEX_LOCK(TIMER_MUTEX);
+	if (timer->index == TIMER_NONE) {
+		MUTEX_UNLOCK(TIMER_MUTEX);
+		return -1;
+	}
+	heap_remove(timer);
+	MUTEX_UNLOCK(TIMER_MUTEX);
+
+	free(timer);
+	return 0;
+}
+
+
 int
 pn_add_timer(struct watch *watch)
 {
@@ -46,19 +253,20 @@ pn_add_timer(struct watch *watch)
 		warn("malloc(3)");
 		return -1;
 	}
-	timer->expires = time(NULL) + watch->ident;
+	timer->expires = pn_time_ms() + (uint64_t) watch->ident * 1000;
 	timer->watch = watch;
 
-	pthread_mutex_lock(&TIMER_MUTEX);
-
-	/* Enable the periodic timer if this is the first entry */
-	//if (LIST_EMPTY(&TIMER))
-	//	timer_enable();
+	MUTEX_LOCK(TIMER_MUTEX);
 
-	/* Add the timer to the list */
-	LIST_INSERT_HEAD(&TIMER, timer, entries);
+	/* Add the timer to the heap */
+	if (heap_insert(timer) != 0) {
+		MUTEX_UNLOCK(TIMER_MUTEX);
+		free(timer);
+		return -1;
+	}
+	watch->priv = timer;
 
-	pthread_mutex_unlock(&TIMER_MUTEX);
+	MUTEX_UNLOCK(TIMER_MUTEX);
 
 	return 0;
 }
@@ -67,23 +275,18 @@ pn_add_timer(struct watch *watch)
 int
 pn_rm_timer(struct watch *watch)
 {
-	struct timer *timer, *tmp;
-
-	pthread_mutex_lock(&TIMER_MUTEX);
+	struct timer *timer;
 
-	/* Disable the periodic timer if there are no more timers */
-//	if (LIST_EMPTY(&TIMER)) 
-//		timer_disable();
+	MUTEX_LOCK(TIMER_MUTEX);
 
-	/* Remove the timer struct */
-	LIST_FOREACH_SAFE(timer, &TIMER, entries, tmp) {
-		if (timer->watch == watch) {
-			LIST_REMOVE(timer, entries);
-			break;
-		}
+	/* The timer thread clears the pointer when the timer expires */
+	if ((timer = watch->priv) != NULL) {
+		heap_remove(timer);
+		watch->priv = NULL;
+		free(timer);
 	}
 
-	pthread_mutex_unlock(&TIMER_MUTEX);
+	MUTEX_UNLOCK(TIMER_MUTEX);
 
 	return 0;
 }
@@ -92,44 +295,51 @@ pn_rm_timer(struct watch *watch)
 void *
 timer_loop(void *unused)
 {
-	struct timer *timer, *tmp;
-	time_t now;
+	struct timer *timer;
+	struct timespec ts;
+
+	MUTEX_LOCK(TIMER_MUTEX);
 
 	/* Loop forever marking time */
 	for (;;) {
 
-		/* Wait for SIGALRM */
-		sleep(TIMER_INTERVAL);
-		now = time(NULL);
-		dprintf("checking timer..\n");
-		
-		/* Check the time remaining on all timers */
-		pthread_mutex_lock(&TIMER_MUTEX);
-		LIST_FOREACH_SAFE(timer, &TIMER, entries, tmp) {
-
-			/* If the timer has expired, generate an event ... */
-			if (now > timer->expires) {
-
-				/* Add the event to an event queue */
-				pn_event_add(timer->watch, PN_TIMEOUT);
-
-				/* Remove the timer */
-
-				/* Delete the watch*/
-				watch_cancel(timer->watch);
-
-				/* Delete the timer entry */
-				LIST_REMOVE(timer, entries);
-				free(timer);
-
-			}
+		/* Wait for the earliest timer to expire */
+		if (TIMER_COUNT == 0) {
+			(void) pthread_cond_wait(&TIMER_COND, &TIMER_MUTEX);
+			continue;
 		}
-
-		/* Disable the periodic timer if there are no more timers */
-		//if (LIST_EMPTY(&TIMER)) 
-		//	timer_disable();
-
-		pthread_mutex_unlock(&TIMER_MUTEX);
+		timer = TIMER[0];
+		if (timer->expires > pn_time_ms()) {
+			ts.tv_sec = timer->expires / 1000;
+			ts.tv_nsec = (timer->expires % 1000) * 1000000;
+			(void) pthread_cond_timedwait(&TIMER_COND, &TIMER_MUTEX, &ts);
+			continue;
+		}
+		dprintf("timer expired..\n");
+
+		/* Remove the timer */
+		heap_remove(timer);
+		if (timer->watch != NULL)
+			timer->watch->priv = NULL;
+
+		/*
+		 * Fire the timer without holding TIMER_MUTEX, because
+		 * watch_cancel() and the internal callbacks acquire it.
+		 */
+		MUTEX_UNLOCK(TIMER_MUTEX);
+		PN_STAT_ADD(PN_STATS()->timers_fired, 1);
+		PN_TRACE(PN_TRACE_TIMER, timer->watch, timer->func, PN_TIMEOUT);
+		if (timer->func != NULL) {
+			timer->func(timer->arg);
+		} else {
+			/* Add the event to an event queue */
+			pn_event_add(timer->watch, PN_TIMEOUT);
+
+			/* Delete the watch*/
+			watch_cancel(timer->watch);
+		}
+		free(timer);
+		MUTEX_LOCK(TIMER_MUTEX);
 	}
 
 	return NULL;
@@ -0,0 +1,280 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  The event tracer.
+ *
+ *  Every thread that writes a trace record owns a ring buffer, so writing
+ *  takes no lock: the record is filled in, and then the head is advanced
+ *  with a release store. pnotify_trace_dump() copies a ring and then reads
+ *  the head again, to find out which of the copied records may have been
+ *  overwritten in the meantime.
+ *
+ *  When a thread exits, its ring is kept so that its records can still be
+ *  dumped, and the next new thread takes it over instead of allocating
+ *  another. There are never more rings than the most threads that have
+ *  been tracing at the same time.
+ */
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The smallest ring, in records */
+#define TRACE_MIN	64
+
+/** The ring buffer of a thread */
+struct pn_trace_ring {
+
+	/** The number of records ever written; the next one goes at head & mask */
+	uint64_t head;
+	size_t mask;
+
+	/** The thread number written into each record */
+	uint32_t tid;
+
+	/** If true, the thread has exited and the ring may be taken over */
+	bool exited;
+
+	LIST_ENTRY(pn_trace_ring) entries;
+
+	struct pn_trace_record rec[];
+};
+
+/** If nonzero, trace records are written */
+int TRACE_ENABLED;
+
+/** The number of records in a new ring */
+static size_t TRACE_SIZE = 65536;
+
+/** All rings, protected by TRACE_MUTEX */
+static LIST_HEAD(, pn_trace_ring) TRACE_RINGS = LIST_HEAD_INITIALIZER(TRACE_RINGS);
+static uint32_t TRACE_THREADS;
+static pthread_mutex_t TRACE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t TRACE_KEY;
+static pthread_once_t TRACE_ONCE = PTHREAD_ONCE_INIT;
+
+/** The ring of the current thread */
+static __thread struct pn_trace_ring *TRACE_SELF;
+
+
+/* Leave the ring of an exiting thread for the next new one */
+static void
+trace_exit(void *arg)
+{
+	struct pn_trace_ring *r = arg;
+
+	MUTEX_LOCK(TRACE_MUTEX);
+	r->exited = true;
+	MUTEX_UNLOCK(TRACE_MUTEX);
+
+	TRACE_SELF = NULL;
+}
+
+
+static void
+trace_init_once(void)
+{
+	if (pthread_key_create(&TRACE_KEY, trace_exit) != 0)
+		errx(1, "pthread_key_create(3) failed");
+}
+
+
+/*
+ * Get a ring for the current thread. The ring of a thread that has exited
+ * is taken over, and its oldest records are overwritten as usual.
+ */
+static struct pn_trace_ring *
+trace_ring(void)
+{
+	struct pn_trace_ring *r;
+	size_t size;
+
+	(void) pthread_once(&TRACE_ONCE, trace_init_once);
+
+	MUTEX_LOCK(TRACE_MUTEX);
+	LIST_FOREACH(r, &TRACE_RINGS, entries) {
+		if (r->exited)
+			break;
+	}
+	if (r == NULL) {
+		size = TRACE_SIZE;
+		if ((r = calloc(1, sizeof(*r) + size * sizeof(r->rec[0]))) == NULL) {
+			MUTEX_UNLOCK(TRACE_MUTEX);
+			warn("calloc(3)");
+			return NULL;
+		}
+		r->mask = size - 1;
+		LIST_INSERT_HEAD(&TRACE_RINGS, r, entries);
+	}
+	r->exited = false;
+	r->tid = ++TRACE_THREADS;
+	MUTEX_UNLOCK(TRACE_MUTEX);
+
+	if (pthread_setspecific(TRACE_KEY, r) != 0)
+		errx(1, "pthread_setspecific(3) failed");
+
+	TRACE_SELF = r;
+	return r;
+}
+
+
+/**
+ * Write a trace record to the ring of the current thread.
+ *
+ * Use the PN_TRACE() macro instead, which does nothing unless tracing
+ * has been started.
+ */
+void
+pn_trace_write(int type, const struct watch *watch, void (*func)(void *), int mask)
+{
+	struct pn_trace_ring *r = TRACE_SELF;
+	struct pn_trace_record *rec;
+
+	if (r == NULL && (r = trace_ring()) == NULL)
+		return;
+
+	rec = &r->rec[r->head & r->mask];
+	rec->ts = pn_time_ns();
+	rec->tid = r->tid;
+	rec->type = type;
+	rec->mask = mask;
+	if (watch != NULL) {
+		rec->id = (uintptr_t) watch;
+		rec->wtype = watch->type;
+		rec->ident = watch->ident;
+	} else {
+		rec->id = (uintptr_t) func;
+		rec->wtype = -1;
+		rec->ident = -1;
+	}
+
+	/* Publish the record */
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+
+int
+pnotify_trace_start(size_t records)
+{
+	size_t size = TRACE_MIN;
+
+	if (records > ((size_t) 1 << 30)) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (size < records)
+		size <<= 1;
+
+	MUTEX_LOCK(TRACE_MUTEX);
+	TRACE_SIZE = size;
+	MUTEX_UNLOCK(TRACE_MUTEX);
+
+	__atomic_store_n(&TRACE_ENABLED, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+void
+pnotify_trace_stop(void)
+{
+	__atomic_store_n(&TRACE_ENABLED, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Copy the records of a ring that have not been overwritten. Returns the number copied. */
+static size_t
+trace_copy(struct pn_trace_ring *r, struct pn_trace_record *buf)
+{
+	uint64_t head, first, i;
+	size_t size = r->mask + 1;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	first = (head > size) ? head - size : 0;
+	for (i = first; i < head; i++)
+		buf[i - first] = r->rec[i & r->mask];
+
+	/*
+	 * The writer may have overwritten the oldest records while they were
+	 * copied, including the one it is writing now.
+	 */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	i = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	if (i + 1 > first + size) {
+		i = i + 1 - size;
+		if (i >= head)
+			return 0;
+		memmove(buf, buf + (i - first), (head - i) * sizeof(*buf));
+		first = i;
+	}
+
+	return head - first;
+}
+
+
+int
+pnotify_trace_dump(const char *path)
+{
+	struct pn_trace_header hdr;
+	struct pn_trace_record *buf = NULL;
+	struct pn_trace_ring *r;
+	size_t n, max = 0;
+	FILE *f;
+	int rv = -1;
+
+	if ((f = fopen(path, "w")) == NULL) {
+		warn("fopen(3) of `%s'", path);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PN_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = PN_TRACE_VERSION;
+	hdr.record_size = sizeof(struct pn_trace_record);
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto out;
+
+	MUTEX_LOCK(TRACE_MUTEX);
+	LIST_FOREACH(r, &TRACE_RINGS, entries)
+		max = MAX(max, r->mask + 1);
+	if (max > 0 && (buf = malloc(max * sizeof(*buf))) == NULL) {
+		MUTEX_UNLOCK(TRACE_MUTEX);
+		warn("malloc(3)");
+		goto out;
+	}
+	LIST_FOREACH(r, &TRACE_RINGS, entries) {
+		n = trace_copy(r, buf);
+		if (n > 0 && fwrite(buf, sizeof(*buf), n, f) != n) {
+			MUTEX_UNLOCK(TRACE_MUTEX);
+			goto out;
+		}
+	}
+	MUTEX_UNLOCK(TRACE_MUTEX);
+	rv = 0;
+
+out:
+	if (rv < 0)
+		warn("unable to write `%s'", path);
+	if (fclose(f) != 0 && rv == 0) {
+		warn("fclose(3) of `%s'", path);
+		rv = -1;
+	}
+	free(buf);
+	return rv;
+}
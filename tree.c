@@ -0,0 +1,388 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  The state of a directory tree, shared by the polling fallback
+ *  (poll.c) and snapshots (snapshot.c).
+ *
+ *  Both keep the tree as a struct pn_tree, read each directory into a
+ *  table of records sorted by name, and compare it with the same
+ *  directory in an older tree by walking the two sorted tables together.
+ *  The layout of the tables is also the layout of a snapshot file, so a
+ *  snapshot can be used in place once it is mapped into memory.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The string table of the directory being sorted by tree_namecmp() */
+static __thread const char *TREE_SORT_STR;
+
+
+/* Join a relative pathname and a filename */
+int
+pn_tree_join(char *buf, size_t bufsz, const char *dir, const char *name)
+{
+	size_t len;
+
+	if (dir[0] == '\0')
+		len = snprintf(buf, bufsz, "%s", name);
+	else
+		len = snprintf(buf, bufsz, "%s/%s", dir, name);
+
+	return (len >= bufsz) ? -1 : 0;
+}
+
+
+/*
+ * Compare two relative pathnames one component at a time.
+ *
+ * This is the order that a depth-first walk visits directories when the
+ * entries of each directory are sorted with strcmp(3).
+ */
+int
+pn_tree_pathcmp(const char *a, const char *b)
+{
+	unsigned char ca, cb;
+
+	for (;; a++, b++) {
+		ca = (*a == '/') ? 1 : (unsigned char) *a;
+		cb = (*b == '/') ? 1 : (unsigned char) *b;
+		if (ca != cb || ca == '\0')
+			return (ca - cb);
+	}
+}
+
+
+/*
+ * Get the metadata of a directory entry.
+ *
+ * Only the fields that are compared are requested, which lets a network
+ * filesystem avoid fetching the rest.
+ */
+int
+pn_tree_stat(int dfd, const char *name, struct pn_tree_rec *rec)
+{
+#if defined(__linux__) && defined(STATX_INO)
+	struct statx stx;
+
+	if (statx(dfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+			STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME,
+			&stx) < 0)
+		return -1;
+	rec->ino = stx.stx_ino;
+	rec->mtime = (int64_t) stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+	rec->size = stx.stx_size;
+	rec->mode = stx.stx_mode;
+#else
+	struct stat sb;
+
+	if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	rec->ino = sb.st_ino;
+	rec->mtime = (int64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+	rec->size = sb.st_size;
+	rec->mode = sb.st_mode;
+#endif
+
+	return 0;
+}
+
+
+/**
+ * Compare two records for the same name.
+ *
+ * @return the events that describe the change, or zero if there is none
+ */
+int
+pn_tree_changed(const struct pn_tree_rec *old, const struct pn_tree_rec *cur)
+{
+	if (cur->ino != old->ino)
+		return (PN_DELETE | PN_CREATE);
+	if (!S_ISDIR(cur->mode) &&
+			(cur->size != old->size || cur->mtime != old->mtime))
+		return (PN_MODIFY);
+	if (cur->mode != old->mode)
+		return (PN_ATTRIB);
+
+	return 0;
+}
+
+
+/* Return a string from the string table, which ends with a NUL byte */
+const char *
+pn_tree_str(const struct pn_tree *t, uint32_t off)
+{
+	return (off < t->strlen) ? t->str + off : "";
+}
+
+
+/* Add a string to the string table, and return its offset */
+uint32_t
+pn_tree_string(struct pn_tree *t, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	uint32_t off;
+	char *tmp;
+
+	while (t->strlen + len > t->strsz) {
+		t->strsz = (t->strsz == 0) ? 4096 : t->strsz * 2;
+		if ((tmp = realloc(t->str, t->strsz)) == NULL)
+			err(1, "realloc(3)");
+		t->str = tmp;
+	}
+	off = t->strlen;
+	memcpy(t->str + off, s, len);
+	t->strlen += len;
+
+	return off;
+}
+
+
+/* Make room for another record, and return it */
+static struct pn_tree_rec *
+tree_add_rec(struct pn_tree *t)
+{
+	void *tmp;
+
+	if (t->nrecs == t->recsz) {
+		t->recsz = (t->recsz == 0) ? 256 : t->recsz * 2;
+		if ((tmp = realloc(t->rec, t->recsz * sizeof(*t->rec))) == NULL)
+			err(1, "realloc(3)");
+		t->rec = tmp;
+	}
+
+	return &t->rec[t->nrecs++];
+}
+
+
+/**
+ * Add a directory, whose records are the ones appended after it.
+ * The caller sets the count once they have been added.
+ *
+ * @return the index of the directory
+ */
+size_t
+pn_tree_add_dir(struct pn_tree *t, const char *rel)
+{
+	void *tmp;
+	size_t di;
+
+	if (t->ndirs == t->dirsz) {
+		t->dirsz = (t->dirsz == 0) ? 64 : t->dirsz * 2;
+		if ((tmp = realloc(t->dir, t->dirsz * sizeof(*t->dir))) == NULL)
+			err(1, "realloc(3)");
+		t->dir = tmp;
+	}
+	di = t->ndirs++;
+	memset(&t->dir[di], 0, sizeof(t->dir[di]));
+	t->dir[di].path = pn_tree_string(t, rel);
+	t->dir[di].first = t->nrecs;
+
+	return di;
+}
+
+
+/* Copy some of the records of another tree, with their names */
+void
+pn_tree_append(struct pn_tree *t, const struct pn_tree *src, size_t first, size_t count)
+{
+	struct pn_tree_rec *rec;
+	size_t i;
+
+	for (i = first; i < first + count; i++) {
+		rec = tree_add_rec(t);
+		*rec = src->rec[i];
+		rec->name = pn_tree_string(t, pn_tree_str(src, src->rec[i].name));
+	}
+}
+
+
+static int
+tree_namecmp(const void *a, const void *b)
+{
+	return strcmp(TREE_SORT_STR + ((const struct pn_tree_rec *) a)->name,
+			TREE_SORT_STR + ((const struct pn_tree_rec *) b)->name);
+}
+
+
+/*
+ * Read the entries of a directory into an empty tree, as records sorted
+ * by name. Entries that vanish before they can be examined are skipped.
+ */
+void
+pn_tree_readdir(DIR *dirp, struct pn_tree *t)
+{
+	struct pn_tree_rec *rec;
+	struct dirent *ent;
+
+	while ((ent = readdir(dirp)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		rec = tree_add_rec(t);
+		if (pn_tree_stat(dirfd(dirp), ent->d_name, rec) < 0) {
+			t->nrecs--;
+			continue;
+		}
+		rec->name = pn_tree_string(t, ent->d_name);
+	}
+	TREE_SORT_STR = t->str;
+	qsort(t->rec, t->nrecs, sizeof(*t->rec), tree_namecmp);
+}
+
+
+/* Find a directory */
+const struct pn_tree_dir *
+pn_tree_find_dir(const struct pn_tree *t, const char *rel)
+{
+	const struct pn_tree_dir *d;
+	size_t lo = 0, hi = t->ndirs, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		d = &t->dir[mid];
+		cmp = pn_tree_pathcmp(rel, pn_tree_str(t, d->path));
+		if (cmp == 0)
+			return ((uint64_t) d->first + d->count <= t->nrecs) ? d : NULL;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+
+/* Add an event for a pathname relative to the root of the tree */
+void
+pn_tree_emit(struct watch *watch, const char *root, const char *rel, int mask)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/%s", root, rel) < sizeof(path))
+		pn_event_add_path(watch, mask, path);
+}
+
+
+/**
+ * Report everything beneath a directory that was removed.
+ *
+ * @return the number of events
+ */
+int
+pn_tree_delete(const struct pn_tree *t, struct watch *watch, const char *root,
+		const char *rel)
+{
+	const struct pn_tree_dir *d;
+	const struct pn_tree_rec *rec;
+	char child[PATH_MAX];
+	int changes = 0;
+	uint32_t i;
+
+	if ((d = pn_tree_find_dir(t, rel)) == NULL)
+		return 0;
+	for (i = 0; i < d->count; i++) {
+		rec = &t->rec[d->first + i];
+		if (pn_tree_join(child, sizeof(child), rel, pn_tree_str(t, rec->name)) < 0)
+			continue;
+		if (S_ISDIR(rec->mode))
+			changes += pn_tree_delete(t, watch, root, child);
+		pn_tree_emit(watch, root, child, PN_DELETE);
+		changes++;
+	}
+
+	return changes;
+}
+
+
+/**
+ * Start walking the entries of a directory, as read by pn_tree_readdir(),
+ * together with its records in an older tree.
+ *
+ * @param dir the directory in @a old, or NULL if it is new
+ */
+void
+pn_tree_merge_init(struct pn_tree_merge *m, const struct pn_tree *old,
+		const struct pn_tree_dir *dir, const struct pn_tree *cur)
+{
+	m->old = old;
+	m->dir = dir;
+	m->cur = cur;
+	m->i = m->j = 0;
+}
+
+
+/**
+ * Get the next name from either directory. @a old is NULL for a new
+ * entry, and @a cur is NULL for an entry that has been removed.
+ *
+ * @return false once both directories have been walked
+ */
+bool
+pn_tree_merge_next(struct pn_tree_merge *m, const char **name,
+		const struct pn_tree_rec **old, const struct pn_tree_rec **cur)
+{
+	size_t ocount = (m->dir != NULL) ? m->dir->count : 0;
+	const char *oname, *cname;
+	int cmp;
+
+	*cur = (m->i < m->cur->nrecs) ? &m->cur->rec[m->i] : NULL;
+	*old = (m->j < ocount) ? &m->old->rec[m->dir->first + m->j] : NULL;
+	if (*cur == NULL && *old == NULL)
+		return false;
+
+	cname = (*cur != NULL) ? pn_tree_str(m->cur, (*cur)->name) : NULL;
+	oname = (*old != NULL) ? pn_tree_str(m->old, (*old)->name) : NULL;
+	if (*cur == NULL)
+		cmp = 1;
+	else if (*old == NULL)
+		cmp = -1;
+	else
+		cmp = strcmp(cname, oname);
+
+	if (cmp < 0)
+		*old = NULL;
+	if (cmp > 0)
+		*cur = NULL;
+	if (cmp <= 0)
+		m->i++;
+	if (cmp >= 0)
+		m->j++;
+	*name = (cmp <= 0) ? cname : oname;
+
+	return true;
+}
+
+
+/* Free the tables of a tree that owns them */
+void
+pn_tree_free(struct pn_tree *t)
+{
+	free(t->dir);
+	free(t->rec);
+	free(t->str);
+	memset(t, 0, sizeof(*t));
+}
@@ -0,0 +1,182 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  Events posted by the application (WATCH_USER).
+ *
+ *  Each post adds its value to a counter. Only the first post after the
+ *  callback has started wakes up the event loop, by writing to an eventfd
+ *  in the epoll set; later posts just add to the counter, without making
+ *  a system call. The callback receives the sum of all the values that
+ *  were posted since it last ran.
+ *
+ *  A backend without an eventfd that it polls, such as kqueue or the
+ *  simulated backend, wakes up the watch with its post function instead.
+ *
+ *  The state is reference counted (see ref.c), and the eventfd is closed
+ *  with it, so a post or a wakeup that races with watch_cancel() never
+ *  uses a descriptor that has been closed and reused. This includes the
+ *  posts made for the done watch of a task after the task returns.
+ */
+
+#if defined(__linux__)
+# include <sys/eventfd.h>
+#endif
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** The state of a WATCH_USER watch */
+struct pn_user {
+
+	/** The reference count */
+	struct pn_ref ref;
+
+	/** The eventfd, or -1 if the events are added to the queue directly */
+	int fd;
+
+	/** The sum of the values posted since the callback last ran */
+	uint64_t counter;
+
+	/** If true, a wakeup has been sent and not yet handled */
+	int pending;
+};
+
+
+/* Free the state after the last reference is dropped */
+static void
+user_release(void *arg)
+{
+	struct pn_user *u = arg;
+
+	if (u->fd >= 0)
+		(void) close(u->fd);
+	free(u);
+}
+
+
+/**
+ * Set up a WATCH_USER watch. Under Linux, this creates the eventfd.
+ */
+int
+pn_user_open(struct watch *watch)
+{
+	struct pn_user *u;
+
+	if ((u = calloc(1, sizeof(*u))) == NULL) {
+		warn("calloc(3)");
+		return -1;
+	}
+	u->fd = -1;
+
+#if defined(__linux__)
+	if ((u->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		warn("eventfd(2)");
+		free(u);
+		return -1;
+	}
+	watch->ident = u->fd;
+#endif
+	pn_ref_init(&u->ref, user_release);
+	watch->priv = u;
+
+	return 0;
+}
+
+
+/**
+ * Handle a wakeup for a WATCH_USER watch.
+ *
+ * This is called by a worker thread instead of the callback.
+ */
+void
+pn_user_dispatch(struct watch *watch, int mask)
+{
+	struct pn_user *u = __atomic_load_n(&watch->priv, __ATOMIC_ACQUIRE);
+	uint64_t value;
+
+	/* The watch has been cancelled; the event still holds the state */
+	if (u == NULL)
+		return;
+
+	/* Reset the eventfd, so that the next wakeup is reported */
+	if (u->fd >= 0)
+		(void) read(u->fd, &value, sizeof(value));
+
+	/*
+	 * Posts that see pending cleared will send another wakeup, so none
+	 * of the values added after this point can be lost.
+	 */
+	__atomic_store_n(&u->pending, 0, __ATOMIC_SEQ_CST);
+	value = __atomic_exchange_n(&u->counter, 0, __ATOMIC_SEQ_CST);
+
+	/* The value was already taken by the previous wakeup */
+	if (value == 0)
+		return;
+
+	watch->cb(watch, value, watch->arg);
+}
+
+
+/**
+ * Release the reference of the watch. The eventfd stays open until the
+ * queued events and any posts that are running have finished with it.
+ */
+void
+pn_user_close(struct watch *watch)
+{
+	pn_ref_put(pn_ref_clear(&watch->priv));
+}
+
+
+int
+pnotify_post(struct watch *watch, uint64_t value)
+{
+	struct pn_user *u;
+	uint64_t one = 1;
+	int rv = 0;
+
+	if (watch->type != WATCH_USER || value == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The watch has been cancelled */
+	if ((u = pn_ref_get(&watch->priv)) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	(void) __atomic_add_fetch(&u->counter, value, __ATOMIC_SEQ_CST);
+
+	/* A wakeup is already on its way */
+	if (__atomic_exchange_n(&u->pending, 1, __ATOMIC_SEQ_CST) != 0)
+		goto out;
+
+	if (sys->post != NULL) {
+		sys->post(watch);
+	} else if (write(u->fd, &one, sizeof(one)) < 0) {
+		__atomic_store_n(&u->pending, 0, __ATOMIC_SEQ_CST);
+		rv = -1;
+	}
+
+out:
+	pn_ref_put(u);
+	return rv;
+}
@@ -0,0 +1,482 @@
+/*		$Id: $		*/
+
+/*
+ * Copyright (c) 2007 Mark Heily <devel@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ *  The worker thread pool.
+ *
+ *  Events from the kernel are put on the global event queues, one for
+ *  each priority, and are taken before tasks for up to PN_PRIO_BURST in
+ *  a row. Tasks
+ *  submitted with pnotify_submit() go to a per-worker inbox instead,
+ *  which is a lock-free stack: submitting is a single compare-and-swap,
+ *  and the owner takes the whole stack with one atomic exchange. A worker
+ *  with nothing to do takes the inbox of another worker before sleeping.
+ *  Tasks pinned to a worker go to a second stack that only the owner
+ *  takes, so that they run one at a time and in the order submitted.
+ *
+ *  Each worker sleeps on its own condition variable, and the idle workers
+ *  are kept in a list so that a submitter can wake the worker it chose.
+ *  When no worker is idle, submitting does not take any lock.
+ *
+ *  If pnotify_spin_limit() has been called, a worker polls the queues for
+ *  a while before it goes on the idle list. Spinning workers are not on
+ *  the list, so they are never signalled; whoever queues work wakes a
+ *  sleeping worker as usual, and the spinning one usually gets there first.
+ */
+
+#include "pnotify.h"
+#include "pnotify-internal.h"
+
+/** All worker threads */
+struct pn_worker *WORKER;
+size_t WORKER_COUNT = 0;
+
+/** The workers that are waiting for something to do, protected by EVENT_MUTEX */
+static LIST_HEAD(, pn_worker) IDLE = LIST_HEAD_INITIALIZER(IDLE);
+static unsigned int IDLE_COUNT;
+
+/** The worker that an unpinned task is given to next */
+static unsigned int NEXT_WORKER;
+
+/** The worker structure of the current thread */
+static __thread struct pn_worker *WORKER_SELF;
+
+/** The longest time that an idle worker spins, in ns, or 0 to not spin */
+static uint64_t SPIN_MAX;
+
+/** The shortest spin, so that a worker whose spins failed can still adapt */
+#define SPIN_MIN	1000
+
+
+/* Remove a worker from the idle list. The caller must hold EVENT_MUTEX. */
+static void
+worker_unpark(struct pn_worker *w)
+{
+	LIST_REMOVE(w, entries);
+	w->idle = false;
+	(void) __atomic_sub_fetch(&IDLE_COUNT, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * Wake up an idle worker, preferably @a target.
+ *
+ * The caller must hold EVENT_MUTEX.
+ */
+void
+pn_worker_wake_locked(struct pn_worker *target)
+{
+	struct pn_worker *w;
+
+	w = (target != NULL && target->idle) ? target : LIST_FIRST(&IDLE);
+	if (w == NULL)
+		return;
+	worker_unpark(w);
+	(void) pthread_cond_signal(&w->cond);
+}
+
+
+/** Get the number of idle workers */
+size_t
+pn_worker_idle(void)
+{
+	return __atomic_load_n(&IDLE_COUNT, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Wake up an idle worker, preferably @a target, if there are any.
+ */
+void
+pn_worker_wake(struct pn_worker *target)
+{
+	if (__atomic_load_n(&IDLE_COUNT, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	MUTEX_LOCK(EVENT_MUTEX);
+	pn_worker_wake_locked(target);
+	MUTEX_UNLOCK(EVENT_MUTEX);
+}
+
+
+/* Wake up a worker only if it is idle, for tasks that no other worker takes */
+static void
+worker_wake_only(struct pn_worker *w)
+{
+	if (__atomic_load_n(&IDLE_COUNT, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	MUTEX_LOCK(EVENT_MUTEX);
+	if (w->idle) {
+		worker_unpark(w);
+		(void) pthread_cond_signal(&w->cond);
+	}
+	MUTEX_UNLOCK(EVENT_MUTEX);
+}
+
+
+/* Add a chain of tasks, linked from @a first to @a last, to an inbox */
+static void
+inbox_push(struct event **inbox, struct event *first, struct event *last)
+{
+	struct event *head;
+
+	head = __atomic_load_n(inbox, __ATOMIC_RELAXED);
+	do {
+		last->next = head;
+	} while (!__atomic_compare_exchange_n(inbox, &head, first, true,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Take every task from an inbox. The first one is returned, and the rest
+ * are kept by the calling thread in submission order.
+ */
+static struct event *
+inbox_take(struct event **inbox, struct pn_worker *self)
+{
+	struct event *evp, *next, *rev = NULL;
+
+	if (__atomic_load_n(inbox, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+	evp = __atomic_exchange_n(inbox, NULL, __ATOMIC_ACQUIRE);
+
+	/* The inbox is last-in first-out */
+	while (evp != NULL) {
+		next = evp->next;
+		evp->next = rev;
+		rev = evp;
+		evp = next;
+	}
+	if (rev != NULL)
+		self->local = rev->next;
+
+	return rev;
+}
+
+
+/* Check if any events are waiting. The caller must hold EVENT_MUTEX. */
+static bool
+event_pending(int level)
+{
+	for (; level < PN_PRIO_COUNT; level++) {
+		if (!STAILQ_EMPTY(&EVENT[level]))
+			return true;
+	}
+
+	return false;
+}
+
+
+/* Remove the next event from the highest priority queue that has one */
+static struct event *
+event_shift(void)
+{
+	static unsigned int run[PN_PRIO_COUNT];
+	struct event *evp = NULL;
+	int i;
+
+	for (i = 0; i < PN_PRIO_COUNT; i++) {
+		if (__atomic_load_n(&STAILQ_FIRST(&EVENT[i]), __ATOMIC_RELAXED) != NULL)
+			break;
+	}
+	if (i == PN_PRIO_COUNT)
+		return NULL;
+
+	MUTEX_LOCK(EVENT_MUTEX);
+	for (i = 0; i < PN_PRIO_COUNT; i++) {
+		if (STAILQ_EMPTY(&EVENT[i]))
+			continue;
+
+		/* After a burst from this queue, a lower one gets a turn */
+		if (run[i] >= PN_PRIO_BURST && event_pending(i + 1)) {
+			run[i] = 0;
+			continue;
+		}
+		run[i]++;
+		evp = STAILQ_FIRST(&EVENT[i]);
+		STAILQ_REMOVE_HEAD(&EVENT[i], entries);
+		pn_event_removed_locked();
+		break;
+	}
+	MUTEX_UNLOCK(EVENT_MUTEX);
+
+	return evp;
+}
+
+
+/* Take a task from this worker, or from another one */
+static struct event *
+task_take(struct pn_worker *self)
+{
+	struct event *evp;
+	size_t i, victim;
+
+	if ((evp = self->local) != NULL) {
+		self->local = evp->next;
+		return evp;
+	}
+	if (self->index >= 0 && ((evp = inbox_take(&self->pinned, self)) != NULL ||
+			(evp = inbox_take(&self->inbox, self)) != NULL))
+		return evp;
+
+	/* Pinned tasks are left to their worker */
+	for (i = 1; i <= WORKER_COUNT; i++) {
+		victim = ((self->index >= 0) ? self->index + i : i) % WORKER_COUNT;
+		if ((evp = inbox_take(&WORKER[victim].inbox, self)) != NULL)
+			return evp;
+	}
+
+	return NULL;
+}
+
+
+/* Wait until there might be something to do */
+static void
+worker_park(struct pn_worker *self)
+{
+	bool work;
+	size_t i;
+
+	MUTEX_LOCK(EVENT_MUTEX);
+	LIST_INSERT_HEAD(&IDLE, self, entries);
+	self->idle = true;
+	(void) __atomic_add_fetch(&IDLE_COUNT, 1, __ATOMIC_SEQ_CST);
+
+	/* Look again, now that submitters can see that this worker is idle */
+	work = event_pending(0) ||
+		(__atomic_load_n(&self->pinned, __ATOMIC_SEQ_CST) != NULL);
+	for (i = 0; !work && i < WORKER_COUNT; i++)
+		work = (__atomic_load_n(&WORKER[i].inbox, __ATOMIC_SEQ_CST) != NULL);
+
+	while (!work && self->idle) {
+		if (pthread_cond_wait(&self->cond, &EVENT_MUTEX) != 0) {
+			warn("pthread_cond_wait(3) failed");
+			break;
+		}
+	}
+	if (self->idle)
+		worker_unpark(self);
+	MUTEX_UNLOCK(EVENT_MUTEX);
+}
+
+
+/*
+ * Poll the queues for up to the spin time of the worker, and adapt the
+ * spin time to whether that found anything.
+ */
+static struct event *
+worker_spin(struct pn_worker *self, uint64_t max)
+{
+	struct pnotify_stats *st;
+	struct event *evp = NULL;
+	uint64_t start, now;
+	unsigned int i;
+
+	if (self->spin == 0 || self->spin > max)
+		self->spin = MIN(SPIN_MIN, max);
+
+	start = now = pn_time_ns();
+	for (i = 1; ; i++) {
+		if ((evp = event_shift()) != NULL || (evp = task_take(self)) != NULL)
+			break;
+		PN_CPU_RELAX();
+
+		/* Reading the clock costs more than a pause */
+		if (i % 64 == 0 && (now = pn_time_ns()) - start >= self->spin)
+			break;
+	}
+	if (evp != NULL) {
+		now = pn_time_ns();
+		self->spin = MIN(self->spin * 2, max);
+	} else {
+		self->spin = MAX(self->spin / 2, MIN(SPIN_MIN, max));
+	}
+
+	st = PN_STATS();
+	PN_STAT_ADD(st->spins, 1);
+	PN_STAT_ADD(st->spin_hits, evp != NULL);
+	PN_STAT_ADD(st->spin_ns, now - start);
+
+	return evp;
+}
+
+
+int
+pnotify_spin_limit(uint64_t max_ns)
+{
+	/* Spinning for longer than a second would be a mistake */
+	if (max_ns > 1000000000) {
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_store_n(&SPIN_MAX, max_ns, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+/* Get the worker structure of the current thread */
+static struct pn_worker *
+worker_self(void)
+{
+	struct pn_worker *w;
+
+	if (WORKER_SELF != NULL)
+		return WORKER_SELF;
+
+	/* A thread outside the pool that calls event_dispatch() */
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		err(1, "calloc(3)");
+	w->index = -1;
+	if (pthread_cond_init(&w->cond, NULL) != 0)
+		errx(1, "pthread_cond_init(3) failed");
+	WORKER_SELF = w;
+
+	return w;
+}
+
+
+struct event *
+event_wait(void)
+{
+	struct pn_worker *self = worker_self();
+	struct event *evp;
+	uint64_t max;
+
+	for (;;) {
+		/* Events come before tasks, but not for more than a burst */
+		if (self->streak < PN_PRIO_BURST && (evp = event_shift()) != NULL) {
+			self->streak++;
+			return evp;
+		}
+		self->streak = 0;
+
+		if ((evp = task_take(self)) != NULL)
+			return evp;
+		if ((evp = event_shift()) != NULL)
+			return evp;
+
+		max = __atomic_load_n(&SPIN_MAX, __ATOMIC_RELAXED);
+		if (max > 0 && (evp = worker_spin(self, max)) != NULL)
+			return evp;
+
+		worker_park(self);
+	}
+}
+
+
+static void *
+worker_main(void *arg)
+{
+	WORKER_SELF = arg;
+	event_dispatch();
+
+	return NULL;
+}
+
+
+/**
+ * Start @a count worker threads.
+ */
+void
+pn_worker_init(size_t count)
+{
+	size_t i;
+
+	if ((WORKER = calloc(count, sizeof(*WORKER))) == NULL)
+		err(1, "calloc(3)");
+	for (i = 0; i < count; i++) {
+		WORKER[i].index = i;
+		if (pthread_cond_init(&WORKER[i].cond, NULL) != 0)
+			errx(1, "pthread_cond_init(3) failed");
+	}
+
+	/* The count is published last, since submitters read it without a lock */
+	__atomic_store_n(&WORKER_COUNT, count, __ATOMIC_RELEASE);
+
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&WORKER[i].tid, NULL, worker_main, &WORKER[i]) != 0)
+			errx(1, "pthread_create(3) failed");
+	}
+}
+
+
+int
+pnotify_submit(void (*fn)(void *), void *arg, int worker, struct watch *done)
+{
+	return pnotify_submit_batch(fn, &arg, 1, worker, done);
+}
+
+
+int
+pnotify_submit_batch(void (*fn)(void *), void * const *args, size_t count,
+		int worker, struct watch *done)
+{
+	struct event *first, *last, *evp;
+	size_t nworkers, chunks, per, i, j, n;
+	struct pn_worker *w;
+	uint64_t now;
+
+	nworkers = __atomic_load_n(&WORKER_COUNT, __ATOMIC_ACQUIRE);
+	if (fn == NULL || nworkers == 0 ||
+			(done != NULL && done->type != WATCH_USER)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* An unpinned batch is spread over the workers, one push per inbox */
+	chunks = (worker >= 0) ? 1 : MIN(count, nworkers);
+	per = (chunks > 0) ? (count + chunks - 1) / chunks : 0;
+	now = pn_time_ns();
+	PN_STAT_ADD(PN_STATS()->tasks_submitted, count);
+
+	for (i = 0; i < count; i += n) {
+		n = MIN(per, count - i);
+
+		/* Link the chain newest-first, since the inbox is a stack */
+		first = last = NULL;
+		for (j = 0; j < n; j++) {
+			if ((evp = calloc(1, sizeof(*evp))) == NULL)
+				err(1, "calloc(3)");
+			evp->func = fn;
+			evp->arg = args[i + j];
+			evp->done = done;
+			evp->enqueued = now;
+			PN_TRACE(PN_TRACE_ENQUEUE, NULL, fn, 0);
+			evp->next = first;
+			first = evp;
+			if (last == NULL)
+				last = evp;
+		}
+
+		if (worker >= 0) {
+			w = &WORKER[worker % nworkers];
+			inbox_push(&w->pinned, first, last);
+			worker_wake_only(w);
+		} else {
+			w = &WORKER[__atomic_fetch_add(&NEXT_WORKER, 1, __ATOMIC_RELAXED) % nworkers];
+			inbox_push(&w->inbox, first, last);
+			pn_worker_wake(w);
+		}
+	}
+
+	return 0;
+}